@@ -0,0 +1,72 @@
+#ifndef BACKUP_STORE_H
+#define BACKUP_STORE_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Two-tier backup store: the newest versions of every file stay as raw
+// copies in backups/ (written on the hot path by backupFile), older ones are
+// recompressed in the background into "<version>.fmz" files.
+
+#define BACKUP_COMPRESSED_SUFFIX ".fmz"
+#define BACKUP_DICTIONARY_DIR "backups/.dict"
+
+struct CompactorOptions {
+    size_t hotVersions = 3;                     // raw versions kept per file
+    std::chrono::seconds interval{60};          // pause between scans
+    int compressionLevel = 1;                   // zlib level, 1 = fastest
+    size_t dictionarySize = 32 * 1024;          // zlib's window size is the useful maximum
+    size_t samplesPerType = 32;                 // files sampled to train a dictionary
+};
+
+struct CompactorStats {
+    uint64_t filesCompressed = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    double busySeconds = 0;                     // time spent compressing
+
+    double ratio() const { return bytesOut ? double(bytesIn) / double(bytesOut) : 0; }
+    double throughputMBs() const { return busySeconds > 0 ? bytesIn / busySeconds / (1024 * 1024) : 0; }
+};
+
+// Background recompression of cold versions at idle CPU and IO priority
+class BackupCompactor {
+public:
+    explicit BackupCompactor(CompactorOptions options = CompactorOptions());
+    ~BackupCompactor();
+
+    void start();
+    void stop();
+    // One pass over backups/; also usable without the background thread
+    void runOnce();
+    CompactorStats stats() const;
+
+private:
+    CompactorOptions options;
+    std::thread worker;
+    std::atomic<bool> running;
+    mutable std::mutex mtx;
+    std::condition_variable wake;
+    CompactorStats totals;
+
+    void workerLoop();
+    bool compressVersion(const std::string& rawPath, const std::vector<std::string>& samplePaths);
+};
+
+// Trains a preset dictionary from sample files: chunks that recur in several
+// samples are kept, the most common ones last (closest to the data in zlib's window)
+std::string trainDictionary(const std::vector<std::string>& samplePaths, size_t dictionarySize);
+
+// Dictionary file a compressed version was written with, empty if it has none
+std::string backupDictionaryPath(const std::string& compressedPath);
+
+// Writes a backup version to destination, decompressing .fmz versions as a stream
+bool restoreBackup(const std::string& backupPath, const std::string& destination);
+
+#endif // BACKUP_STORE_H
@@ -0,0 +1,90 @@
+#ifndef BURST_SNAPSHOT_H
+#define BURST_SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "ChangeJournal.h"
+
+// Burst mode for the backup subscriber. When git checkout, a package upgrade
+// or a deploy changes thousands of files under one directory, per-event
+// copies cannot keep up. Once the event rate under a directory crosses the
+// threshold, its events are collected instead of copied. When the directory
+// goes quiet, the collected set is copied in parallel into one snapshot with
+// one timestamp and one change record per file.
+
+#define BURST_SNAPSHOT_DIR "backups/snapshots"
+// One "<source>\t<copy>\n" line per copied file. Backslashes, tabs and
+// newlines in paths are written as \\, \t and \n.
+#define BURST_MANIFEST_NAME "MANIFEST"
+
+struct BurstOptions {
+    size_t threshold = 200;                       // events per window under one directory
+    std::chrono::milliseconds window{1000};
+    std::chrono::milliseconds quietPeriod{500};   // no events for this long ends the burst
+    std::chrono::milliseconds maxDuration{5000};  // snapshot a burst that never goes quiet
+    size_t copyThreads = 4;
+    size_t maxRootDepth = 3;      // directories above a file's own that may become its burst root
+    double maxChildShare = 0.9;   // a root whose count is mostly one child's is left to that child
+};
+
+class BurstSnapshotter {
+public:
+    // Called once per absorbed event after its snapshot; backupPath is empty if the copy failed
+    using CompletionCallback = std::function<void(uint64_t eventId, const std::string& backupPath)>;
+
+    BurstSnapshotter(ChangeJournal& changes, CompletionCallback onComplete, BurstOptions options = BurstOptions());
+    ~BurstSnapshotter();
+
+    // Counts the event against the directories above filePath, up to the
+    // deepest rule root containing it or maxRootDepth levels, whichever is
+    // nearer; outside every rule root only against its own directory.
+    // Returns true when the file belongs to an active burst and will be in
+    // its snapshot.
+    bool absorb(const std::string& filePath, int64_t timestampNs, uint64_t eventId);
+
+    // Rule roots bound burst roots from above, so "/" or $HOME never becomes one
+    void setRoots(const std::vector<std::string>& roots);
+
+    void start();
+    // Snapshots every pending burst before returning
+    void stop();
+
+private:
+    struct RateWindow {
+        int64_t windowStartNs = 0;
+        size_t count = 0;
+    };
+
+    struct Burst {
+        std::string root;
+        int64_t startNs = 0;
+        int64_t lastEventNs = 0;
+        std::unordered_map<std::string, std::vector<uint64_t>> files;  // path -> absorbed event ids
+    };
+
+    ChangeJournal& changes;
+    CompletionCallback onComplete;
+    BurstOptions options;
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::unordered_map<std::string, RateWindow> rates;   // per directory and per changed file
+    std::vector<std::string> roots;                      // absolute, without trailing '/'
+    std::unordered_map<std::string, Burst> bursts;       // active, by root directory
+    std::atomic<bool> running;
+    std::thread worker;
+
+    size_t rootDepthLimit(const std::string& filePath) const;
+    void workerLoop();
+    std::vector<Burst> takeFinished(int64_t nowNs, bool all);
+    void snapshot(const Burst& burst);
+};
+
+#endif // BURST_SNAPSHOT_H
@@ -0,0 +1,100 @@
+#ifndef CHANGE_JOURNAL_H
+#define CHANGE_JOURNAL_H
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <ostream>
+#include <chrono>
+#include <cstdint>
+#include <climits>
+
+// Binary replacement for the text changes.log. Changes are appended to
+// time-partitioned segment files (one per hour by default) under changes/:
+//
+//   paths.dat         path dictionary, {u32 length, bytes} per path id
+//   seg-<start>.dat   records {i64 timeNs, u32 pathId, u16 kind, u16 backupLength, backup}
+//   seg-<start>.idx   record offsets in time order, then (pathId, ordinal)
+//                     pairs sorted by path id; written when a segment is
+//                     sealed and covering a prefix of it
+//
+// Queries mmap only the segments overlapping their time range and use the
+// indexes to jump to matching records; --export-changes prints the old text format.
+
+#define CHANGE_JOURNAL_DEFAULT_DIR "changes"
+
+enum class ChangeKind : uint16_t {
+    Backup = 1,     // a version copied by backupFile
+    Snapshot = 2,   // a file copied into a burst snapshot
+};
+
+struct ChangeJournalOptions {
+    bool enabled = true;                         // false keeps appending text to changes.log
+    std::string directory = CHANGE_JOURNAL_DEFAULT_DIR;
+    std::chrono::seconds segmentDuration{3600};
+};
+
+// Writer for one journal directory. Each FileMonitor owns its own, so
+// embedded instances never close or take over each other's journal; a
+// second writer for the same directory is refused. While not open,
+// record() appends to the text changes.log instead.
+class ChangeJournal {
+public:
+    ChangeJournal() = default;
+    ~ChangeJournal();
+    ChangeJournal(const ChangeJournal&) = delete;
+    ChangeJournal& operator=(const ChangeJournal&) = delete;
+
+    bool open(const ChangeJournalOptions& options);
+    void close();  // seals the open segment with its index
+
+    // Records that filePath was copied to backupPath
+    bool record(const std::string& filePath, const std::string& backupPath, ChangeKind kind);
+
+    // fdatasyncs what record() has written (journal or changes.log)
+    void sync();
+
+private:
+    std::mutex mtx;
+    bool opened = false;
+    ChangeJournalOptions options;
+    int pathsFd = -1;                                  // flock()ed while open
+    std::unordered_map<std::string, uint32_t> pathIds;
+    int segmentFd = -1;
+    int64_t segmentStart = 0;                          // seconds
+    uint64_t segmentSize = 0;
+    std::vector<std::pair<uint64_t, uint32_t>> segmentRecords;   // offset, pathId of the open segment
+    int64_t lastTimeNs = 0;
+
+    void sealSegment();
+    bool openSegment(int64_t start);
+    bool pathId(const std::string& path, uint32_t& id);
+    void closeFiles();
+};
+
+struct ChangeQuery {
+    std::string prefix;              // path or directory prefix, empty = everything
+    int64_t fromNs = INT64_MIN;      // inclusive
+    int64_t toNs = INT64_MAX;        // exclusive
+    size_t limit = 0;                // 0 = no limit
+};
+
+struct ChangeEntry {
+    int64_t timeNs;
+    ChangeKind kind;
+    std::string_view path;           // valid during the callback only
+    std::string_view backupPath;
+};
+
+// Calls visit for matching changes in time order; returns how many matched,
+// or -1 if the journal directory cannot be read
+long long queryChanges(const std::string& directory, const ChangeQuery& query,
+                       const std::function<void(const ChangeEntry&)>& visit);
+
+// One line in the changes.log format
+void writeChangeLine(std::ostream& out, const ChangeEntry& entry);
+
+#endif // CHANGE_JOURNAL_H
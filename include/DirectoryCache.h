@@ -0,0 +1,87 @@
+#ifndef DIRECTORY_CACHE_H
+#define DIRECTORY_CACHE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+// Directory listings for the file browser. Each directory is read once with
+// getdents64 on a background thread that publishes entries in chunks while
+// it reads, and is kept until inotify reports a change in it.
+
+struct DirEntry {
+    std::string name;
+    char type;              // DT_DIR, DT_REG, DT_LNK or DT_UNKNOWN
+};
+
+// One directory's entries. entries only grows while loading, so indices stay
+// valid; order holds them sorted (directories first, then by name).
+// Lock mtx to read either vector.
+struct DirectoryListing {
+    std::string path;
+    std::mutex mtx;
+    std::vector<DirEntry> entries;
+    std::vector<uint32_t> order;
+    std::atomic<uint64_t> version{0};    // bumped after every published chunk
+    std::atomic<bool> complete{false};
+    std::atomic<bool> failed{false};
+    std::atomic<bool> stale{false};      // changed on disk since it was read
+    std::chrono::steady_clock::time_point loadedAt;
+};
+
+class DirectoryCache {
+public:
+    explicit DirectoryCache(size_t maxDirectories = 32);
+    ~DirectoryCache();
+
+    // Returns the listing for dir, starting a background load if it is not
+    // cached. A stale listing is returned until its replacement has loaded.
+    std::shared_ptr<DirectoryListing> get(const std::string& dir);
+
+    // Drains inotify without blocking and marks changed listings stale.
+    // Returns true if any listing was invalidated.
+    bool pollInvalidations();
+
+private:
+    struct CacheEntry {
+        std::shared_ptr<DirectoryListing> current;
+        std::shared_ptr<DirectoryListing> reloading;  // replacement being read
+        int wd = -1;
+        std::list<std::string>::iterator lruPosition;
+    };
+
+    size_t maxDirectories;
+    int inotifyFd;
+    std::unordered_map<std::string, CacheEntry> cache;
+    std::unordered_map<int, std::string> watchedDirs;
+    std::list<std::string> lru;                        // most recent first
+
+    std::mutex queueMtx;
+    std::condition_variable queueWake;
+    std::deque<std::shared_ptr<DirectoryListing>> queue;
+    bool stopping;
+    std::thread loader;
+
+    void schedule(const std::shared_ptr<DirectoryListing>& listing);
+    void loaderLoop();
+    void evict();
+};
+
+// Reads an open directory with getdents64 and hands over the entries of
+// each call (without "." and ".."). Returns false on a read error.
+bool readDirectoryChunks(int dirFd, const std::function<void(std::vector<DirEntry>&)>& onChunk);
+
+// Reads dir into listing, publishing a chunk per getdents64 call
+void loadDirectory(DirectoryListing& listing);
+
+#endif // DIRECTORY_CACHE_H
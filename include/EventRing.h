@@ -0,0 +1,110 @@
+#ifndef EVENT_RING_H
+#define EVENT_RING_H
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include "Events.h"
+
+// Shared-memory ring through which the monitor publishes decoded events to
+// local subscriber processes. One producer, any number of consumers; each
+// consumer owns a cursor and detects when the producer has lapped it.
+
+#define EVENT_RING_DEFAULT_NAME "/file_monitor_events"
+#define EVENT_RING_MAX_CONSUMERS 32
+#define EVENT_RING_SLOT_SIZE 1024
+
+// Set in RingEvent::flags when the path did not fit in the slot
+#define RING_PATH_TRUNCATED 0x1
+
+struct RingConsumerCursor {
+    std::atomic<int32_t> pid;        // 0 = free entry
+    std::atomic<uint64_t> position;  // next sequence this consumer will read
+    std::atomic<uint64_t> overruns;  // events lost because the producer lapped it
+};
+
+struct RingHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slotCount;              // power of two
+    std::atomic<int32_t> producerPid;
+    std::atomic<uint64_t> head;      // sequence of the next event to publish
+    std::atomic<uint32_t> wakeWord;  // futex word bumped once per published batch
+    std::atomic<uint32_t> sleepers;  // consumers blocked on wakeWord
+    RingConsumerCursor consumers[EVENT_RING_MAX_CONSUMERS];
+};
+
+struct RingSlot {
+    std::atomic<uint64_t> sequence;  // sequence stored in the slot, UINT64_MAX while being written
+    uint32_t mask;
+    uint16_t flags;
+    uint16_t pathLength;
+    int64_t timestampNs;
+    char path[EVENT_RING_SLOT_SIZE - 24];
+};
+
+static_assert(sizeof(RingSlot) == EVENT_RING_SLOT_SIZE, "ring slot layout");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring needs lock-free 64-bit atomics");
+
+// A copied-out event as seen by a consumer
+struct RingEvent {
+    uint64_t sequence;
+    uint32_t mask;
+    uint16_t flags;
+    int64_t timestampNs;
+    std::string_view path;           // valid until the next call into the reader
+};
+
+class EventRingWriter {
+public:
+    EventRingWriter();
+    ~EventRingWriter();
+
+    // Creates (or re-creates) the shared-memory object; slotCount is rounded up to a power of two
+    bool open(const std::string& name = EVENT_RING_DEFAULT_NAME, uint32_t slotCount = 16384);
+    void close();
+    bool isOpen() const { return header != nullptr; }
+
+    // Publishes a batch and wakes sleeping consumers with at most one syscall.
+    // Safe to call from several monitor threads; they take turns as the producer.
+    void publish(const EventBatch& batch);
+
+private:
+    std::string name;
+    std::mutex publishMtx;
+    RingHeader* header;
+    RingSlot* slots;
+    size_t mappedSize;
+};
+
+class EventRingReader {
+public:
+    EventRingReader();
+    ~EventRingReader();
+
+    // Attaches to an existing ring and claims a consumer cursor starting at the current head
+    bool open(const std::string& name = EVENT_RING_DEFAULT_NAME);
+    void close();
+
+    // Delivers up to maxEvents pending events without any syscall; returns how many were read
+    size_t poll(const std::function<void(const RingEvent&)>& callback, size_t maxEvents = SIZE_MAX);
+
+    // Blocks until new events are published or timeoutMs elapses
+    void wait(int timeoutMs);
+
+    uint64_t overruns() const;
+    bool producerAlive() const;
+
+private:
+    RingHeader* header;
+    RingSlot* slots;
+    size_t mappedSize;
+    RingConsumerCursor* cursor;
+    uint64_t position;
+    char pathCopy[sizeof(RingSlot::path)];
+};
+
+#endif // EVENT_RING_H
@@ -0,0 +1,39 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <string_view>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+// One decoded change. path points into monitor-owned storage and is only
+// valid for the duration of the callback that received it.
+struct FileEvent {
+    std::string_view path;
+    uint32_t mask;          // IN_* bits; polled changes report IN_MODIFY
+    int64_t timestampNs;    // system_clock, shared by all events of a batch
+};
+
+// Read-only view over a reused event buffer (a minimal std::span)
+class EventBatch {
+public:
+    EventBatch(const FileEvent* data, size_t size) : first(data), count(size) {}
+
+    const FileEvent* begin() const { return first; }
+    const FileEvent* end() const { return first + count; }
+    const FileEvent& operator[](size_t i) const { return first[i]; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+private:
+    const FileEvent* first;
+    size_t count;
+};
+
+// Subscribers run on the monitor's threads without the registry locks held.
+// Inotify readers, polling workers and rule walks call the same subscriber
+// concurrently, so subscribers must be thread-safe. They must not subscribe
+// or unsubscribe from inside a callback, and should return quickly.
+using EventCallback = std::function<void(const EventBatch&)>;
+
+#endif // EVENTS_H
@@ -0,0 +1,95 @@
+#ifndef FANOTIFY_WATCHER_H
+#define FANOTIFY_WATCHER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <sys/types.h>
+#include "Monitoring.h"
+
+// Which kernel interface watches tracked files
+enum class WatchEngine {
+    Inotify,    // one watch per file and per rule directory
+    Fanotify,   // one mark per filesystem, falls back to inotify without CAP_SYS_ADMIN
+};
+
+struct FanotifyOptions {
+    size_t handleCacheSize = 65536;   // directory handle -> path entries before the cache is reset
+};
+
+// Watches whole filesystems with fanotify (FAN_MARK_FILESYSTEM and
+// FAN_REPORT_DFID_NAME). The kernel reports a directory handle and an entry
+// name; handles are resolved to paths once and cached, and events are
+// filtered in user space: explicitly tracked files by lookup, files under
+// rule roots by the rule filter. Rule roots therefore need neither a tree
+// walk nor kernel watches. Mount marks are not used: they cannot report
+// create and rename events. Handles of one filesystem resolve through the
+// first mount it was seen on, so files and roots reached through another
+// (bind) mount of it are refused and left to inotify.
+class FanotifyWatcher {
+public:
+    // Decides whether a file under a rule root is selected; called on the reader thread
+    using RuleFilter = std::function<bool(const std::string&)>;
+
+    FanotifyWatcher(EventDispatcher dispatch, RuleFilter ruleFilter, FanotifyOptions options = FanotifyOptions());
+    ~FanotifyWatcher();
+
+    // Returns false if fanotify is unavailable or unprivileged
+    bool open();
+    bool isOpen() const { return fanotifyFd != -1; }
+
+    // Marks the file's filesystem on first use. Returns false if it cannot
+    // be marked (e.g. a filesystem without file handles), so the caller can
+    // fall back to inotify for this file.
+    bool addFile(const std::string& filePath);
+    bool removeFile(const std::string& filePath);
+    bool contains(const std::string& filePath) const;
+
+    // Replaces the rule roots, marking their filesystems and the mounts
+    // below them. Returns the roots that could not be covered.
+    std::vector<std::string> setRuleRoots(const std::vector<std::string>& roots);
+
+    void start();
+    void stop();
+
+private:
+    struct Directory {
+        std::string canonical;
+        dev_t device = 0;
+        int mountId = -1;
+    };
+
+    EventDispatcher dispatch;
+    RuleFilter ruleFilter;
+    FanotifyOptions options;
+    int fanotifyFd;
+    std::atomic<bool> running;
+    std::thread reader;
+
+    // Paths are kept in canonical form, which is what handles resolve to,
+    // and mapped back to the names the caller used
+    mutable std::mutex mtx;
+    std::unordered_map<std::string, std::string> files;         // canonical -> tracked name
+    std::unordered_map<std::string, std::string> canonicalOf;   // tracked name -> canonical
+    std::vector<std::pair<std::string, std::string>> ruleRoots; // canonical -> root as given
+    std::unordered_map<std::string, std::string> handles;       // fsid + handle -> canonical directory
+    std::unordered_map<uint64_t, int> mountFds;                 // fsid -> fd for open_by_handle_at
+    std::unordered_map<dev_t, bool> filesystems;                // st_dev -> marked successfully
+    std::unordered_map<dev_t, int> mountIds;                    // st_dev -> mount of its fd in mountFds
+    std::string lastDirectory;                                  // files of one directory arrive together
+    Directory lastResolved;
+
+    bool resolveDirectoryPath(const std::string& dirPath, Directory& directory);
+    bool markFilesystem(const std::string& dirPath, dev_t device, int mountId);
+    const std::string* resolveHandle(uint64_t fsid, const void* fileHandle, std::string& key);
+    void forgetHandlesUnder(const std::string& dirPath);
+    bool underRuleRoot(const std::string& path, std::string& rulePath) const;
+    void readLoop();
+};
+
+#endif
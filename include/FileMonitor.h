@@ -2,25 +2,81 @@
 #define FILE_MONITOR_H
 
 #include <string>
+#include <vector>
 #include <unordered_set>
 #include <unordered_map>
 #include <thread>
 #include <mutex>
-#include <deque>
-#include <stack>
+#include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include "Events.h"
+#include "Monitoring.h"
+#include "Polling.h"
+#include "FanotifyWatcher.h"
+#include "WatchRules.h"
+#include "BackupStore.h"
+#include "IntentJournal.h"
+#include "BurstSnapshot.h"
+#include "Replication.h"
+#include "ChangeJournal.h"
+#include "MonitorConfig.h"
 
+struct FileMonitorOptions {
+    bool backups = true;              // register the built-in backup subscriber
+    bool compactBackups = true;       // recompress cold versions in the background
+    CompactorOptions compactor;
+    ChangeJournalOptions changeJournal;  // binary, indexed replacement for changes.log
+    bool journalBackups = true;       // replay backups interrupted by a crash, fsync in groups
+    JournalOptions journal;
+    bool burstSnapshots = true;       // batch thousands of changes under one directory into a snapshot
+    BurstOptions burst;
+    ReplicationOptions replication;   // copy committed versions to a second target, off by default
+    bool persistTrackedFiles = true;  // load/save tracked_files.txt and load watch_rules.txt
+    std::string configPath = MONITOR_CONFIG_DEFAULT_PATH;  // declarative config, empty = none
+    bool watchConfig = true;          // reload the config when it is rewritten or on requestConfigReload()
+    WatchEngine engine = WatchEngine::Inotify;  // Fanotify: whole-filesystem marks for very large trees
+    FanotifyOptions fanotify;
+    size_t inotifyShards = 0;         // inotify instances/readers, 0 = one per core (max 8)
+    bool pinReaders = true;           // pin each reader thread to its own core
+    PollingOptions polling;
+};
+
+// Headless monitoring core (libfilemonitor). Front-ends and embedding
+// services drive it through this API and receive changes via subscribe().
 class FileMonitor {
 public:
-    FileMonitor();
+    explicit FileMonitor(const FileMonitorOptions& options = FileMonitorOptions());
     ~FileMonitor();
 
     void addFile(const std::string& filePath);
     void removeFile(const std::string& filePath);
-    void removeFileByIndex();
     void startMonitoring();
     void stopMonitoring();
-    void listTrackedFiles() const;
-    std::string browseAndSelectFile(const std::string& startDir = ".") const;
+    // Stops monitoring and every background writer and closes the journals.
+    // Call it before fork() when the child builds its own FileMonitor: the
+    // change journal's lock belongs to the open file, which a child shares.
+    void shutdown();
+    std::vector<std::string> trackedFileList() const;
+
+    // Tracks every file under roots that the include/exclude globs select,
+    // including files created or moved in later
+    bool setWatchRules(const std::vector<std::string>& roots, const std::vector<WatchRule>& rules);
+
+    // Applies a config: files added to or dropped from it, and listed files
+    // that are not tracked right now, are (un)watched; rules are re-walked
+    // only when they changed, and policies are swapped atomically, so
+    // backups in flight are not disturbed
+    bool applyConfig(MonitorConfig config);
+    // Re-reads options.configPath and applies it
+    bool reloadConfig();
+
+    // Registers a batch callback, returns an id for unsubscribe()
+    int subscribe(EventCallback callback);
+    void unsubscribe(int subscriberId);
+
+    // Paths prefixed with "poll:" are always watched by the polling engine
+    static constexpr const char* POLL_PREFIX = "poll:";
 
     // Новый метод для проверки состояния мониторинга
     bool isMonitoringActive() const {
@@ -28,17 +84,59 @@ public:
     }
 
 private:
-    int inotifyFd;
+    FileMonitorOptions options;
+    InotifyShards shards;
     std::unordered_set<std::string> trackedFiles;
-    std::unordered_map<int, std::string> watchDescriptors;
-    bool isMonitoring;
-    std::thread monitoringThread;
+    std::atomic<bool> isMonitoring;
     mutable std::mutex mtx;
-    mutable std::deque<std::string> dirHistory;
-    mutable std::stack<std::string> backStack;
+    std::shared_mutex subscribersMtx;
+    std::vector<std::pair<int, EventCallback>> subscribers;
+    int nextSubscriberId;
+    std::shared_ptr<const RuleMatcher> ruleMatcher;    // replaced whole, read through std::atomic_load
+    std::vector<std::string> ruleRoots;
+    std::vector<WatchRule> activeRules;
+    std::unordered_set<std::string> ruleTrackedFiles;  // not written to tracked_files.txt
+    PollingWatcher poller;
+    ChangeJournal changes;            // outlives the journal and bursts, which record and sync through it
+    FanotifyWatcher fanotify;         // closed unless options.engine selects it and the kernel allows it
+    BackupCompactor compactor;
+    Replicator replicator;            // outlives the journal, which feeds it on commit
+    IntentJournal journal;
+    BurstSnapshotter bursts;
+
+    // Files listed by the applied config. A listed file that is not tracked
+    // (its watch failed, it was removed from the menu, the rules dropped it)
+    // waits in configMissing and is retried on every reload.
+    struct ConfigTracked {
+        uint32_t fileLines = 0;     // "file" lines listing it
+        uint32_t pollLines = 0;     // "poll" lines listing it; any of them selects polling
+        bool owned = false;         // tracked because of the config, untracked when the config drops it
+        bool touched = false;       // queued for comparison during a reload
+    };
+    std::mutex configMtx;           // one reload at a time
+    std::unordered_map<std::string, ConfigTracked> configFiles;  // by path, changed under mtx
+    std::unordered_set<std::string> configMissing;               // listed but not tracked, under mtx
+    std::vector<char> appliedConfigText;                      // diffed against on reload
+    bool configManagesRules;
+    std::shared_ptr<const PolicySet> policies;  // replaced whole, read through std::atomic_load
+    ConfigWatcher configWatcher;
 
+    void replayJournal();
+    void backupCompleted(uint64_t eventId, const std::string& backupPath);
     void loadTrackedFiles();
     void saveTrackedFiles();
+    void addPolledFile(const std::string& filePath);
+    void removeTrackedFile(const std::string& filePath);
+    void dispatchPaths(const std::vector<std::string>& filePaths, uint32_t mask);
+    void watchTree(const std::string& root);
+    void trackRuleFile(const std::string& filePath);
+    void untrackFiles(const std::vector<std::string>& filePaths);
+    size_t trackConfigFiles(const std::vector<std::string>& filePaths);
+    void configFileUntracked(const std::string& filePath);
+    bool isConfigFile(const std::string& filePath) const;
+    void onDirectoryEntries(const std::vector<DirectoryEntryEvent>& entries);
+    void dispatch(const EventBatch& batch);
+    void backupSubscriber(const EventBatch& batch);
 };
 
 #endif
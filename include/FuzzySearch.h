@@ -0,0 +1,58 @@
+#ifndef FUZZY_SEARCH_H
+#define FUZZY_SEARCH_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+// Incremental fuzzy filter for the browser's type-to-search. A candidate
+// matches when the query's characters occur in it in order (ASCII case
+// folded); each character is located with an SSE2 scan of 16 bytes at a time.
+// Scans run in time slices, so a keystroke never blocks the UI longer than
+// its budget, and a query that extends the previous one only rescans the
+// previous matches.
+
+struct FuzzyMatch {
+    uint32_t index;
+    int score;
+};
+
+// Returns the score of text for a lowercase query, or -1 if it does not match
+int fuzzyScore(std::string_view text, std::string_view loweredQuery);
+
+class FuzzySearcher {
+public:
+    // Candidate text by index; an empty view means "skip" (e.g. filtered out)
+    using CandidateSource = std::function<std::string_view(uint32_t)>;
+
+    void setQuery(const std::string& query);
+    const std::string& query() const { return text; }
+
+    // Discards previous results, e.g. when the candidate set is replaced
+    void reset();
+
+    // Scans candidates [0, count) until done or until deadline. Candidates
+    // added since the last complete scan are picked up on the next call.
+    // Returns true when every candidate has been scanned.
+    bool scan(uint32_t count, const CandidateSource& candidate, std::chrono::steady_clock::time_point deadline);
+
+    bool complete() const { return done; }
+    size_t matchCount() const { return matches.size(); }
+
+    // Best `limit` matches, highest score first (ties keep candidate order)
+    std::vector<uint32_t> ranked(size_t limit) const;
+
+private:
+    std::string text;
+    std::string lowered;
+    std::vector<FuzzyMatch> matches;   // of the current query, in candidate order
+    std::vector<uint32_t> narrowFrom;  // previous matches still to rescan
+    size_t narrowPosition = 0;
+    uint32_t nextIndex = 0;            // first candidate not scanned yet
+    bool done = true;
+};
+
+#endif // FUZZY_SEARCH_H
@@ -0,0 +1,91 @@
+#ifndef INTENT_JOURNAL_H
+#define INTENT_JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include "Events.h"
+#include "ChangeJournal.h"
+
+// Append-only write-ahead journal for backups. An intent record is written
+// before a change is copied and a commit record once the copy and its
+// change record are on disk, so intents without a commit are replayed on
+// the next start.
+//
+// Intents reach the kernel with one write() per batch and survive a process
+// crash at once. fsyncs are grouped: a flusher thread syncs every backup
+// finished in the last interval and their directories, then the change
+// journal, then this one.
+
+#define INTENT_JOURNAL_DEFAULT_PATH "backup_journal.log"
+
+struct JournalOptions {
+    std::string path = INTENT_JOURNAL_DEFAULT_PATH;
+    std::chrono::milliseconds groupCommitInterval{20};  // upper bound on lost work after a power cut
+    size_t truncateAbove = 1024 * 1024;                 // journal bytes before it is reset when idle
+};
+
+struct PendingIntent {
+    uint64_t id;
+    std::string path;
+};
+
+class IntentJournal {
+public:
+    // changes is synced with the copies before each group commit
+    explicit IntentJournal(ChangeJournal& changes, JournalOptions options = JournalOptions());
+    ~IntentJournal();
+
+    // Opens the journal and returns the intents that never committed. They
+    // stay in the journal until the caller completes them.
+    bool open(std::vector<PendingIntent>& pending);
+    void close();
+    bool isOpen() const { return fd != -1; }
+
+    // Records one intent per event; ids are consecutive from the returned one
+    uint64_t recordIntents(const EventBatch& batch);
+
+    // Marks an intent done. backupPath is synced before the commit record is
+    // written; an empty path commits without syncing (nothing was copied).
+    void complete(uint64_t id, const std::string& backupPath);
+
+    // Runs a group commit now and waits for it
+    void flush();
+
+    // Called from the group commit with the backup paths it made durable,
+    // before their commit records are written
+    using CommitListener = std::function<void(const std::vector<std::string>&)>;
+    void setCommitListener(CommitListener listener) { onCommit = std::move(listener); }
+
+private:
+    struct Completion {
+        uint64_t id;
+        std::string backupPath;
+    };
+
+    ChangeJournal& changes;
+    JournalOptions options;
+    int fd;
+    uint64_t nextId;
+    std::mutex writeMtx;                     // serializes appends and truncation
+    std::mutex commitMtx;                    // one group commit at a time
+    std::mutex queueMtx;
+    std::condition_variable wake;
+    std::vector<Completion> completed;       // waiting for the next group commit
+    uint64_t outstanding;                    // intents without a commit record, under writeMtx
+    std::atomic<bool> running;
+    std::thread flusher;
+    CommitListener onCommit;
+
+    void flusherLoop();
+    void groupCommit();
+    bool appendRecords(const std::string& records);
+};
+
+#endif // INTENT_JOURNAL_H
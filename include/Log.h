@@ -0,0 +1,12 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <ostream>
+
+// Diagnostic streams used by the monitoring library (cout/cerr by default).
+// Passing nullptr discards the output, which is what embedders usually want.
+void setMonitorOutput(std::ostream* out, std::ostream* err);
+std::ostream& monitorOut();
+std::ostream& monitorErr();
+
+#endif // LOG_H
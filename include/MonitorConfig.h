@@ -0,0 +1,107 @@
+#ifndef MONITOR_CONFIG_H
+#define MONITOR_CONFIG_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include "WatchRules.h"
+
+// Declarative configuration, one directive per line, '#' starts a comment:
+//
+//   file /etc/hosts                 track with inotify
+//   poll /mnt/nfs/app.conf          track by polling
+//   root /srv                       rule roots and globs, as in watch_rules.txt
+//   include *.conf
+//   exclude **/cache/**
+//   policy /srv/logs/** nobackup    per-path policies, later lines win
+//   policy /srv/repo/** noburst
+//
+// The file is reloaded on SIGHUP or when it is rewritten, and only the
+// difference to what is live is applied (see FileMonitor::reloadConfig).
+
+#define MONITOR_CONFIG_DEFAULT_PATH "file_monitor.conf"
+
+enum PolicyOption : uint8_t {
+    POLICY_BACKUP = 1,
+    POLICY_BURST = 2,
+};
+
+struct PathPolicy {
+    std::string pattern;
+    bool backup = true;     // nobackup: events still reach subscribers, no copies are made
+    bool burst = true;      // noburst: never fold this path into a burst snapshot
+    uint8_t overrides = 0;  // PolicyOption bits named on the line
+};
+
+struct ConfigFile {
+    std::string_view path;  // points into MonitorConfig::text
+    bool poll;
+};
+
+// Parsed config. Entries are views into text, so it can be moved but not copied.
+struct MonitorConfig {
+    std::vector<char> text;
+    std::vector<ConfigFile> files;
+    std::vector<std::string> roots;
+    std::vector<WatchRule> rules;
+    std::vector<PathPolicy> policies;
+
+    MonitorConfig() = default;
+    MonitorConfig(MonitorConfig&&) = default;
+    MonitorConfig& operator=(MonitorConfig&&) = default;
+    MonitorConfig(const MonitorConfig&) = delete;
+    MonitorConfig& operator=(const MonitorConfig&) = delete;
+};
+
+// Returns false if the file cannot be read; bad lines are reported and skipped
+bool loadMonitorConfig(const std::string& fileName, MonitorConfig& config);
+
+// Only the file/poll entries of a fragment of config text, which must start
+// at a line boundary; used to diff two versions of a config
+void parseConfigFiles(std::string_view text, std::vector<ConfigFile>& files);
+
+// Appends the lines only in before to removed and the lines only in after
+// to added; both fragments must start at a line boundary
+void diffConfigLines(std::string_view before, std::string_view after, std::string& removed, std::string& added);
+
+// Policies compiled to one glob matcher each
+class PolicySet {
+public:
+    bool compile(const std::vector<PathPolicy>& policies);
+    bool empty() const { return compiled.empty(); }
+    PathPolicy lookup(std::string_view path) const;
+
+private:
+    std::vector<std::pair<RuleMatcher, PathPolicy>> compiled;
+};
+
+// Calls onChange when the config file is written, replaced or created, and
+// when requestConfigReload() is called. Uses its own inotify instance, so
+// the config is never treated as a monitored file.
+class ConfigWatcher {
+public:
+    ConfigWatcher() : running(false), inotifyFd(-1) {}
+    ~ConfigWatcher();
+
+    bool start(const std::string& path, std::function<void()> onChange);
+    void stop();
+
+private:
+    std::atomic<bool> running;
+    int inotifyFd;
+    std::thread worker;
+
+    void watchLoop(std::string directory, std::string name, std::function<void()> onChange);
+};
+
+// Async-signal-safe: wakes the running ConfigWatcher
+void requestConfigReload();
+
+// Makes SIGHUP reload the config (the usual daemon convention)
+void installConfigReloadSignal();
+
+#endif // MONITOR_CONFIG_H
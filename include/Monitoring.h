@@ -2,29 +2,82 @@
 #define MONITORING_H
 
 #include <string>
+#include <ostream>
 #include <unordered_set>
+#include <functional>
 #include <unordered_map>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include "Events.h"
+#include "ChangeJournal.h"
 
-void addFileToWatch(int inotifyFd, const std::string& filePath, 
-                    std::unordered_set<std::string>& trackedFiles, 
-                    std::unordered_map<int, std::string>& watchDescriptors, 
-                    std::mutex& mtx);
+// Receives each decoded inotify batch after the shard's mutex has been
+// released, possibly from several shard readers at once
+using EventDispatcher = std::function<void(const EventBatch&)>;
 
-void removeFileFromWatch(int inotifyFd, const std::string& filePath, 
-                         std::unordered_set<std::string>& trackedFiles, 
-                         std::unordered_map<int, std::string>& watchDescriptors, 
+// A file or directory that appeared in a directory watched for rule matching
+struct DirectoryEntryEvent {
+    std::string path;
+    uint32_t mask;          // IN_CREATE or IN_MOVED_TO, plus IN_ISDIR for directories
+};
+
+// Receives new directory entries after the shard's mutex has been released
+using DirectoryEventHandler = std::function<void(const std::vector<DirectoryEntryEvent>&)>;
+
+// One inotify instance with its own reader thread and its own slice of the
+// watch registry. Watches are spread over shards by directory hash.
+struct InotifyShard {
+    int inotifyFd = -1;
+    int cpu = -1;                                           // reader affinity, -1 = unpinned
+    std::unordered_map<int, std::string> watchDescriptors;  // file watches
+    std::unordered_map<int, std::string> directoryWatches;  // rule directory watches
+    std::mutex mtx;
+    std::thread reader;
+};
+
+using InotifyShards = std::vector<std::unique_ptr<InotifyShard>>;
+
+// Creates count non-blocking inotify instances pinned round-robin to the allowed CPUs
+bool openInotifyShards(InotifyShards& shards, size_t count, bool pinReaders);
+void closeInotifyShards(InotifyShards& shards);
+
+// Shard for a watch: files are keyed by their parent directory, directories
+// by themselves, so a directory watch and its files share a reader
+InotifyShard& shardForDirectory(const InotifyShards& shards, const std::string& dirPath);
+InotifyShard& shardForFile(const InotifyShards& shards, const std::string& filePath);
+
+// Returns false if the kernel refused the watch (e.g. on some network mounts)
+bool addFileToWatch(InotifyShard& shard, const std::string& filePath);
+
+// Watches dirPath for new entries. Returns the wd or -1
+int addDirectoryWatch(InotifyShard& shard, const std::string& dirPath);
+
+void removeFileFromWatch(InotifyShard& shard, const std::string& filePath,
                          bool isMonitoring);
 
-void startMonitoringThread(bool& isMonitoring, std::thread& monitoringThread, 
-                          int inotifyFd, const std::unordered_set<std::string>& trackedFiles, 
-                          const std::unordered_map<int, std::string>& watchDescriptors, 
-                          std::mutex& mtx);
+// Batched variants for bulk changes such as config reloads: the shard's
+// mutex is taken once and nothing is logged per file. Paths the kernel
+// refused are appended to failed.
+size_t addFilesToWatch(InotifyShard& shard, const std::vector<std::string>& filePaths,
+                       std::vector<std::string>& failed);
+// One pass over the shard's registry however many paths are removed
+size_t removeFilesFromWatch(InotifyShard& shard, const std::unordered_set<std::string>& filePaths);
+// Removes the directory watches for which drop returns true
+size_t removeDirectoryWatches(InotifyShard& shard, const std::function<bool(const std::string&)>& drop);
+
+// Copies filePath into backups/<name>_<time> and records the change in
+// changes; a name already taken gets "-2", "-3"... appended. Safe to call
+// from several threads. The copy's path is stored in backupPath when given.
+bool backupFile(const std::string& filePath, ChangeJournal& changes, std::ostream& log,
+                std::string* backupPath = nullptr);
 
-void stopMonitoringThread(bool& isMonitoring, std::thread& monitoringThread);
+void startMonitoringThreads(std::atomic<bool>& isMonitoring, InotifyShards& shards,
+                            EventDispatcher dispatch,
+                            DirectoryEventHandler onDirectoryEntries);
 
-void listTrackedFilesImpl(const std::unordered_set<std::string>& trackedFiles, 
-                         std::mutex& mtx);
+void stopMonitoringThreads(std::atomic<bool>& isMonitoring, InotifyShards& shards);
 
 #endif
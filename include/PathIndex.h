@@ -0,0 +1,45 @@
+#ifndef PATH_INDEX_H
+#define PATH_INDEX_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+// Recursive list of every path below a root, built breadth-first with
+// getdents64 on a background thread for the browser's recursive search.
+// Paths are relative to the root and packed into one buffer, so a million
+// entries cost about their name bytes plus 5 bytes each.
+
+#define PATH_INDEX_MAX_ENTRIES 5000000
+
+class PathIndex {
+public:
+    explicit PathIndex(std::string root);
+    ~PathIndex();
+
+    const std::string& root() const { return rootPath; }
+    bool complete() const { return done; }
+
+    // Lock mtx around size/path/type: the builder appends concurrently
+    std::mutex mtx;
+    uint32_t size() const { return static_cast<uint32_t>(types.size()); }
+    std::string_view path(uint32_t index) const;
+    char type(uint32_t index) const { return types[index]; }
+
+private:
+    std::string rootPath;
+    std::string names;               // relative paths, back to back
+    std::vector<uint32_t> offsets;   // start of each path in names, plus the end
+    std::vector<char> types;
+    std::atomic<bool> stopping;
+    std::atomic<bool> done;
+    std::thread builder;
+
+    void build();
+};
+
+#endif // PATH_INDEX_H
@@ -0,0 +1,88 @@
+#ifndef POLLING_H
+#define POLLING_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+// Tuning for the stat-polling engine used where inotify does not work
+struct PollingOptions {
+    size_t workerThreads = 4;
+    size_t batchSize = 256;                                // statx calls per batch
+    std::chrono::milliseconds minInterval{500};            // hot files
+    std::chrono::milliseconds maxInterval{60000};          // cold files
+    double cpuBudget = 0.10;                               // fraction of one core, all workers together
+};
+
+// Returns true for NFS/CIFS/SMB/FUSE mounts where inotify misses remote changes
+bool isRemoteFilesystem(const std::string& path);
+
+// Polls file metadata with statx and reports each batch of changed files through a callback.
+// Files that change are polled more often, unchanged ones are backed off.
+class PollingWatcher {
+public:
+    using ChangeCallback = std::function<void(const std::vector<std::string>&)>;
+
+    explicit PollingWatcher(ChangeCallback onChange, PollingOptions options = PollingOptions());
+    ~PollingWatcher();
+
+    bool addPath(const std::string& filePath);
+    bool removePath(const std::string& filePath);
+    bool contains(const std::string& filePath) const;
+    size_t size() const;
+
+    void start();
+    void stop();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct FileState {
+        std::string path;
+        int64_t mtimeSec = 0;
+        uint32_t mtimeNsec = 0;
+        int64_t ctimeSec = 0;
+        uint32_t ctimeNsec = 0;
+        uint64_t size = 0;
+        uint64_t inode = 0;
+        bool exists = false;
+        bool primed = false;                               // first statx only records a baseline
+        std::chrono::milliseconds interval{0};
+        uint32_t generation = 0;                           // bumped when the slot is reused
+    };
+
+    struct DueEntry {
+        Clock::time_point due;
+        size_t slot;
+        uint32_t generation;
+        bool operator>(const DueEntry& other) const { return due > other.due; }
+    };
+
+    // Each worker owns one shard, so workers never contend with each other
+    struct Shard {
+        std::mutex mtx;
+        std::condition_variable wake;
+        std::vector<FileState> slots;
+        std::vector<size_t> freeSlots;
+        std::unordered_map<std::string, size_t> index;
+        std::vector<DueEntry> dueHeap;                     // min-heap on due
+        std::thread worker;
+    };
+
+    ChangeCallback onChange;
+    PollingOptions options;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<bool> running;
+
+    Shard& shardFor(const std::string& filePath) const;
+    void workerLoop(Shard& shard);
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Asynchronous replication of committed backup versions to a second target:
+// another directory (a second disk or a mount) or a peer daemon over TCP.
+// Versions are queued on disk, sent in batches without waiting for earlier
+// batches to be acknowledged, and re-sent from the last acknowledgement
+// after an outage or a restart.
+
+#define REPLICATION_TCP_PREFIX "tcp://"
+
+struct ReplicationOptions {
+    std::string target;                           // directory or tcp://host:port; empty = off
+    size_t batchSize = 64;                        // versions per acknowledged batch
+    size_t maxInFlight = 8;                       // batches sent ahead of the acknowledgements
+    uint64_t bandwidthLimit = 0;                  // bytes per second, 0 = unlimited
+    std::string queuePath = "replication_queue.log";
+    std::string statePath = "replication_state";  // last acknowledged sequence
+    std::string rejectedPath = "replication_rejected.log";  // versions the target refused
+};
+
+struct ReplicationStats {
+    uint64_t queued = 0;        // highest sequence queued
+    uint64_t acknowledged = 0;  // highest sequence stored by the target
+    uint64_t bytesSent = 0;
+    bool connected = false;
+};
+
+// Outcome of a transfer step. Rejected is final for that version (its path
+// cannot be stored on the target); Failed is retried after a reconnect.
+enum class TransferResult { Ok, Failed, Rejected };
+
+// A place versions are copied to. Files are streamed in chunks; the target
+// acknowledges whole batches once their files are durable.
+class ReplicationTarget {
+public:
+    virtual ~ReplicationTarget() = default;
+    virtual std::string name() const = 0;
+    virtual bool connect() = 0;
+    virtual void disconnect() = 0;
+
+    // relativePath is the version's path below backups/
+    virtual TransferResult beginFile(uint64_t sequence, const std::string& relativePath, uint64_t size) = 0;
+    virtual bool writeChunk(const char* data, size_t size) = 0;
+    virtual bool endFile() = 0;
+    virtual bool endBatch(uint64_t lastSequence) = 0;
+
+    // Reads acknowledgements for up to timeoutMs; sequence only ever grows
+    virtual bool pollAcknowledged(uint64_t& sequence, int timeoutMs) = 0;
+};
+
+// Builds a target from "tcp://host:port" or a directory path
+std::unique_ptr<ReplicationTarget> makeReplicationTarget(const std::string& spec);
+
+class Replicator {
+public:
+    explicit Replicator(ReplicationOptions options = ReplicationOptions());
+    ~Replicator();
+
+    bool enabled() const { return !options.target.empty(); }
+
+    // Loads the unacknowledged queue and starts the sender thread
+    bool start();
+    void stop();
+
+    // Queues committed versions (paths as written by backupFile). The queue
+    // append is synced before returning, so a version committed by the
+    // group commit is never lost to replication by a crash.
+    void enqueue(const std::vector<std::string>& backupPaths);
+
+    ReplicationStats stats() const;
+
+private:
+    struct Record {
+        uint64_t sequence;
+        std::string backupPath;
+    };
+
+    ReplicationOptions options;
+    std::unique_ptr<ReplicationTarget> target;
+    std::mutex queueMtx;              // queue file appends and truncation, taken before mtx
+    mutable std::mutex mtx;
+    std::condition_variable wake;
+    std::deque<Record> pending;       // queued and not yet acknowledged
+    uint64_t nextSequence;
+    uint64_t acknowledged;
+    uint64_t bytesSent;
+    bool connected;
+    std::atomic<bool> running;
+    std::thread sender;
+    std::chrono::steady_clock::time_point sendAllowedAt;  // bandwidth cap
+    std::set<std::string> sentDictionaries;  // sent on this connection (sender thread only)
+
+    void senderLoop();
+    TransferResult sendVersion(const Record& record);
+    TransferResult sendFile(uint64_t sequence, const std::string& path, int fd);
+    void reject(const Record& record);
+    void throttle(size_t bytes);
+    bool acknowledge(uint64_t sequence);  // false if nothing new
+};
+
+// Receives versions from Replicator over TCP into directory, acknowledging
+// each batch after it is fsynced. Serves one monitor at a time until stopped.
+// listenAddress is "port" (loopback) or "host:port".
+int runReplicationPeer(const std::string& listenAddress, const std::string& directory);
+
+#endif // REPLICATION_H
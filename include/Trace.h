@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <cstdint>
+
+// Stage timing for the event-to-backup pipeline. Spans exist only in builds
+// compiled with -DFILE_MONITOR_TRACING; otherwise TRACE_SPAN expands to
+// nothing and the dump functions report that tracing is off.
+//
+// Each thread records into its own fixed-size ring (single writer, no locks
+// on the hot path). A dump copies the rings and writes Chrome trace JSON,
+// which chrome://tracing and ui.perfetto.dev open directly.
+
+#define TRACE_RING_CAPACITY 16384   // spans kept per thread, older ones are overwritten
+#define TRACE_DEFAULT_PATH "file_monitor_trace.json"
+
+#ifdef FILE_MONITOR_TRACING
+
+#include <chrono>
+
+// name must be a string literal: only the pointer is stored
+void traceRecord(const char* name, int64_t startNs, int64_t endNs);
+
+inline int64_t traceNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name) : name(name), startNs(traceNowNs()) {}
+    ~TraceSpan() { traceRecord(name, startNs, traceNowNs()); }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    int64_t startNs;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+// Times the rest of the enclosing scope
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+#else
+
+#define TRACE_SPAN(name) ((void)0)
+
+#endif // FILE_MONITOR_TRACING
+
+// Writes every recorded span to path; returns false if tracing is compiled out
+bool dumpTrace(const std::string& path = TRACE_DEFAULT_PATH);
+
+// Dumps to path whenever the process receives SIGUSR2. Call again in a
+// forked child: the dumping thread does not survive fork().
+void installTraceDumpSignal(const std::string& path = TRACE_DEFAULT_PATH);
+
+#endif // TRACE_H
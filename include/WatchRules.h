@@ -0,0 +1,52 @@
+#ifndef WATCH_RULES_H
+#define WATCH_RULES_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+// One include/exclude glob. Supported syntax: '?' and '*' (never match '/'),
+// '**' (matches across directories), [a-z] / [!a-z] classes and '\' escapes.
+// Patterns that do not start with '/' may match at any depth, so "*.conf"
+// behaves like "**/*.conf".
+struct WatchRule {
+    std::string pattern;
+    bool include;
+};
+
+// All rules compiled into a single DFA over byte classes. Matching a path
+// costs one table lookup per byte regardless of how many rules there are.
+class RuleMatcher {
+public:
+    RuleMatcher();
+
+    // Returns false and leaves the matcher empty if a pattern is malformed
+    bool compile(const std::vector<WatchRule>& rules);
+    bool empty() const { return transitions.empty(); }
+
+    // True if some include rule matches and no exclude rule does
+    bool matches(std::string_view path) const;
+    // False when no include rule can match anything below this directory
+    bool mayMatchUnder(std::string_view directory) const;
+
+private:
+    enum StateFlags : uint8_t {
+        INCLUDE_ACCEPT = 1,
+        EXCLUDE_ACCEPT = 2,
+        INCLUDE_LIVE = 4,   // an include pattern is still partially matched
+    };
+
+    uint16_t byteClass[256];
+    size_t classCount;
+    std::vector<int32_t> transitions;  // state * classCount + class -> state
+    std::vector<uint8_t> stateFlags;
+
+    int32_t run(int32_t state, std::string_view text) const;
+};
+
+// Loads "root <dir>", "include <glob>" and "exclude <glob>" lines, '#' starts a comment
+bool loadWatchRules(const std::string& fileName, std::vector<std::string>& roots,
+                    std::vector<WatchRule>& rules);
+
+#endif // WATCH_RULES_H
@@ -0,0 +1,546 @@
+#include "BackupStore.h"
+#include "Log.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <array>
+#include <cstring>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char FMZ_MAGIC[4] = {'F', 'M', 'Z', '1'};
+const size_t STREAM_CHUNK = 64 * 1024;
+const size_t SAMPLE_BYTES = 256 * 1024;
+const size_t TIMESTAMP_LENGTH = 19; // "YYYY-MM-DD HH:MM:SS"
+
+// ioprio_set(2) constants, not exported by glibc
+const int IOPRIO_CLASS_IDLE = 3;
+const int IOPRIO_CLASS_SHIFT = 13;
+const int IOPRIO_WHO_PROCESS = 1;
+
+struct FmzHeader {
+    char magic[4];
+    uint32_t dictionaryId;   // adler32 of the preset dictionary, 0 = none
+    uint64_t originalSize;
+};
+
+struct BackupVersion {
+    string path;
+    string timestamp;
+    bool compressed;
+};
+
+void lowerThreadPriority() {
+    pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+    setpriority(PRIO_PROCESS, tid, 19);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+bool endsWith(const string& text, const string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Splits "<name>_YYYY-MM-DD HH:MM:SS[-N][.fmz]" into name and timestamp. backupFile
+// adds "-N" when same-named files are backed up within one second.
+bool parseVersionName(const string& fileName, string& base, string& timestamp) {
+    string name = fileName;
+    if (endsWith(name, BACKUP_COMPRESSED_SUFFIX)) {
+        name.resize(name.size() - strlen(BACKUP_COMPRESSED_SUFFIX));
+    }
+    string counter;
+    size_t dash = name.rfind('-');
+    if (dash != string::npos && dash > TIMESTAMP_LENGTH && dash + 1 < name.size() && name[dash - 3] == ':' &&
+        name.find_first_not_of("0123456789", dash + 1) == string::npos) {
+        counter = name.substr(dash);
+        name.resize(dash);
+    }
+    if (name.size() < TIMESTAMP_LENGTH + 2 || name[name.size() - TIMESTAMP_LENGTH - 1] != '_') {
+        return false;
+    }
+    timestamp = name.substr(name.size() - TIMESTAMP_LENGTH);
+    for (size_t i = 0; i < timestamp.size(); ++i) {
+        bool digit = isdigit(static_cast<unsigned char>(timestamp[i])) != 0;
+        bool separator = i == 4 || i == 7 || i == 10 || i == 13 || i == 16;
+        if (digit == separator) {
+            return false;
+        }
+    }
+    base = name.substr(0, name.size() - TIMESTAMP_LENGTH - 1);
+    timestamp += counter;
+    return true;
+}
+
+// Dictionaries are shared by files with the same extension
+string fileType(const string& base) {
+    string ext = fs::path(base).extension().string();
+    if (ext.size() <= 1) {
+        return "noext";
+    }
+    string type;
+    for (char c : ext.substr(1)) {
+        type += isalnum(static_cast<unsigned char>(c)) ? static_cast<char>(tolower(c)) : '_';
+    }
+    return type;
+}
+
+string dictionaryPath(const string& type, uint32_t id) {
+    ostringstream name;
+    name << BACKUP_DICTIONARY_DIR << "/" << type << "-" << hex << setw(8) << setfill('0') << id << ".dict";
+    return name.str();
+}
+
+bool readWholeFile(const string& path, string& data, size_t limit = SIZE_MAX) {
+    ifstream in(path, ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    data.clear();
+    char buffer[STREAM_CHUNK];
+    while (data.size() < limit) {
+        in.read(buffer, sizeof(buffer));
+        if (in.gcount() <= 0) {
+            break;
+        }
+        data.append(buffer, min(static_cast<size_t>(in.gcount()), limit - data.size()));
+    }
+    return true;
+}
+
+// Finds the dictionary file for a type, or the one with a given id when restoring
+string findDictionaryFile(const string& directory, const string& type, uint32_t id, uint32_t& foundId) {
+    error_code ec;
+    for (const auto& entry : fs::directory_iterator(directory, ec)) {
+        string name = entry.path().filename().string();
+        size_t dash = name.rfind('-');
+        if (dash == string::npos || !endsWith(name, ".dict")) {
+            continue;
+        }
+        uint32_t entryId = static_cast<uint32_t>(strtoul(name.substr(dash + 1, 8).c_str(), nullptr, 16));
+        if ((type.empty() || name.compare(0, dash, type) == 0) && (id == 0 || entryId == id)) {
+            foundId = entryId;
+            return entry.path().string();
+        }
+    }
+    return "";
+}
+
+bool findDictionary(const string& type, uint32_t id, string& dictionary, uint32_t& foundId) {
+    string path = findDictionaryFile(BACKUP_DICTIONARY_DIR, type, id, foundId);
+    return !path.empty() && readWholeFile(path, dictionary);
+}
+
+bool readHeader(istream& in, FmzHeader& header) {
+    return in.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+           memcmp(header.magic, FMZ_MAGIC, sizeof(FMZ_MAGIC)) == 0;
+}
+
+// A version's dictionary lives in the nearest ".dict" above it: backups/.dict
+// locally, <root>/.dict on a replica
+string dictionaryFileFor(const string& backupPath, uint32_t id) {
+    uint32_t foundId = 0;
+    fs::path directory = fs::path(backupPath).parent_path();
+    while (!directory.empty()) {
+        string path = findDictionaryFile((directory / ".dict").string(), "", id, foundId);
+        if (!path.empty()) {
+            return path;
+        }
+        if (directory == directory.parent_path()) {
+            break;
+        }
+        directory = directory.parent_path();
+    }
+    return findDictionaryFile(BACKUP_DICTIONARY_DIR, "", id, foundId);
+}
+
+// Gear table for content-defined chunking, filled from a fixed seed
+const array<uint32_t, 256>& gearTable() {
+    static const array<uint32_t, 256> table = []() {
+        array<uint32_t, 256> values{};
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        for (auto& value : values) {
+            state += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            value = static_cast<uint32_t>(z ^ (z >> 31));
+        }
+        return values;
+    }();
+    return table;
+}
+
+// fdatasync for a file, fsync for a directory (makes renames and unlinks durable)
+bool syncPath(const string& path, bool directory) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | (directory ? O_DIRECTORY : 0));
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = (directory ? fsync(fd) : fdatasync(fd)) == 0;
+    ::close(fd);
+    return ok;
+}
+
+} // namespace
+
+string trainDictionary(const vector<string>& samplePaths, size_t dictionarySize) {
+    const size_t MIN_CHUNK = 16, MAX_CHUNK = 128;
+    const uint32_t BOUNDARY_MASK = 0x1F; // ~32 byte chunks
+    const auto& gear = gearTable();
+
+    // Chunk boundaries depend on content, so shifted copies of the same text
+    // still produce the same chunks; count in how many samples each appears
+    struct ChunkCount { uint32_t samples; uint32_t lastSample; };
+    unordered_map<string, ChunkCount> counts;
+    string data;
+    for (uint32_t s = 0; s < samplePaths.size(); ++s) {
+        if (!readWholeFile(samplePaths[s], data, SAMPLE_BYTES)) {
+            continue;
+        }
+        size_t start = 0;
+        uint32_t h = 0;
+        for (size_t i = 0; i < data.size(); ++i) {
+            h = (h << 1) + gear[static_cast<unsigned char>(data[i])];
+            size_t length = i + 1 - start;
+            if ((length >= MIN_CHUNK && (h & BOUNDARY_MASK) == 0) || length >= MAX_CHUNK) {
+                auto& count = counts[data.substr(start, length)];
+                if (count.samples == 0 || count.lastSample != s + 1) {
+                    count.samples++;
+                    count.lastSample = s + 1;
+                }
+                start = i + 1;
+                h = 0;
+            }
+        }
+    }
+
+    uint32_t minSamples = samplePaths.size() > 1 ? 2 : 1;
+    vector<pair<uint64_t, const string*>> ranked;
+    for (const auto& entry : counts) {
+        if (entry.second.samples >= minSamples) {
+            ranked.emplace_back(uint64_t(entry.second.samples) * entry.first.size(), &entry.first);
+        }
+    }
+    sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first > b.first : *a.second < *b.second;
+    });
+
+    vector<const string*> chosen;
+    size_t total = 0;
+    for (const auto& entry : ranked) {
+        if (total + entry.second->size() > dictionarySize) {
+            continue;
+        }
+        chosen.push_back(entry.second);
+        total += entry.second->size();
+    }
+    string dictionary;
+    dictionary.reserve(total);
+    for (auto it = chosen.rbegin(); it != chosen.rend(); ++it) {
+        dictionary += **it;
+    }
+    return dictionary;
+}
+
+BackupCompactor::BackupCompactor(CompactorOptions options) : options(options), running(false) {}
+
+BackupCompactor::~BackupCompactor() {
+    stop();
+}
+
+void BackupCompactor::start() {
+    if (running.exchange(true)) {
+        return;
+    }
+    worker = thread([this]() { workerLoop(); });
+}
+
+void BackupCompactor::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+CompactorStats BackupCompactor::stats() const {
+    lock_guard<mutex> lock(mtx);
+    return totals;
+}
+
+void BackupCompactor::workerLoop() {
+    lowerThreadPriority();
+    while (running) {
+        runOnce();
+        unique_lock<mutex> lock(mtx);
+        wake.wait_for(lock, options.interval, [this]() { return !running; });
+    }
+}
+
+void BackupCompactor::runOnce() {
+    map<string, vector<BackupVersion>> versionsByFile;
+    error_code ec;
+    for (const auto& entry : fs::directory_iterator("backups", ec)) {
+        if (!entry.is_regular_file(ec)) {
+            continue;
+        }
+        string name = entry.path().filename().string();
+        string base, timestamp;
+        if (name[0] == '.' || !parseVersionName(name, base, timestamp)) {
+            continue;
+        }
+        versionsByFile[base].push_back({entry.path().string(), timestamp, endsWith(name, BACKUP_COMPRESSED_SUFFIX)});
+    }
+
+    // Hot (newest) raw versions are the training samples for their file type
+    map<string, vector<string>> samplesByType;
+    vector<pair<string, string>> cold; // path, type
+    for (auto& file : versionsByFile) {
+        auto& versions = file.second;
+        sort(versions.begin(), versions.end(), [](const auto& a, const auto& b) { return a.timestamp > b.timestamp; });
+        string type = fileType(file.first);
+        for (size_t i = 0; i < versions.size(); ++i) {
+            if (versions[i].compressed) {
+                continue;
+            }
+            if (i < options.hotVersions) {
+                if (samplesByType[type].size() < options.samplesPerType) {
+                    samplesByType[type].push_back(versions[i].path);
+                }
+            } else {
+                cold.emplace_back(versions[i].path, type);
+            }
+        }
+    }
+    if (cold.empty()) {
+        return;
+    }
+
+    CompactorStats before = stats();
+    for (const auto& version : cold) {
+        if (!running && worker.joinable()) {
+            break;
+        }
+        vector<string>& samples = samplesByType[version.second];
+        if (samples.empty()) {
+            samples.push_back(version.first);
+        }
+        compressVersion(version.first, samples);
+    }
+    CompactorStats after = stats();
+    if (after.filesCompressed > before.filesCompressed) {
+        monitorOut() << "Compactor: " << after.filesCompressed - before.filesCompressed << " versions compressed, "
+                     << "total ratio " << fixed << setprecision(2) << after.ratio() << ", throughput "
+                     << after.throughputMBs() << " MB/s" << defaultfloat << endl;
+    }
+}
+
+bool BackupCompactor::compressVersion(const string& rawPath, const vector<string>& samplePaths) {
+    auto startTime = chrono::steady_clock::now();
+    string base, timestamp;
+    parseVersionName(fs::path(rawPath).filename().string(), base, timestamp);
+    string type = fileType(base);
+
+    // One dictionary per type, trained the first time that type is compacted
+    string dictionary;
+    uint32_t dictionaryId = 0;
+    if (!findDictionary(type, 0, dictionary, dictionaryId)) {
+        dictionary = trainDictionary(samplePaths, options.dictionarySize);
+        dictionaryId = 0;
+        if (!dictionary.empty()) {
+            dictionaryId = static_cast<uint32_t>(adler32(1, reinterpret_cast<const Bytef*>(dictionary.data()),
+                                                         static_cast<uInt>(dictionary.size())));
+            error_code ec;
+            fs::create_directories(BACKUP_DICTIONARY_DIR, ec);
+            ofstream out(dictionaryPath(type, dictionaryId), ios::binary);
+            out.write(dictionary.data(), static_cast<streamsize>(dictionary.size()));
+            out.close();
+            // Versions compressed with it are unreadable without it
+            if (!out || !syncPath(dictionaryPath(type, dictionaryId), false) || !syncPath(BACKUP_DICTIONARY_DIR, true)) {
+                dictionary.clear();
+                dictionaryId = 0;
+            }
+        }
+    }
+
+    ifstream in(rawPath, ios::binary);
+    string tempPath = rawPath + BACKUP_COMPRESSED_SUFFIX + ".tmp";
+    ofstream out(tempPath, ios::binary | ios::trunc);
+    if (!in.is_open() || !out.is_open()) {
+        monitorErr() << "Compactor: cannot open " << rawPath << endl;
+        return false;
+    }
+    error_code ec;
+    FmzHeader header;
+    memcpy(header.magic, FMZ_MAGIC, sizeof(FMZ_MAGIC));
+    header.dictionaryId = dictionaryId;
+    header.originalSize = fs::file_size(rawPath, ec);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    z_stream stream{};
+    if (deflateInit(&stream, options.compressionLevel) != Z_OK) {
+        return false;
+    }
+    if (!dictionary.empty()) {
+        deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(dictionary.data()),
+                             static_cast<uInt>(dictionary.size()));
+    }
+
+    vector<char> input(STREAM_CHUNK), output(STREAM_CHUNK);
+    uint64_t bytesOut = sizeof(header);
+    int flush = Z_NO_FLUSH;
+    bool ok = true;
+    do {
+        in.read(input.data(), static_cast<streamsize>(input.size()));
+        stream.next_in = reinterpret_cast<Bytef*>(input.data());
+        stream.avail_in = static_cast<uInt>(in.gcount());
+        flush = in.eof() ? Z_FINISH : Z_NO_FLUSH;
+        do {
+            stream.next_out = reinterpret_cast<Bytef*>(output.data());
+            stream.avail_out = static_cast<uInt>(output.size());
+            deflate(&stream, flush);
+            size_t produced = output.size() - stream.avail_out;
+            out.write(output.data(), static_cast<streamsize>(produced));
+            bytesOut += produced;
+        } while (stream.avail_out == 0);
+        if (in.bad() || !out) {
+            ok = false;
+            break;
+        }
+    } while (flush != Z_FINISH);
+    deflateEnd(&stream);
+    out.close();
+
+    if (!ok || !out) {
+        monitorErr() << "Compactor: failed to compress " << rawPath << endl;
+        fs::remove(tempPath, ec);
+        return false;
+    }
+    // The compressed file replaces the raw one only once it is complete and
+    // durable, and the rename is on disk before the raw version goes away
+    if (!syncPath(tempPath, false)) {
+        monitorErr() << "Compactor: cannot sync " << tempPath << ": " << strerror(errno) << endl;
+        fs::remove(tempPath, ec);
+        return false;
+    }
+    fs::rename(tempPath, rawPath + BACKUP_COMPRESSED_SUFFIX, ec);
+    if (ec) {
+        fs::remove(tempPath, ec);
+        return false;
+    }
+    string directory = fs::path(rawPath).parent_path().string();
+    if (!syncPath(directory.empty() ? "." : directory, true)) {
+        monitorErr() << "Compactor: cannot sync " << directory << ", keeping " << rawPath << endl;
+        return false;
+    }
+    fs::remove(rawPath, ec);
+
+    lock_guard<mutex> lock(mtx);
+    totals.filesCompressed++;
+    totals.bytesIn += header.originalSize;
+    totals.bytesOut += bytesOut;
+    totals.busySeconds += chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+    return true;
+}
+
+string backupDictionaryPath(const string& compressedPath) {
+    ifstream in(compressedPath, ios::binary);
+    FmzHeader header;
+    if (!readHeader(in, header) || header.dictionaryId == 0) {
+        return "";
+    }
+    return dictionaryFileFor(compressedPath, header.dictionaryId);
+}
+
+bool restoreBackup(const string& backupPath, const string& destination) {
+    if (!endsWith(backupPath, BACKUP_COMPRESSED_SUFFIX)) {
+        error_code ec;
+        fs::copy_file(backupPath, destination, fs::copy_options::overwrite_existing, ec);
+        if (ec) {
+            monitorErr() << "Restore failed: " << ec.message() << endl;
+        }
+        return !ec;
+    }
+
+    ifstream in(backupPath, ios::binary);
+    FmzHeader header;
+    if (!readHeader(in, header)) {
+        monitorErr() << "Not a compressed backup: " << backupPath << endl;
+        return false;
+    }
+    string dictionary;
+    if (header.dictionaryId != 0 && !readWholeFile(dictionaryFileFor(backupPath, header.dictionaryId), dictionary)) {
+        monitorErr() << "Missing dictionary " << hex << header.dictionaryId << dec << " for " << backupPath << endl;
+        return false;
+    }
+    ofstream out(destination, ios::binary | ios::trunc);
+    if (!out.is_open()) {
+        monitorErr() << "Cannot write " << destination << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    // Decompress chunk by chunk so large versions never sit in memory whole
+    z_stream stream{};
+    inflateInit(&stream);
+    vector<char> input(STREAM_CHUNK), output(STREAM_CHUNK);
+    int status = Z_OK;
+    uint64_t written = 0;
+    while (status != Z_STREAM_END) {
+        in.read(input.data(), static_cast<streamsize>(input.size()));
+        stream.next_in = reinterpret_cast<Bytef*>(input.data());
+        stream.avail_in = static_cast<uInt>(in.gcount());
+        if (stream.avail_in == 0) {
+            break; // truncated
+        }
+        while (true) {
+            stream.next_out = reinterpret_cast<Bytef*>(output.data());
+            stream.avail_out = static_cast<uInt>(output.size());
+            status = inflate(&stream, Z_NO_FLUSH);
+            if (status == Z_NEED_DICT) {
+                if (inflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(dictionary.data()),
+                                         static_cast<uInt>(dictionary.size())) != Z_OK) {
+                    status = Z_DATA_ERROR;
+                    break;
+                }
+                continue; // retry the same input with the dictionary loaded
+            }
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                break;
+            }
+            size_t produced = output.size() - stream.avail_out;
+            out.write(output.data(), static_cast<streamsize>(produced));
+            written += produced;
+            if (status == Z_STREAM_END || stream.avail_out != 0) {
+                break;
+            }
+        }
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            break;
+        }
+    }
+    inflateEnd(&stream);
+    out.close();
+    if (status != Z_STREAM_END || written != header.originalSize || !out) {
+        monitorErr() << "Restore of " << backupPath << " failed (corrupt or truncated)" << endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,268 @@
+#include "BurstSnapshot.h"
+#include "ChangeJournal.h"
+#include "Log.h"
+#include "Trace.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+int64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+string formatTimestamp(chrono::system_clock::time_point when) {
+    time_t seconds = chrono::system_clock::to_time_t(when);
+    tm local;
+    localtime_r(&seconds, &local);
+    ostringstream out;
+    out << put_time(&local, "%Y-%m-%d %H:%M:%S");
+    return out.str();
+}
+
+// Paths may hold the manifest's separators; escape them and the escape character
+string escapeManifestPath(const string& path) {
+    string escaped;
+    escaped.reserve(path.size());
+    for (char c : path) {
+        switch (c) {
+            case '\\': escaped += "\\\\"; break;
+            case '\t': escaped += "\\t"; break;
+            case '\n': escaped += "\\n"; break;
+            default: escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// "/a/b/c.txt" -> "/a/b", "/a" -> "/", "c.txt" -> ""
+string parentOf(const string& path) {
+    size_t slash = path.rfind('/');
+    if (slash == string::npos) {
+        return "";
+    }
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+} // namespace
+
+BurstSnapshotter::BurstSnapshotter(ChangeJournal& changes, CompletionCallback onComplete, BurstOptions options)
+    : changes(changes), onComplete(std::move(onComplete)), options(options), running(false) {}
+
+BurstSnapshotter::~BurstSnapshotter() {
+    stop();
+}
+
+bool BurstSnapshotter::absorb(const string& filePath, int64_t timestampNs, uint64_t eventId) {
+    lock_guard<mutex> lock(mtx);
+    // Deepest active burst wins
+    for (string dir = parentOf(filePath); !dir.empty(); dir = dir == "/" ? "" : parentOf(dir)) {
+        auto burst = bursts.find(dir);
+        if (burst != bursts.end()) {
+            burst->second.files[filePath].push_back(eventId);
+            burst->second.lastEventNs = timestampNs;
+            return true;
+        }
+    }
+
+    // Fixed windows per directory and per file; the deepest directory over
+    // the threshold becomes the burst root unless one child, a file or a
+    // subdirectory, brought most of its events: then it is only that child's
+    // ancestor and the child becomes the root once it crosses on its own
+    const int64_t windowNs = chrono::duration_cast<chrono::nanoseconds>(options.window).count();
+    auto countEvent = [&](const string& key) {
+        RateWindow& rate = rates[key];
+        if (timestampNs - rate.windowStartNs >= windowNs) {
+            rate.windowStartNs = timestampNs;
+            rate.count = 0;
+        }
+        return ++rate.count;
+    };
+    const size_t levels = rootDepthLimit(filePath);
+    string root;
+    size_t childCount = countEvent(filePath);
+    size_t level = 0;
+    for (string dir = parentOf(filePath); !dir.empty() && level <= levels; dir = dir == "/" ? "" : parentOf(dir), ++level) {
+        const size_t count = countEvent(dir);
+        if (root.empty() && count >= options.threshold && childCount <= options.maxChildShare * count) {
+            root = dir;
+        }
+        childCount = count;
+    }
+    if (root.empty() || !running) {
+        return false;
+    }
+    Burst& burst = bursts[root];
+    burst.root = root;
+    burst.startNs = timestampNs;
+    burst.lastEventNs = timestampNs;
+    burst.files[filePath].push_back(eventId);
+    monitorOut() << "Burst of changes under " << root << ", switching to a batched snapshot" << endl;
+    return true;
+}
+
+void BurstSnapshotter::setRoots(const vector<string>& newRoots) {
+    lock_guard<mutex> lock(mtx);
+    roots.clear();
+    for (string root : newRoots) {
+        while (root.size() > 1 && root.back() == '/') {
+            root.pop_back();
+        }
+        roots.push_back(root);
+    }
+}
+
+// Directory levels above filePath's own that absorb() may count: up to the
+// deepest rule root containing the file, never more than maxRootDepth. An
+// explicitly tracked file outside every root bursts only with its siblings.
+size_t BurstSnapshotter::rootDepthLimit(const string& filePath) const {
+    size_t limit = 0;
+    bool underRoot = false;
+    for (const auto& root : roots) {
+        if (filePath.size() > root.size() && filePath.compare(0, root.size(), root) == 0 &&
+            (root == "/" || filePath[root.size()] == '/')) {
+            // "/srv/repo" and "/srv/repo/src/a.c": the root is one level above "/srv/repo/src"
+            const size_t below = count(filePath.begin() + (root == "/" ? 0 : root.size()), filePath.end(), '/');
+            limit = underRoot ? min(limit, below - 1) : below - 1;
+            underRoot = true;
+        }
+    }
+    return min(limit, options.maxRootDepth);
+}
+
+void BurstSnapshotter::start() {
+    if (running.exchange(true)) {
+        return;
+    }
+    worker = thread([this]() { workerLoop(); });
+}
+
+void BurstSnapshotter::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    for (const auto& burst : takeFinished(nowNs(), true)) {
+        snapshot(burst);
+    }
+}
+
+void BurstSnapshotter::workerLoop() {
+    const auto tick = max(chrono::milliseconds(10), options.quietPeriod / 4);
+    while (running) {
+        for (const auto& burst : takeFinished(nowNs(), false)) {
+            snapshot(burst);
+        }
+        unique_lock<mutex> lock(mtx);
+        wake.wait_for(lock, tick, [this]() { return !running; });
+    }
+}
+
+// Removes and returns the bursts that went quiet or ran too long, and
+// forgets rate windows that have long expired
+vector<BurstSnapshotter::Burst> BurstSnapshotter::takeFinished(int64_t now, bool all) {
+    const int64_t quietNs = chrono::duration_cast<chrono::nanoseconds>(options.quietPeriod).count();
+    const int64_t maxNs = chrono::duration_cast<chrono::nanoseconds>(options.maxDuration).count();
+    const int64_t windowNs = chrono::duration_cast<chrono::nanoseconds>(options.window).count();
+    lock_guard<mutex> lock(mtx);
+    vector<Burst> finished;
+    for (auto it = bursts.begin(); it != bursts.end(); ) {
+        if (all || now - it->second.lastEventNs >= quietNs || now - it->second.startNs >= maxNs) {
+            finished.push_back(std::move(it->second));
+            it = bursts.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = rates.begin(); it != rates.end(); ) {
+        it = now - it->second.windowStartNs >= 2 * windowNs ? rates.erase(it) : next(it);
+    }
+    return finished;
+}
+
+// Copies every file of the burst under one timestamped directory, mirroring
+// absolute paths, and writes a manifest plus a journal record per file. Files
+// are read once each at snapshot time, so the set reflects the tree after
+// the burst rather than every intermediate version.
+void BurstSnapshotter::snapshot(const Burst& burst) {
+    TRACE_SPAN("burst.snapshot");
+    const string timestamp = formatTimestamp(chrono::system_clock::now());
+    fs::path snapshotDir = fs::path(BURST_SNAPSHOT_DIR) / timestamp;
+    error_code ec;
+    for (int suffix = 2; fs::exists(snapshotDir, ec); ++suffix) {
+        snapshotDir = fs::path(BURST_SNAPSHOT_DIR) / (timestamp + "_" + to_string(suffix));
+    }
+    fs::create_directories(snapshotDir, ec);
+
+    struct CopyJob {
+        const string* source;
+        const vector<uint64_t>* eventIds;
+        string backupPath;
+    };
+    vector<CopyJob> jobs;
+    jobs.reserve(burst.files.size());
+    for (const auto& file : burst.files) {
+        jobs.push_back({&file.first, &file.second, ""});
+    }
+
+    atomic<size_t> nextJob(0);
+    auto copyWorker = [&]() {
+        for (size_t i = nextJob++; i < jobs.size(); i = nextJob++) {
+            CopyJob& job = jobs[i];
+            fs::path source = fs::absolute(*job.source).lexically_normal();
+            fs::path dest = snapshotDir / source.relative_path();
+            error_code copyError;
+            fs::create_directories(dest.parent_path(), copyError);
+            if (fs::copy_file(source, dest, fs::copy_options::overwrite_existing, copyError)) {
+                job.backupPath = dest.string();
+            }
+        }
+    };
+    vector<thread> copiers;
+    for (size_t i = 1; i < min(options.copyThreads, jobs.size()); ++i) {
+        copiers.emplace_back(copyWorker);
+    }
+    copyWorker();
+    for (auto& copier : copiers) {
+        copier.join();
+    }
+
+    size_t copied = 0;
+    const fs::path manifestPath = snapshotDir / BURST_MANIFEST_NAME;
+    ofstream manifest(manifestPath);
+    for (const auto& job : jobs) {
+        if (!job.backupPath.empty()) {
+            manifest << escapeManifestPath(*job.source) << "\t" << escapeManifestPath(job.backupPath) << "\n";
+            ++copied;
+        }
+    }
+    manifest.close();
+
+    for (const auto& job : jobs) {
+        if (!job.backupPath.empty() && !changes.record(*job.source, job.backupPath, ChangeKind::Snapshot)) {
+            monitorErr() << "Failed to record change of " << *job.source << endl;
+        }
+    }
+    monitorOut() << "Burst snapshot " << snapshotDir << ": " << copied << " of " << jobs.size() << " files" << endl;
+
+    for (const auto& job : jobs) {
+        for (uint64_t eventId : *job.eventIds) {
+            onComplete(eventId, job.backupPath);
+        }
+    }
+}
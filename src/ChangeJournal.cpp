@@ -0,0 +1,552 @@
+#include "ChangeJournal.h"
+#include "Log.h"
+#include "Trace.h"
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char SEGMENT_MAGIC[8] = {'F', 'M', 'C', 'J', 'S', 'E', 'G', '1'};
+const char INDEX_MAGIC[8] = {'F', 'M', 'C', 'J', 'I', 'D', 'X', '1'};
+const size_t SEGMENT_HEADER_SIZE = 16;   // magic, i64 start in seconds
+const size_t INDEX_HEADER_SIZE = 16;     // magic, u64 count
+const char* PATHS_FILE = "paths.dat";
+const char* TEXT_LOG = "changes.log";
+
+struct RecordHeader {
+    int64_t timeNs;
+    uint32_t pathId;
+    uint16_t kind;
+    uint16_t backupLength;
+};
+static_assert(sizeof(RecordHeader) == 16, "record header must stay packed");
+
+struct IndexPair {
+    uint32_t pathId;
+    uint32_t ordinal;
+};
+
+// Read-only mapping of a whole file
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    bool valid = false;
+
+    explicit MappedFile(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            size = static_cast<size_t>(st.st_size);
+            valid = true;
+            if (size > 0) {
+                void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped == MAP_FAILED) {
+                    valid = false;
+                    size = 0;
+                } else {
+                    data = static_cast<const char*>(mapped);
+                }
+            }
+        }
+        ::close(fd);
+    }
+    ~MappedFile() {
+        if (data) {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+template <typename T>
+T load(const char* data) {
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+string segmentPath(const string& directory, int64_t start, const char* extension) {
+    return directory + "/seg-" + to_string(start) + extension;
+}
+
+// Calls visit for each complete record from offset on; returns the end of the last one
+template <typename Visit>
+size_t scanRecords(const char* data, size_t size, size_t offset, Visit visit) {
+    while (offset + sizeof(RecordHeader) <= size) {
+        RecordHeader header = load<RecordHeader>(data + offset);
+        size_t next = offset + sizeof(RecordHeader) + header.backupLength;
+        if (next > size) {
+            break; // torn tail
+        }
+        if (!visit(offset, header)) {
+            return next;
+        }
+        offset = next;
+    }
+    return offset;
+}
+
+bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Offsets in record order, then (pathId, ordinal) sorted by path id
+bool writeIndex(const string& directory, int64_t start, const vector<pair<uint64_t, uint32_t>>& records) {
+    string index(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    uint64_t count = records.size();
+    index.append(reinterpret_cast<const char*>(&count), sizeof(count));
+    vector<IndexPair> pairs(records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        index.append(reinterpret_cast<const char*>(&records[i].first), sizeof(uint64_t));
+        pairs[i] = {records[i].second, static_cast<uint32_t>(i)};
+    }
+    stable_sort(pairs.begin(), pairs.end(), [](const IndexPair& a, const IndexPair& b) { return a.pathId < b.pathId; });
+    index.append(reinterpret_cast<const char*>(pairs.data()), pairs.size() * sizeof(IndexPair));
+
+    const string path = segmentPath(directory, start, ".idx");
+    const string tmpPath = path + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || !writeAll(fd, index.data(), index.size())) {
+        monitorErr() << "Failed to write " << tmpPath << ": " << strerror(errno) << endl;
+        if (fd != -1) {
+            ::close(fd);
+        }
+        return false;
+    }
+    ::close(fd);
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+// Start times of the segments under directory, oldest first
+vector<int64_t> listSegments(const string& directory) {
+    vector<int64_t> starts;
+    error_code ec;
+    for (const auto& entry : fs::directory_iterator(directory, ec)) {
+        const string name = entry.path().filename().string();
+        if (name.size() > 8 && name.compare(0, 4, "seg-") == 0 && entry.path().extension() == ".dat") {
+            try {
+                starts.push_back(stoll(name.substr(4, name.size() - 8)));
+            } catch (const exception&) {
+            }
+        }
+    }
+    sort(starts.begin(), starts.end());
+    return starts;
+}
+
+bool indexValid(const string& directory, int64_t start) {
+    MappedFile index(segmentPath(directory, start, ".idx"));
+    if (!index.valid || index.size < INDEX_HEADER_SIZE || memcmp(index.data, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+        return false;
+    }
+    uint64_t count = load<uint64_t>(index.data + 8);
+    return index.size == INDEX_HEADER_SIZE + count * (sizeof(uint64_t) + sizeof(IndexPair));
+}
+
+// Records of a segment file as (offset, pathId); end receives the end of the last complete one
+vector<pair<uint64_t, uint32_t>> readSegmentRecords(const string& path, int64_t& lastTimeNs, size_t& end) {
+    vector<pair<uint64_t, uint32_t>> records;
+    MappedFile segment(path);
+    end = segment.size;
+    if (segment.size < SEGMENT_HEADER_SIZE) {
+        return records;
+    }
+    end = scanRecords(segment.data, segment.size, SEGMENT_HEADER_SIZE, [&](size_t offset, const RecordHeader& header) {
+        records.emplace_back(offset, header.pathId);
+        lastTimeNs = max(lastTimeNs, header.timeNs);
+        return true;
+    });
+    return records;
+}
+
+string formatLocalTime(int64_t timeNs) {
+    time_t seconds = static_cast<time_t>(timeNs / 1000000000);
+    tm local;
+    localtime_r(&seconds, &local);
+    ostringstream out;
+    out << put_time(&local, "%Y-%m-%d %H:%M:%S");
+    return out.str();
+}
+
+} // namespace
+
+ChangeJournal::~ChangeJournal() {
+    close();
+}
+
+void ChangeJournal::sealSegment() {
+    if (segmentFd == -1) {
+        return;
+    }
+    writeIndex(options.directory, segmentStart, segmentRecords);
+    ::close(segmentFd);
+    segmentFd = -1;
+    segmentRecords.clear();
+}
+
+bool ChangeJournal::openSegment(int64_t start) {
+    const string path = segmentPath(options.directory, start, ".dat");
+    size_t end = 0;
+    segmentRecords = readSegmentRecords(path, lastTimeNs, end);
+    segmentFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (segmentFd == -1) {
+        monitorErr() << "Failed to open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    segmentStart = start;
+    if (end < SEGMENT_HEADER_SIZE) {
+        char header[SEGMENT_HEADER_SIZE];
+        memcpy(header, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+        memcpy(header + 8, &start, sizeof(start));
+        if (ftruncate(segmentFd, 0) == -1 || !writeAll(segmentFd, header, sizeof(header))) {
+            return false;
+        }
+        end = SEGMENT_HEADER_SIZE;
+    } else if (ftruncate(segmentFd, static_cast<off_t>(end)) == -1) {
+        return false;
+    }
+    segmentSize = end;
+    return true;
+}
+
+bool ChangeJournal::pathId(const string& path, uint32_t& id) {
+    auto it = pathIds.find(path);
+    if (it != pathIds.end()) {
+        id = it->second;
+        return true;
+    }
+    string entry(sizeof(uint32_t), '\0');
+    uint32_t length = static_cast<uint32_t>(path.size());
+    memcpy(&entry[0], &length, sizeof(length));
+    entry += path;
+    if (!writeAll(pathsFd, entry.data(), entry.size())) {
+        return false;
+    }
+    id = static_cast<uint32_t>(pathIds.size());
+    pathIds.emplace(path, id);
+    return true;
+}
+
+void ChangeJournal::closeFiles() {
+    sealSegment();
+    if (pathsFd != -1) {
+        ::close(pathsFd); // also releases the directory lock
+        pathsFd = -1;
+    }
+    pathIds.clear();
+    opened = false;
+}
+
+bool ChangeJournal::open(const ChangeJournalOptions& journalOptions) {
+    lock_guard<mutex> lock(mtx);
+    closeFiles();
+    if (!journalOptions.enabled) {
+        return false;
+    }
+    options = journalOptions;
+    if (options.segmentDuration.count() <= 0) {
+        options.segmentDuration = chrono::seconds(3600);
+    }
+    error_code ec;
+    fs::create_directories(options.directory, ec);
+
+    // One writer per directory: a second journal would interleave appends
+    const string pathsFile = options.directory + "/" + PATHS_FILE;
+    pathsFd = ::open(pathsFile.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (pathsFd == -1) {
+        monitorErr() << "Failed to open " << pathsFile << ": " << strerror(errno) << endl;
+        return false;
+    }
+    if (flock(pathsFd, LOCK_EX | LOCK_NB) == -1) {
+        monitorErr() << "Change journal " << options.directory << " is in use by another monitor, using " << TEXT_LOG << endl;
+        closeFiles();
+        return false;
+    }
+    size_t end = 0;
+    {
+        MappedFile paths(pathsFile);
+        while (end + sizeof(uint32_t) <= paths.size) {
+            uint32_t length = load<uint32_t>(paths.data + end);
+            if (end + sizeof(uint32_t) + length > paths.size) {
+                break;
+            }
+            pathIds.emplace(string(paths.data + end + sizeof(uint32_t), length), static_cast<uint32_t>(pathIds.size()));
+            end += sizeof(uint32_t) + length;
+        }
+    }
+    if (ftruncate(pathsFd, static_cast<off_t>(end)) == -1) {
+        monitorErr() << "Failed to open " << pathsFile << ": " << strerror(errno) << endl;
+        closeFiles();
+        return false;
+    }
+    // Index segments left unsealed by a crash; the newest one also gives
+    // the time new records must not go below
+    lastTimeNs = 0;
+    vector<int64_t> segments = listSegments(options.directory);
+    for (int64_t start : segments) {
+        if (start == segments.back() || !indexValid(options.directory, start)) {
+            size_t segmentEnd = 0;
+            auto records = readSegmentRecords(segmentPath(options.directory, start, ".dat"), lastTimeNs, segmentEnd);
+            if (!indexValid(options.directory, start)) {
+                writeIndex(options.directory, start, records);
+            }
+        }
+    }
+    opened = true;
+    return true;
+}
+
+void ChangeJournal::close() {
+    lock_guard<mutex> lock(mtx);
+    closeFiles();
+}
+
+bool ChangeJournal::record(const string& filePath, const string& backupPath, ChangeKind kind) {
+    TRACE_SPAN("change_journal.append");
+    const int64_t nowNs = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    unique_lock<mutex> lock(mtx);
+    if (!opened) {
+        lock.unlock();
+        ofstream changeLog(TEXT_LOG, ios::app);
+        if (!changeLog.is_open()) {
+            return false;
+        }
+        writeChangeLine(changeLog, {nowNs, kind, filePath, backupPath});
+        return true;
+    }
+    // Time never goes backwards inside the journal, so segments stay sorted
+    const int64_t timeNs = max(nowNs, lastTimeNs);
+    lastTimeNs = timeNs;
+    const int64_t duration = options.segmentDuration.count();
+    const int64_t seconds = timeNs / 1000000000;
+    const int64_t start = seconds - ((seconds % duration) + duration) % duration;
+    if (segmentFd == -1 || start != segmentStart) {
+        sealSegment();
+        if (!openSegment(start)) {
+            return false;
+        }
+    }
+
+    uint32_t id;
+    if (!pathId(filePath, id)) {
+        monitorErr() << "Failed to append to the change journal's path dictionary: " << strerror(errno) << endl;
+        return false;
+    }
+    RecordHeader header{timeNs, id, static_cast<uint16_t>(kind),
+                        static_cast<uint16_t>(min<size_t>(backupPath.size(), UINT16_MAX))};
+    string record(reinterpret_cast<const char*>(&header), sizeof(header));
+    record.append(backupPath, 0, header.backupLength);
+    if (!writeAll(segmentFd, record.data(), record.size())) {
+        monitorErr() << "Failed to append to the change journal: " << strerror(errno) << endl;
+        return false;
+    }
+    segmentRecords.emplace_back(segmentSize, id);
+    segmentSize += record.size();
+    return true;
+}
+
+void ChangeJournal::sync() {
+    int paths = -1;
+    int segment = -1;
+    {
+        // Duplicates, so the segment can be sealed while they are synced
+        lock_guard<mutex> lock(mtx);
+        if (!opened) {
+            paths = ::open(TEXT_LOG, O_RDONLY | O_CLOEXEC);
+        } else {
+            paths = dup(pathsFd);
+            segment = segmentFd == -1 ? -1 : dup(segmentFd);
+        }
+    }
+    for (int fd : {paths, segment}) {
+        if (fd != -1) {
+            fdatasync(fd);
+            ::close(fd);
+        }
+    }
+}
+
+long long queryChanges(const string& directory, const ChangeQuery& query,
+                       const function<void(const ChangeEntry&)>& visit) {
+    MappedFile paths(directory + "/" + PATHS_FILE);
+    if (!paths.valid) {
+        return -1;
+    }
+    // Path ids under the prefix; "/etc" selects /etc and /etc/..., not /etcd
+    vector<string_view> pathViews;
+    vector<char> selected;
+    vector<uint32_t> selectedIds;
+    for (size_t offset = 0; offset + sizeof(uint32_t) <= paths.size; ) {
+        uint32_t length = load<uint32_t>(paths.data + offset);
+        if (offset + sizeof(uint32_t) + length > paths.size) {
+            break;
+        }
+        string_view path(paths.data + offset + sizeof(uint32_t), length);
+        bool match = path.compare(0, query.prefix.size(), query.prefix) == 0 &&
+                     (path.size() == query.prefix.size() || query.prefix.empty() ||
+                      query.prefix.back() == '/' || path[query.prefix.size()] == '/');
+        pathViews.push_back(path);
+        selected.push_back(match);
+        if (match) {
+            selectedIds.push_back(static_cast<uint32_t>(pathViews.size() - 1));
+        }
+        offset += sizeof(uint32_t) + length;
+    }
+    if (selectedIds.empty()) {
+        return 0;
+    }
+
+    long long matched = 0;
+    vector<int64_t> segments = listSegments(directory);
+    for (size_t s = 0; s < segments.size(); ++s) {
+        // A segment runs until the next one starts
+        const int64_t startNs = segments[s] * 1000000000;
+        if (startNs >= query.toNs) {
+            break;
+        }
+        if (s + 1 < segments.size() && segments[s + 1] * 1000000000 <= query.fromNs) {
+            continue;
+        }
+        TRACE_SPAN("change_journal.query_segment");
+        MappedFile segment(segmentPath(directory, segments[s], ".dat"));
+        if (segment.size < SEGMENT_HEADER_SIZE || memcmp(segment.data, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0) {
+            continue;
+        }
+
+        bool stop = false;
+        // Returns false once the time range or the limit is exhausted
+        auto consider = [&](size_t offset, const RecordHeader& header) {
+            if (header.timeNs >= query.toNs) {
+                stop = true;
+                return false;
+            }
+            if (header.timeNs < query.fromNs || header.pathId >= pathViews.size() || !selected[header.pathId]) {
+                return true;
+            }
+            visit({header.timeNs, static_cast<ChangeKind>(header.kind), pathViews[header.pathId],
+                   string_view(segment.data + offset + sizeof(RecordHeader), header.backupLength)});
+            if (++matched == static_cast<long long>(query.limit)) {
+                stop = true;
+                return false;
+            }
+            return true;
+        };
+        auto recordAt = [&](uint64_t offset, RecordHeader& header) {
+            if (offset + sizeof(RecordHeader) > segment.size) {
+                return false;
+            }
+            header = load<RecordHeader>(segment.data + offset);
+            return offset + sizeof(RecordHeader) + header.backupLength <= segment.size;
+        };
+
+        size_t tail = SEGMENT_HEADER_SIZE;
+        MappedFile index(segmentPath(directory, segments[s], ".idx"));
+        uint64_t count = index.size >= INDEX_HEADER_SIZE ? load<uint64_t>(index.data + 8) : 0;
+        if (index.size >= INDEX_HEADER_SIZE && memcmp(index.data, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+            index.size == INDEX_HEADER_SIZE + count * (sizeof(uint64_t) + sizeof(IndexPair)) && count > 0) {
+            const char* offsets = index.data + INDEX_HEADER_SIZE;
+            const char* pairs = offsets + count * sizeof(uint64_t);
+            auto offsetOf = [&](uint64_t ordinal) { return load<uint64_t>(offsets + ordinal * sizeof(uint64_t)); };
+            RecordHeader header;
+            if (!recordAt(offsetOf(count - 1), header)) {
+                continue; // index does not belong to this file
+            }
+            tail = offsetOf(count - 1) + sizeof(RecordHeader) + header.backupLength;
+
+            if (selectedIds.size() < count / 16) {
+                // Few paths: gather their ordinals from the path id index
+                vector<uint32_t> ordinals;
+                for (uint32_t id : selectedIds) {
+                    uint64_t low = 0, high = count;
+                    while (low < high) {
+                        uint64_t mid = (low + high) / 2;
+                        if (load<IndexPair>(pairs + mid * sizeof(IndexPair)).pathId < id) {
+                            low = mid + 1;
+                        } else {
+                            high = mid;
+                        }
+                    }
+                    for (; low < count; ++low) {
+                        IndexPair pair = load<IndexPair>(pairs + low * sizeof(IndexPair));
+                        if (pair.pathId != id) {
+                            break;
+                        }
+                        ordinals.push_back(pair.ordinal);
+                    }
+                }
+                sort(ordinals.begin(), ordinals.end());
+                for (uint32_t ordinal : ordinals) {
+                    uint64_t offset = offsetOf(ordinal);
+                    if (!recordAt(offset, header) || !consider(offset, header)) {
+                        break;
+                    }
+                }
+            } else {
+                // Many paths: binary search the time index for the start of the range
+                uint64_t low = 0, high = count;
+                while (low < high) {
+                    uint64_t mid = (low + high) / 2;
+                    if (recordAt(offsetOf(mid), header) && header.timeNs < query.fromNs) {
+                        low = mid + 1;
+                    } else {
+                        high = mid;
+                    }
+                }
+                for (; low < count; ++low) {
+                    uint64_t offset = offsetOf(low);
+                    if (!recordAt(offset, header) || !consider(offset, header)) {
+                        break;
+                    }
+                }
+            }
+        }
+        // Records past the index (the open segment, or appended after a restart)
+        if (!stop) {
+            scanRecords(segment.data, segment.size, tail, consider);
+        }
+        if (query.limit > 0 && matched >= static_cast<long long>(query.limit)) {
+            break;
+        }
+    }
+    return matched;
+}
+
+void writeChangeLine(ostream& out, const ChangeEntry& entry) {
+    out << formatLocalTime(entry.timeNs) << ": " << entry.path
+        << (entry.kind == ChangeKind::Snapshot ? " (snapshot: " : " (backup: ")
+        << quoted(string(entry.backupPath)) << ")\n";
+}
@@ -0,0 +1,235 @@
+#include "DirectoryCache.h"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+
+using namespace std;
+
+namespace {
+
+// Layout of the records returned by getdents64(2)
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+const size_t GETDENTS_BUFFER = 1024 * 1024;
+const auto RELOAD_INTERVAL = chrono::seconds(1);  // busy spool dirs are re-read at most this often
+
+bool sortsBefore(const DirEntry& a, const DirEntry& b) {
+    if (a.type == DT_DIR && b.type != DT_DIR) return true;
+    if (a.type != DT_DIR && b.type == DT_DIR) return false;
+    return a.name < b.name;
+}
+
+// Same rules as the old readdir loop: a link to a directory counts as a directory
+char resolveType(int dirFd, const char* name) {
+    struct stat st;
+    if (fstatat(dirFd, name, &st, 0) == 0 && S_ISDIR(st.st_mode)) return DT_DIR;
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        if (S_ISLNK(st.st_mode)) return DT_LNK;
+        if (S_ISREG(st.st_mode)) return DT_REG;
+    }
+    return DT_UNKNOWN;
+}
+
+} // namespace
+
+bool readDirectoryChunks(int dirFd, const function<void(vector<DirEntry>&)>& onChunk) {
+    vector<char> buffer(GETDENTS_BUFFER);
+    vector<DirEntry> chunk;
+    while (true) {
+        long bytes = syscall(SYS_getdents64, dirFd, buffer.data(), buffer.size());
+        if (bytes <= 0) {
+            return bytes == 0;
+        }
+        chunk.clear();
+        for (long offset = 0; offset < bytes; ) {
+            auto* entry = reinterpret_cast<LinuxDirent64*>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char type = static_cast<char>(entry->d_type);
+            if (type == DT_UNKNOWN) {
+                type = resolveType(dirFd, entry->d_name);
+            }
+            chunk.push_back({entry->d_name, type});
+        }
+        onChunk(chunk);
+    }
+}
+
+void loadDirectory(DirectoryListing& listing) {
+    int fd = open(listing.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        listing.failed = true;
+        listing.complete = true;
+        ++listing.version;
+        return;
+    }
+    bool ok = readDirectoryChunks(fd, [&listing](vector<DirEntry>& chunk) {
+        // Sort the chunk on its own, then merge it into the published order
+        vector<uint32_t> chunkOrder(chunk.size());
+        lock_guard<mutex> lock(listing.mtx);
+        uint32_t base = static_cast<uint32_t>(listing.entries.size());
+        for (auto& entry : chunk) {
+            listing.entries.push_back(std::move(entry));
+        }
+        for (uint32_t i = 0; i < chunkOrder.size(); ++i) {
+            chunkOrder[i] = base + i;
+        }
+        const auto& entries = listing.entries;
+        auto less = [&entries](uint32_t a, uint32_t b) { return sortsBefore(entries[a], entries[b]); };
+        sort(chunkOrder.begin(), chunkOrder.end(), less);
+        size_t middle = listing.order.size();
+        listing.order.insert(listing.order.end(), chunkOrder.begin(), chunkOrder.end());
+        inplace_merge(listing.order.begin(), listing.order.begin() + middle, listing.order.end(), less);
+        ++listing.version;
+    });
+    if (!ok) {
+        listing.failed = true;
+    }
+    close(fd);
+    listing.loadedAt = chrono::steady_clock::now();
+    listing.complete = true;
+    ++listing.version;
+}
+
+DirectoryCache::DirectoryCache(size_t maxDirectories)
+    : maxDirectories(max<size_t>(1, maxDirectories)),
+      inotifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), stopping(false) {
+    loader = thread([this]() { loaderLoop(); });
+}
+
+DirectoryCache::~DirectoryCache() {
+    {
+        lock_guard<mutex> lock(queueMtx);
+        stopping = true;
+    }
+    queueWake.notify_all();
+    loader.join();
+    if (inotifyFd != -1) {
+        close(inotifyFd);
+    }
+}
+
+shared_ptr<DirectoryListing> DirectoryCache::get(const string& dir) {
+    auto it = cache.find(dir);
+    if (it == cache.end()) {
+        CacheEntry entry;
+        // Watch before reading so that no change between the two is missed
+        if (inotifyFd != -1) {
+            entry.wd = inotify_add_watch(inotifyFd, dir.c_str(),
+                                         IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                         IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+            if (entry.wd != -1) {
+                watchedDirs[entry.wd] = dir;
+            }
+        }
+        entry.current = make_shared<DirectoryListing>();
+        entry.current->path = dir;
+        lru.push_front(dir);
+        entry.lruPosition = lru.begin();
+        it = cache.emplace(dir, std::move(entry)).first;
+        schedule(it->second.current);
+        evict();
+        return it->second.current;
+    }
+
+    CacheEntry& entry = it->second;
+    lru.splice(lru.begin(), lru, entry.lruPosition);
+    if (entry.reloading && entry.reloading->complete) {
+        entry.current = std::move(entry.reloading);
+        entry.reloading.reset();
+    }
+    const auto& current = entry.current;
+    if (current->stale && current->complete && !entry.reloading &&
+        chrono::steady_clock::now() - current->loadedAt >= RELOAD_INTERVAL) {
+        entry.reloading = make_shared<DirectoryListing>();
+        entry.reloading->path = dir;
+        schedule(entry.reloading);
+    }
+    return entry.current;
+}
+
+bool DirectoryCache::pollInvalidations() {
+    if (inotifyFd == -1) {
+        return false;
+    }
+    alignas(struct inotify_event) char buffer[16 * 1024];
+    bool invalidated = false;
+    while (true) {
+        ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            break;
+        }
+        for (char* ptr = buffer; ptr < buffer + length; ) {
+            auto* event = reinterpret_cast<struct inotify_event*>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+            auto watched = watchedDirs.find(event->wd);
+            if (watched == watchedDirs.end()) {
+                continue;
+            }
+            auto cached = cache.find(watched->second);
+            if (cached != cache.end()) {
+                cached->second.current->stale = true;
+                if (cached->second.reloading) {
+                    cached->second.reloading->stale = true;
+                }
+                invalidated = true;
+            }
+            if (event->mask & IN_IGNORED) {
+                watchedDirs.erase(watched);
+            }
+        }
+    }
+    return invalidated;
+}
+
+void DirectoryCache::schedule(const shared_ptr<DirectoryListing>& listing) {
+    {
+        lock_guard<mutex> lock(queueMtx);
+        // The directory being looked at goes first
+        queue.push_front(listing);
+    }
+    queueWake.notify_one();
+}
+
+void DirectoryCache::loaderLoop() {
+    while (true) {
+        shared_ptr<DirectoryListing> listing;
+        {
+            unique_lock<mutex> lock(queueMtx);
+            queueWake.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            listing = std::move(queue.front());
+            queue.pop_front();
+        }
+        loadDirectory(*listing);
+    }
+}
+
+// Drops the least recently used listings beyond the limit
+void DirectoryCache::evict() {
+    while (cache.size() > maxDirectories) {
+        auto it = cache.find(lru.back());
+        lru.pop_back();
+        if (it->second.wd != -1) {
+            inotify_rm_watch(inotifyFd, it->second.wd);
+            watchedDirs.erase(it->second.wd);
+        }
+        cache.erase(it);
+    }
+}
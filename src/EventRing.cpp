@@ -0,0 +1,270 @@
+#include "EventRing.h"
+#include "Log.h"
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+using namespace std;
+
+namespace {
+
+const uint64_t RING_MAGIC = 0x474e4952544e5645ULL; // "EVNTRING"
+const uint32_t RING_VERSION = 1;
+const uint64_t SLOT_WRITING = UINT64_MAX;
+
+size_t slotsOffset() {
+    return (sizeof(RingHeader) + 63) & ~size_t(63);
+}
+
+int futexCall(atomic<uint32_t>* word, int op, uint32_t value, const timespec* timeout) {
+    return static_cast<int>(syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value, timeout, nullptr, 0));
+}
+
+bool processAlive(int32_t pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+} // namespace
+
+EventRingWriter::EventRingWriter() : header(nullptr), slots(nullptr), mappedSize(0) {}
+
+EventRingWriter::~EventRingWriter() {
+    close();
+}
+
+bool EventRingWriter::open(const string& ringName, uint32_t slotCount) {
+    close();
+    uint32_t count = 1;
+    while (count < slotCount) {
+        count <<= 1;
+    }
+
+    // Consumers still attached to a previous ring keep their mapping and
+    // notice through producerPid that nobody writes to it any more
+    shm_unlink(ringName.c_str());
+    int fd = shm_open(ringName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1) {
+        monitorErr() << "shm_open " << ringName << ": " << strerror(errno) << endl;
+        return false;
+    }
+    size_t size = slotsOffset() + size_t(count) * sizeof(RingSlot);
+    if (ftruncate(fd, static_cast<off_t>(size)) == -1) {
+        monitorErr() << "ftruncate " << ringName << ": " << strerror(errno) << endl;
+        ::close(fd);
+        shm_unlink(ringName.c_str());
+        return false;
+    }
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+        monitorErr() << "mmap " << ringName << ": " << strerror(errno) << endl;
+        shm_unlink(ringName.c_str());
+        return false;
+    }
+
+    // ftruncate zero-fills, which is a valid initial state for every atomic
+    header = static_cast<RingHeader*>(mem);
+    slots = reinterpret_cast<RingSlot*>(static_cast<char*>(mem) + slotsOffset());
+    mappedSize = size;
+    name = ringName;
+    header->version = RING_VERSION;
+    header->slotCount = count;
+    header->producerPid.store(getpid());
+    for (uint32_t i = 0; i < count; ++i) {
+        slots[i].sequence.store(SLOT_WRITING, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_release);
+    header->magic = RING_MAGIC;
+    monitorOut() << "Publishing events to shared memory ring " << name << " (" << count << " slots)" << endl;
+    return true;
+}
+
+void EventRingWriter::close() {
+    lock_guard<mutex> lock(publishMtx);
+    if (!header) {
+        return;
+    }
+    header->producerPid.store(0);
+    header->wakeWord.fetch_add(1);
+    futexCall(&header->wakeWord, FUTEX_WAKE, INT_MAX, nullptr);
+    munmap(header, mappedSize);
+    shm_unlink(name.c_str());
+    header = nullptr;
+    slots = nullptr;
+}
+
+void EventRingWriter::publish(const EventBatch& batch) {
+    lock_guard<mutex> lock(publishMtx);
+    if (!header || batch.empty()) {
+        return;
+    }
+    const uint64_t slotMask = header->slotCount - 1;
+    uint64_t sequence = header->head.load(memory_order_relaxed);
+    for (const auto& event : batch) {
+        RingSlot& slot = slots[sequence & slotMask];
+        // Seqlock write: mark the slot busy, fill it, then publish its sequence
+        slot.sequence.store(SLOT_WRITING, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        size_t length = min(event.path.size(), sizeof(slot.path));
+        slot.mask = event.mask;
+        slot.flags = length < event.path.size() ? RING_PATH_TRUNCATED : 0;
+        slot.pathLength = static_cast<uint16_t>(length);
+        slot.timestampNs = event.timestampNs;
+        memcpy(slot.path, event.path.data(), length);
+        slot.sequence.store(sequence, memory_order_release);
+        ++sequence;
+    }
+    header->head.store(sequence, memory_order_release);
+
+    header->wakeWord.fetch_add(1);
+    if (header->sleepers.load() > 0) {
+        futexCall(&header->wakeWord, FUTEX_WAKE, INT_MAX, nullptr);
+    }
+}
+
+EventRingReader::EventRingReader()
+    : header(nullptr), slots(nullptr), mappedSize(0), cursor(nullptr), position(0) {}
+
+EventRingReader::~EventRingReader() {
+    close();
+}
+
+bool EventRingReader::open(const string& ringName) {
+    close();
+    int fd = shm_open(ringName.c_str(), O_RDWR, 0);
+    if (fd == -1) {
+        monitorErr() << "shm_open " << ringName << ": " << strerror(errno) << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < slotsOffset()) {
+        monitorErr() << "Event ring " << ringName << " is not initialized" << endl;
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+        monitorErr() << "mmap " << ringName << ": " << strerror(errno) << endl;
+        return false;
+    }
+    RingHeader* candidate = static_cast<RingHeader*>(mem);
+    if (candidate->magic != RING_MAGIC || candidate->version != RING_VERSION ||
+        slotsOffset() + size_t(candidate->slotCount) * sizeof(RingSlot) > size) {
+        monitorErr() << "Event ring " << ringName << " has an unknown layout" << endl;
+        munmap(mem, size);
+        return false;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    // Claim a free cursor entry, reusing ones left behind by dead consumers
+    int32_t self = getpid();
+    for (auto& entry : candidate->consumers) {
+        int32_t owner = entry.pid.load();
+        if ((owner == 0 || !processAlive(owner)) && entry.pid.compare_exchange_strong(owner, self)) {
+            cursor = &entry;
+            break;
+        }
+    }
+    if (!cursor) {
+        monitorErr() << "Event ring " << ringName << " has no free consumer cursors" << endl;
+        munmap(mem, size);
+        return false;
+    }
+
+    header = candidate;
+    slots = reinterpret_cast<RingSlot*>(static_cast<char*>(mem) + slotsOffset());
+    mappedSize = size;
+    position = header->head.load(memory_order_acquire);
+    cursor->overruns.store(0);
+    cursor->position.store(position);
+    return true;
+}
+
+void EventRingReader::close() {
+    if (!header) {
+        return;
+    }
+    cursor->pid.store(0);
+    munmap(header, mappedSize);
+    header = nullptr;
+    slots = nullptr;
+    cursor = nullptr;
+}
+
+size_t EventRingReader::poll(const function<void(const RingEvent&)>& callback, size_t maxEvents) {
+    if (!header) {
+        return 0;
+    }
+    const uint64_t slotCount = header->slotCount;
+    uint64_t head = header->head.load(memory_order_acquire);
+    size_t delivered = 0;
+
+    while (position < head && delivered < maxEvents) {
+        if (head - position > slotCount) {
+            // Lapped: everything older than one ring length is gone
+            uint64_t resume = head - slotCount;
+            cursor->overruns.fetch_add(resume - position, memory_order_relaxed);
+            position = resume;
+        }
+        RingSlot& slot = slots[position & (slotCount - 1)];
+        uint64_t before = slot.sequence.load(memory_order_acquire);
+        if (before != position) {
+            // The producer is rewriting this slot for a later lap
+            cursor->overruns.fetch_add(1, memory_order_relaxed);
+            ++position;
+            head = header->head.load(memory_order_acquire);
+            continue;
+        }
+        RingEvent event;
+        event.sequence = position;
+        event.mask = slot.mask;
+        event.flags = slot.flags;
+        event.timestampNs = slot.timestampNs;
+        size_t length = min<size_t>(slot.pathLength, sizeof(pathCopy));
+        memcpy(pathCopy, slot.path, length);
+        atomic_thread_fence(memory_order_acquire);
+        if (slot.sequence.load(memory_order_relaxed) != before) {
+            cursor->overruns.fetch_add(1, memory_order_relaxed);
+            ++position;
+            continue;
+        }
+        event.path = string_view(pathCopy, length);
+        ++position;
+        ++delivered;
+        callback(event);
+    }
+    cursor->position.store(position, memory_order_release);
+    return delivered;
+}
+
+void EventRingReader::wait(int timeoutMs) {
+    if (!header) {
+        return;
+    }
+    uint32_t word = header->wakeWord.load();
+    if (header->head.load(memory_order_acquire) != position || !producerAlive()) {
+        return;
+    }
+    timespec timeout{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    header->sleepers.fetch_add(1);
+    futexCall(&header->wakeWord, FUTEX_WAIT, word, &timeout);
+    header->sleepers.fetch_sub(1);
+}
+
+uint64_t EventRingReader::overruns() const {
+    return cursor ? cursor->overruns.load() : 0;
+}
+
+bool EventRingReader::producerAlive() const {
+    return header && processAlive(header->producerPid.load());
+}
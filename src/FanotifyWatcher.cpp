@@ -0,0 +1,471 @@
+#include "FanotifyWatcher.h"
+#include "Log.h"
+#include "Trace.h"
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/fanotify.h>
+
+using namespace std;
+
+namespace {
+
+// Older glibc has no <sys/fanotify.h>, so the two calls go through syscall()
+int fanotifyInit(unsigned int flags, unsigned int eventFlags) {
+    return static_cast<int>(syscall(SYS_fanotify_init, flags, eventFlags));
+}
+
+int fanotifyMark(int fd, unsigned int flags, uint64_t mask, int dirFd, const char* path) {
+    return static_cast<int>(syscall(SYS_fanotify_mark, fd, flags, mask, dirFd, path));
+}
+
+// Subscribers receive inotify masks; fanotify reuses the same bit values
+static_assert(FAN_MODIFY == IN_MODIFY && FAN_CLOSE_WRITE == IN_CLOSE_WRITE && FAN_MOVED_TO == IN_MOVED_TO,
+              "fanotify and inotify masks differ");
+
+const uint64_t FILE_EVENTS = FAN_MODIFY | FAN_CLOSE_WRITE | FAN_MOVED_TO;
+const uint64_t MARK_MASK = FILE_EVENTS | FAN_MOVED_FROM | FAN_ONDIR;  // directory renames invalidate cached paths
+
+uint64_t fsidOf(const void* fsid) {
+    uint64_t id;
+    memcpy(&id, fsid, sizeof(id));
+    return id;
+}
+
+bool isPathUnder(const string& path, const string& dirPath) {
+    if (dirPath == "/") {
+        return !path.empty() && path[0] == '/';
+    }
+    return path.compare(0, dirPath.size(), dirPath) == 0 && (path.size() == dirPath.size() || path[dirPath.size()] == '/');
+}
+
+// Mount points from /proc/self/mountinfo, where spaces and the like are octal escapes
+vector<string> mountPoints() {
+    vector<string> mounts;
+    ifstream in("/proc/self/mountinfo");
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string id, parent, device, root, escaped;
+        if (!(fields >> id >> parent >> device >> root >> escaped)) {
+            continue;
+        }
+        string mount;
+        for (size_t i = 0; i < escaped.size(); ++i) {
+            if (escaped[i] == '\\' && i + 3 < escaped.size()) {
+                mount += static_cast<char>(stoi(escaped.substr(i + 1, 3), nullptr, 8));
+                i += 3;
+            } else {
+                mount += escaped[i];
+            }
+        }
+        mounts.push_back(std::move(mount));
+    }
+    return mounts;
+}
+
+// Mount id of path; -1 if its filesystem has no file handles, in which
+// case fanotify cannot report its directories either
+int mountIdOf(const string& path) {
+    vector<uint64_t> buffer((sizeof(struct file_handle) + MAX_HANDLE_SZ + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    auto* handle = reinterpret_cast<struct file_handle*>(buffer.data());
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mountId = -1;
+    if (name_to_handle_at(AT_FDCWD, path.c_str(), handle, &mountId, 0) == -1) {
+        return -1;
+    }
+    return mountId;
+}
+
+bool canonicalPath(const string& path, string& canonical) {
+    char resolved[PATH_MAX];
+    if (!realpath(path.c_str(), resolved)) {
+        return false;
+    }
+    canonical = resolved;
+    return true;
+}
+
+} // namespace
+
+FanotifyWatcher::FanotifyWatcher(EventDispatcher dispatch, RuleFilter ruleFilter, FanotifyOptions options)
+    : dispatch(std::move(dispatch)), ruleFilter(std::move(ruleFilter)), options(options),
+      fanotifyFd(-1), running(false) {}
+
+FanotifyWatcher::~FanotifyWatcher() {
+    stop();
+    for (const auto& mount : mountFds) {
+        ::close(mount.second);
+    }
+    if (fanotifyFd != -1) {
+        ::close(fanotifyFd);
+    }
+}
+
+bool FanotifyWatcher::open() {
+    if (fanotifyFd != -1) {
+        return true;
+    }
+    fanotifyFd = fanotifyInit(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+                              O_RDONLY | O_LARGEFILE);
+    if (fanotifyFd == -1) {
+        monitorErr() << "fanotify_init: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+// mtx must be held; dirPath must be a directory on mount mountId. Filesystem
+// marks need CAP_SYS_ADMIN, and file handles need a filesystem id, so either
+// can fail for one filesystem and work for another. Handles resolve through
+// the mount the filesystem was marked from; through any other mount of it
+// they would name paths outside that mount, so those are refused.
+bool FanotifyWatcher::markFilesystem(const string& dirPath, dev_t device, int mountId) {
+    auto known = filesystems.find(device);
+    if (known != filesystems.end()) {
+        return known->second && mountIds[device] == mountId;
+    }
+    bool marked = false;
+    struct statfs info;
+    // open_by_handle_at() refuses O_PATH descriptors
+    int mountFd = ::open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mountFd != -1 && mountId != -1 && fstatfs(mountFd, &info) == 0 &&
+        fanotifyMark(fanotifyFd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, MARK_MASK, AT_FDCWD, dirPath.c_str()) == 0) {
+        uint64_t fsid = fsidOf(&info.f_fsid);
+        if (mountFds.emplace(fsid, mountFd).second) {
+            mountFd = -1;
+        }
+        mountIds[device] = mountId;
+        marked = true;
+        monitorOut() << "fanotify: watching the filesystem of " << dirPath << endl;
+    } else {
+        monitorErr() << "fanotify: cannot mark the filesystem of " << dirPath << ": " << strerror(errno) << endl;
+    }
+    if (mountFd != -1) {
+        ::close(mountFd);
+    }
+    filesystems[device] = marked;
+    return marked;
+}
+
+// mtx must be held. Remembers the last directory, because the files of one
+// directory are usually added together and realpath() costs a syscall per component.
+bool FanotifyWatcher::resolveDirectoryPath(const string& dirPath, Directory& directory) {
+    if (dirPath != lastDirectory || lastResolved.canonical.empty()) {
+        Directory resolved;
+        struct stat st;
+        if (!canonicalPath(dirPath, resolved.canonical) || stat(resolved.canonical.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            return false;
+        }
+        resolved.device = st.st_dev;
+        resolved.mountId = mountIdOf(resolved.canonical);
+        lastDirectory = dirPath;
+        lastResolved = std::move(resolved);
+    }
+    directory = lastResolved;
+    return true;
+}
+
+bool FanotifyWatcher::addFile(const string& filePath) {
+    TRACE_SPAN("fanotify.addFile");
+    struct stat st;
+    if (!isOpen() || lstat(filePath.c_str(), &st) != 0) {
+        return false;
+    }
+    string path = filePath;
+    if (S_ISLNK(st.st_mode) && (!canonicalPath(filePath, path) || stat(path.c_str(), &st) != 0)) {
+        return false; // events name the link's target
+    }
+    const size_t slash = path.rfind('/');
+    const string dirPath = slash == string::npos ? "." : path.substr(0, max<size_t>(1, slash));
+    const string name = path.substr(slash + 1);
+
+    lock_guard<mutex> lock(mtx);
+    Directory directory;
+    // Events name the file by its directory, so both must be on one filesystem
+    if (!resolveDirectoryPath(dirPath, directory) || directory.device != st.st_dev ||
+        !markFilesystem(directory.canonical, directory.device, directory.mountId)) {
+        return false;
+    }
+    const string canonical = (directory.canonical == "/" ? "" : directory.canonical) + "/" + name;
+    files[canonical] = filePath;
+    canonicalOf[filePath] = canonical;
+    return true;
+}
+
+bool FanotifyWatcher::removeFile(const string& filePath) {
+    lock_guard<mutex> lock(mtx);
+    auto it = canonicalOf.find(filePath);
+    if (it == canonicalOf.end()) {
+        return false;
+    }
+    files.erase(it->second);
+    canonicalOf.erase(it);
+    return true;
+}
+
+bool FanotifyWatcher::contains(const string& filePath) const {
+    lock_guard<mutex> lock(mtx);
+    return canonicalOf.count(filePath) != 0;
+}
+
+// Filesystems mounted below a root get marks of their own. Those that cannot
+// be marked (proc, sysfs and the like) are skipped, as inotify sees nothing
+// there either. A root with a bind mount of an already marked filesystem
+// below it is left uncovered, since events there would resolve elsewhere.
+vector<string> FanotifyWatcher::setRuleRoots(const vector<string>& roots) {
+    if (!isOpen()) {
+        return roots;
+    }
+    vector<string> mounts = mountPoints();
+    vector<pair<string, string>> covered;
+    vector<string> uncovered;
+    lock_guard<mutex> lock(mtx);
+    for (const auto& root : roots) {
+        Directory directory;
+        if (!resolveDirectoryPath(root, directory) ||
+            !markFilesystem(directory.canonical, directory.device, directory.mountId)) {
+            uncovered.push_back(root);
+            continue;
+        }
+        bool resolvable = true;
+        for (const auto& mount : mounts) {
+            struct stat st;
+            if (mount != directory.canonical && isPathUnder(mount, directory.canonical) && stat(mount.c_str(), &st) == 0) {
+                const int mountId = mountIdOf(mount);
+                auto known = mountIds.find(st.st_dev);
+                if (known != mountIds.end() && known->second != mountId) {
+                    resolvable = false;
+                } else {
+                    markFilesystem(mount, st.st_dev, mountId);
+                }
+            }
+        }
+        if (resolvable) {
+            covered.emplace_back(directory.canonical, root);
+        } else {
+            monitorErr() << "fanotify: " << root << " contains another mount of a watched filesystem, using inotify" << endl;
+            uncovered.push_back(root);
+        }
+    }
+    ruleRoots = std::move(covered);
+    return uncovered;
+}
+
+// mtx must be held. Maps a canonical path under a rule root to the root's
+// spelling, which is what the rules were written against.
+bool FanotifyWatcher::underRuleRoot(const string& path, string& rulePath) const {
+    for (const auto& root : ruleRoots) {
+        if (isPathUnder(path, root.first)) {
+            rulePath.assign(root.second == "/" ? "" : root.second);
+            rulePath.append(path, root.first == "/" ? 0 : root.first.size(), string::npos);
+            if (rulePath.empty()) {
+                rulePath = "/";
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// mtx must be held. Returns the cached path of a directory handle, opening
+// the handle on a miss; null if the directory is gone. key is scratch space.
+const string* FanotifyWatcher::resolveHandle(uint64_t fsid, const void* fileHandle, string& key) {
+    struct file_handle header;
+    memcpy(&header, fileHandle, sizeof(header));
+    const size_t handleSize = sizeof(header) + header.handle_bytes;
+    key.assign(reinterpret_cast<const char*>(&fsid), sizeof(fsid));
+    key.append(static_cast<const char*>(fileHandle), handleSize);
+    auto cached = handles.find(key);
+    if (cached != handles.end()) {
+        return &cached->second;
+    }
+
+    auto mount = mountFds.find(fsid);
+    if (mount == mountFds.end()) {
+        return nullptr;
+    }
+    // The event buffer gives no alignment guarantee for struct file_handle
+    vector<uint64_t> aligned((handleSize + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    memcpy(aligned.data(), fileHandle, handleSize);
+    int dirFd;
+    {
+        TRACE_SPAN("fanotify.open_by_handle");
+        dirFd = open_by_handle_at(mount->second, reinterpret_cast<struct file_handle*>(aligned.data()), O_PATH | O_CLOEXEC);
+    }
+    if (dirFd == -1) {
+        return nullptr; // ESTALE: removed since the event was queued
+    }
+    char path[PATH_MAX];
+    string link = "/proc/self/fd/" + to_string(dirFd);
+    ssize_t length = readlink(link.c_str(), path, sizeof(path) - 1);
+    // A directory removed since the event was queued reads as "<path> (deleted)"
+    static const string deleted = " (deleted)";
+    struct stat st;
+    if (length > static_cast<ssize_t>(deleted.size()) &&
+        deleted.compare(0, string::npos, path + length - deleted.size(), deleted.size()) == 0 &&
+        fstat(dirFd, &st) == 0 && st.st_nlink == 0) {
+        length -= deleted.size();
+    }
+    ::close(dirFd);
+    if (length <= 0) {
+        return nullptr;
+    }
+    if (handles.size() >= options.handleCacheSize) {
+        handles.clear();
+    }
+    return &handles.emplace(key, string(path, static_cast<size_t>(length))).first->second;
+}
+
+// mtx must be held. A renamed directory keeps its handle, so cached paths
+// at or below its old name are dropped and resolved again when next seen.
+void FanotifyWatcher::forgetHandlesUnder(const string& dirPath) {
+    for (auto it = handles.begin(); it != handles.end(); ) {
+        if (isPathUnder(it->second, dirPath)) {
+            it = handles.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void FanotifyWatcher::start() {
+    if (!isOpen() || running.exchange(true)) {
+        return;
+    }
+    size_t tracked;
+    {
+        lock_guard<mutex> lock(mtx);
+        tracked = canonicalOf.size();
+    }
+    reader = thread([this]() { readLoop(); });
+    monitorOut() << "fanotify monitoring started for " << tracked << " files." << endl;
+}
+
+void FanotifyWatcher::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    if (reader.joinable()) {
+        reader.join();
+    }
+    monitorOut() << "fanotify monitoring stopped." << endl;
+}
+
+// Decodes one read() at a time: under the lock, each event's directory is
+// resolved and the entry is matched against the tracked files and the rule
+// roots; the resulting batch is dispatched after the lock is released
+void FanotifyWatcher::readLoop() {
+    const size_t BUF_LEN = 64 * 1024;
+    vector<uint64_t> storage(BUF_LEN / sizeof(uint64_t));  // aligned for fanotify_event_metadata
+    char* buffer = reinterpret_cast<char*>(storage.data());
+    vector<string> paths;      // reported names, owned here while subscribers run
+    vector<uint32_t> masks;
+    vector<FileEvent> events;
+    string key;
+    string entryPath;
+    string rulePath;
+
+    pollfd pfd{fanotifyFd, POLLIN, 0};
+    while (running) {
+        ssize_t length;
+        {
+            TRACE_SPAN("fanotify.read");
+            length = read(fanotifyFd, buffer, BUF_LEN);
+        }
+        if (length < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                poll(&pfd, 1, 100); // wake at least every 100ms to notice stop requests
+                continue;
+            }
+            monitorErr() << "Error reading fanotify: " << strerror(errno) << endl;
+            break;
+        }
+
+        size_t count = 0;
+        {
+            TRACE_SPAN("fanotify.batch");
+            lock_guard<mutex> lock(mtx);
+            auto* meta = reinterpret_cast<struct fanotify_event_metadata*>(buffer);
+            for (; FAN_EVENT_OK(meta, length); meta = FAN_EVENT_NEXT(meta, length)) {
+                if (meta->fd >= 0) {
+                    ::close(meta->fd); // not sent in handle mode, but never leak one
+                }
+                if (meta->mask & FAN_Q_OVERFLOW) {
+                    monitorErr() << "fanotify queue overflow, events were lost" << endl;
+                    continue;
+                }
+                if (meta->event_len < meta->metadata_len + sizeof(struct fanotify_event_info_fid)) {
+                    continue;
+                }
+                auto* info = reinterpret_cast<const struct fanotify_event_info_fid*>(
+                    reinterpret_cast<const char*>(meta) + meta->metadata_len);
+                if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                    continue;
+                }
+                struct file_handle header;
+                memcpy(&header, info->handle, sizeof(header));
+                const char* name = reinterpret_cast<const char*>(info->handle) + sizeof(header) + header.handle_bytes;
+                const string* dir = resolveHandle(fsidOf(&info->fsid), info->handle, key);
+                if (!dir) {
+                    continue;
+                }
+                entryPath.assign(*dir);
+                if (entryPath != "/") {
+                    entryPath += '/';
+                }
+                entryPath += name;
+
+                if (meta->mask & FAN_ONDIR) {
+                    if (meta->mask & FAN_MOVED_FROM) {
+                        forgetHandlesUnder(entryPath);
+                    }
+                    continue;
+                }
+                if (!(meta->mask & FILE_EVENTS)) {
+                    continue;
+                }
+                auto file = files.find(entryPath);
+                const string* reported = nullptr;
+                if (file != files.end()) {
+                    reported = &file->second;
+                } else if (underRuleRoot(entryPath, rulePath) && ruleFilter(rulePath)) {
+                    reported = &rulePath;
+                }
+                if (reported) {
+                    if (count == paths.size()) {
+                        paths.emplace_back();
+                        masks.emplace_back();
+                    }
+                    paths[count] = *reported;
+                    masks[count] = static_cast<uint32_t>(meta->mask & FILE_EVENTS);
+                    ++count;
+                }
+            }
+        }
+
+        if (count > 0) {
+            int64_t now = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::system_clock::now().time_since_epoch()).count();
+            events.clear();
+            for (size_t i = 0; i < count; ++i) {
+                events.push_back({paths[i], masks[i], now});
+            }
+            TRACE_SPAN("dispatch");
+            dispatch(EventBatch(events.data(), events.size()));
+        }
+    }
+    monitorOut() << "fanotify monitoring thread exited." << endl;
+}
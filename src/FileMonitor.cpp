@@ -1,52 +1,107 @@
 #include "FileMonitor.h"
 #include "Monitoring.h"
-#include "UI.h"
-#include "Navigation.h"
-#include "Utils.h"
+#include "Log.h"
+#include "Trace.h"
 #include <filesystem>
-#include <iostream>
-#include <cstdlib>
+#include <fstream>
 #include <unistd.h>
 #include <sys/inotify.h>
 #include <fcntl.h>
-#include <fstream>
 #include <cstring>
-#include <vector>
-#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <system_error>
+#include <shared_mutex>
 
 using namespace std;
 
 namespace fs = std::filesystem;
 
-// Constructor: Initializes inotify and creates backups directory
-FileMonitor::FileMonitor() : inotifyFd(-1), isMonitoring(false) {
-    inotifyFd = inotify_init();
-    if (inotifyFd == -1) {
-        perror("inotify_init");
-        exit(EXIT_FAILURE);
+// Constructor: Initializes the inotify shards and creates backups directory.
+// Throws std::system_error instead of exiting so that host processes survive.
+FileMonitor::FileMonitor(const FileMonitorOptions& options)
+    : options(options), isMonitoring(false), nextSubscriberId(1), ruleMatcher(make_shared<RuleMatcher>()),
+      poller([this](const vector<string>& filePaths) { dispatchPaths(filePaths, IN_MODIFY); }, options.polling),
+      fanotify([this](const EventBatch& batch) { dispatch(batch); },
+               [this](const string& filePath) { return atomic_load(&ruleMatcher)->matches(filePath); }, options.fanotify),
+      compactor(options.compactor), replicator(options.replication), journal(changes, options.journal),
+      bursts(changes, [this](uint64_t eventId, const string& backupPath) { backupCompleted(eventId, backupPath); },
+             options.burst),
+      configManagesRules(false) {
+    size_t shardCount = this->options.inotifyShards;
+    if (shardCount == 0) {
+        shardCount = min<size_t>(8, max(1u, thread::hardware_concurrency()));
+    }
+    if (!openInotifyShards(shards, shardCount, this->options.pinReaders)) {
+        throw system_error(errno, generic_category(), "inotify_init1");
     }
-    // Set inotifyFd to non-blocking mode
-    int flags = fcntl(inotifyFd, F_GETFL, 0);
-    if (flags == -1) {
-        perror("fcntl get flags");
-        exit(EXIT_FAILURE);
+    // inotify stays open: it serves files on filesystems fanotify cannot mark
+    if (this->options.engine == WatchEngine::Fanotify && !fanotify.open()) {
+        monitorOut() << "fanotify is unavailable (it needs CAP_SYS_ADMIN), using inotify" << endl;
     }
-    if (fcntl(inotifyFd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        perror("fcntl set non-blocking");
-        exit(EXIT_FAILURE);
+    if (this->options.backups) {
+        fs::create_directory("backups");
+        changes.open(this->options.changeJournal);
+        if (replicator.enabled()) {
+            journal.setCommitListener([this](const vector<string>& backupPaths) { replicator.enqueue(backupPaths); });
+            replicator.start();
+        }
+        if (this->options.journalBackups) {
+            replayJournal();
+        }
+        subscribe([this](const EventBatch& batch) { backupSubscriber(batch); });
+    }
+    if (this->options.persistTrackedFiles) {
+        loadTrackedFiles(); // Load existing tracked files on startup
+        vector<string> roots;
+        vector<WatchRule> rules;
+        if (loadWatchRules("watch_rules.txt", roots, rules)) {
+            setWatchRules(roots, rules);
+        }
+    }
+    if (!this->options.configPath.empty()) {
+        reloadConfig();
+        if (this->options.watchConfig) {
+            configWatcher.start(this->options.configPath, [this]() { reloadConfig(); });
+        }
     }
-    fs::create_directory("backups");
-    loadTrackedFiles(); // Load existing tracked files on startup
 }
 
 // Destructor: Stops monitoring and saves tracked files
 FileMonitor::~FileMonitor() {
-    saveTrackedFiles(); // Save tracked files before exit
+    configWatcher.stop();
+    if (options.persistTrackedFiles) {
+        saveTrackedFiles(); // Save tracked files before exit
+    }
     stopMonitoring();
-    if (inotifyFd != -1) {
-        close(inotifyFd);
+    closeInotifyShards(shards);
+    changes.close(); // seals the open segment with its index
+}
+
+// Re-runs backups that were recorded in the journal but never committed
+void FileMonitor::replayJournal() {
+    vector<PendingIntent> pending;
+    if (!journal.open(pending) || pending.empty()) {
+        return;
+    }
+    monitorOut() << "Replaying " << pending.size() << " unfinished backups from " << options.journal.path << endl;
+    ofstream backupLog("file_monitor.log", ios::app);
+    for (const auto& intent : pending) {
+        string backupPath;
+        backupFile(intent.path, changes, backupLog, &backupPath);
+        journal.complete(intent.id, backupPath);
+    }
+    journal.flush();
+}
+
+// A finished copy goes through the journal's group commit when journaling,
+// which hands it to the replicator once durable; otherwise straight there
+void FileMonitor::backupCompleted(uint64_t eventId, const string& backupPath) {
+    if (journal.isOpen()) {
+        journal.complete(eventId, backupPath);
+    } else if (!backupPath.empty()) {
+        replicator.enqueue({backupPath});
     }
-    endwin(); // Ensure ncurses is properly terminated
 }
 
 // Load tracked files from file
@@ -59,149 +114,610 @@ void FileMonitor::loadTrackedFiles() {
         }
     }
     in.close();
-    cout << "Loaded " << trackedFiles.size() << " files from tracked_files.txt" << endl;
+    monitorOut() << "Loaded " << trackedFiles.size() << " files from tracked_files.txt" << endl;
 }
 
 // Save tracked files to file
 void FileMonitor::saveTrackedFiles() {
     lock_guard<mutex> lock(mtx);
-    cout << "Saving " << trackedFiles.size() << " tracked files to tracked_files.txt" << endl;
+    monitorOut() << "Saving " << trackedFiles.size() << " tracked files to tracked_files.txt" << endl;
     ofstream out("tracked_files.txt");
     if (!out.is_open()) {
-        cerr << "Failed to open tracked_files.txt for writing: " << strerror(errno) << endl;
+        monitorErr() << "Failed to open tracked_files.txt for writing: " << strerror(errno) << endl;
         return;
     }
     for (const auto& file : trackedFiles) {
-        out << file << endl;
-        cout << "Saved file: " << file << endl;
+        if (ruleTrackedFiles.count(file) || isConfigFile(file)) {
+            continue; // re-created from watch_rules.txt or the config on the next start
+        }
+        out << (poller.contains(file) ? POLL_PREFIX : "") << file << endl;
+        monitorOut() << "Saved file: " << file << endl;
     }
     out.close();
 }
 
-// Adds a file to the tracking list
+// Adds a file to the tracking list, choosing fanotify, inotify or polling for it
 void FileMonitor::addFile(const string& filePath) {
-    addFileToWatch(inotifyFd, filePath, trackedFiles, watchDescriptors, mtx);
+    TRACE_SPAN("addFile");
+    const string prefix = POLL_PREFIX;
+    if (filePath.compare(0, prefix.size(), prefix) == 0) {
+        addPolledFile(filePath.substr(prefix.size()));
+        return;
+    }
+    // inotify does not see changes made by other clients of a network mount
+    if (isRemoteFilesystem(filePath)) {
+        addPolledFile(filePath);
+        return;
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+        if (trackedFiles.find(filePath) != trackedFiles.end()) {
+            monitorOut() << "File is already being tracked: " << filePath << endl;
+            return;
+        }
+    }
+    if (fanotify.addFile(filePath)) {
+        lock_guard<mutex> lock(mtx);
+        trackedFiles.insert(filePath);
+        monitorOut() << "Added file to track (fanotify): " << filePath << endl;
+        return;
+    }
+    if (addFileToWatch(shardForFile(shards, filePath), filePath)) {
+        lock_guard<mutex> lock(mtx);
+        trackedFiles.insert(filePath);
+    } else if (fs::exists(filePath)) {
+        monitorOut() << "Falling back to polling for: " << filePath << endl;
+        addPolledFile(filePath);
+    }
+}
+
+// Adds a file to the polling engine
+void FileMonitor::addPolledFile(const string& filePath) {
+    lock_guard<mutex> lock(mtx);
+    if (trackedFiles.find(filePath) != trackedFiles.end()) {
+        monitorOut() << "File is already being tracked: " << filePath << endl;
+        return;
+    }
+    trackedFiles.insert(filePath);
+    poller.addPath(filePath);
+    monitorOut() << "Added file to track (polling): " << filePath << endl;
+}
+
+// Removes a file from whichever engine watches it; mtx must be held
+void FileMonitor::removeTrackedFile(const string& filePath) {
+    if (poller.removePath(filePath) || fanotify.removeFile(filePath)) {
+        trackedFiles.erase(filePath);
+        configFileUntracked(filePath);
+        return;
+    }
+    if (trackedFiles.erase(filePath) == 0) {
+        monitorOut() << "Error: File not found in tracking list: " << filePath << endl;
+        return;
+    }
+    configFileUntracked(filePath);
+    removeFileFromWatch(shardForFile(shards, filePath), filePath, isMonitoring);
 }
 
 // Removes a file from the tracking list
 void FileMonitor::removeFile(const string& filePath) {
-    removeFileFromWatch(inotifyFd, filePath, trackedFiles, watchDescriptors, isMonitoring);
+    TRACE_SPAN("removeFile");
+    lock_guard<mutex> lock(mtx);
+    removeTrackedFile(filePath);
 }
 
-// Removes a file by index (interactive mode)
-void FileMonitor::removeFileByIndex() {
-    lock_guard<mutex> lock(mtx);
-    
-    // Clear the terminal
-    clearScreen();
-
-    // Check if there are any tracked files
-    if (trackedFiles.empty()) {
-        cout << "+------------------------------------------+\n";
-        cout << "| No files are being tracked.              |\n";
-        cout << "+------------------------------------------+\n";
-        cout << "Press Enter to continue...\n";
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        return;
+// Dispatches one batch for changes that were not decoded from inotify
+// (polling workers, files moved into rule-watched directories). The events
+// point into the caller's list, so no monitor lock is held while subscribers run.
+void FileMonitor::dispatchPaths(const vector<string>& filePaths, uint32_t mask) {
+    thread_local vector<FileEvent> pathEvents;  // reused per calling thread
+    int64_t now = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    pathEvents.clear();
+    for (const auto& filePath : filePaths) {
+        pathEvents.push_back({filePath, mask, now});
     }
+    dispatch(EventBatch(pathEvents.data(), pathEvents.size()));
+}
 
-    // Display the list of tracked files with numbers
-    vector<string> fileList(trackedFiles.begin(), trackedFiles.end());
-    cout << "+------------------------------------------+\n";
-    cout << "| Select a file to remove:                 |\n";
-    cout << "+------------------------------------------+\n";
-    
-    const size_t maxDisplayLength = 36; // Maximum length for display
-    for (size_t i = 0; i < fileList.size(); ++i) {
-        string displayName = fs::path(fileList[i]).filename().string();
-        if (displayName.length() > maxDisplayLength) {
-            displayName = displayName.substr(0, maxDisplayLength - 3) + "...";
-        }
-        size_t paddingLength = maxDisplayLength - displayName.length();
-        string padding = (paddingLength > 0) ? string(paddingLength, ' ') : "";
-        cout << "| " << (i + 1) << ". " << displayName << padding << " |\n";
-    }
-    cout << "+------------------------------------------+\n";
-    cout << "| Enter the number of the file to remove   |\n";
-    cout << "| (or 0 to cancel):                        |\n";
-    cout << "+------------------------------------------+\n";
-    cout << "Choice: ";
-
-    // Read user input
-    string input;
-    getline(cin, input);
-    istringstream iss(input);
-    int choice;
-    
-    // Validate input
-    if (!(iss >> choice)) {
-        cout << "Invalid input: please enter a number.\n";
-        cout << "Press Enter to continue...\n";
-        cin.clear(); // Clear error flags
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        return;
+// Replaces the rules. Files and directories the new rules no longer select
+// are unwatched in batches; the roots are then walked for new matches.
+bool FileMonitor::setWatchRules(const vector<string>& roots, const vector<WatchRule>& rules) {
+    auto matcher = make_shared<RuleMatcher>();
+    if (!matcher->compile(rules)) {
+        return false;
+    }
+    vector<string> tops;
+    for (const auto& root : roots) {
+        string top = fs::absolute(root).lexically_normal().string();
+        while (top.size() > 1 && top.back() == '/') {
+            top.pop_back();
+        }
+        tops.push_back(top);
     }
+    auto underRoots = [&tops](const string& path) {
+        for (const auto& top : tops) {
+            if (path.compare(0, top.size(), top) == 0 &&
+                (path.size() == top.size() || top == "/" || path[top.size()] == '/')) {
+                return true;
+            }
+        }
+        return false;
+    };
+    atomic_store(&ruleMatcher, shared_ptr<const RuleMatcher>(matcher));
+    bursts.setRoots(tops);
 
-    // Check for extra input after the number
-    string remaining;
-    if (getline(iss, remaining) && !remaining.empty() && remaining.find_first_not_of(" \t") != string::npos) {
-        cout << "Invalid input: extra characters after the number.\n";
-        cout << "Press Enter to continue...\n";
-        cin.clear(); // Clear error flags
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        return;
+    vector<string> stale;
+    {
+        lock_guard<mutex> lock(mtx);
+        ruleRoots = roots;
+        activeRules = rules;
+        for (auto it = ruleTrackedFiles.begin(); it != ruleTrackedFiles.end(); ) {
+            if (!underRoots(*it) || !matcher->matches(*it)) {
+                stale.push_back(*it);
+                it = ruleTrackedFiles.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    untrackFiles(stale);
+    for (auto& shard : shards) {
+        removeDirectoryWatches(*shard, [&](const string& dir) { return !underRoots(dir) || !matcher->mayMatchUnder(dir); });
+    }
+    // fanotify matches the rules against every event under the roots it
+    // covers, so only the others are walked and watched
+    for (const auto& top : fanotify.setRuleRoots(tops)) {
+        watchTree(top);
     }
+    return true;
+}
 
-    // Handle the choice
-    if (choice == 0) {
-        cout << "Removal cancelled.\n";
-        cout << "Press Enter to continue...\n";
-        cin.clear(); // Clear error flags
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+// Walks a directory tree, watching directories that can still contain
+// matches and tracking the files the rules select
+void FileMonitor::watchTree(const string& root) {
+    string top = root;
+    while (top.size() > 1 && top.back() == '/') {
+        top.pop_back();
+    }
+    shared_ptr<const RuleMatcher> matcher = atomic_load(&ruleMatcher);
+    if (!matcher->mayMatchUnder(top)) {
         return;
     }
+    addDirectoryWatch(shardForDirectory(shards, top), top);
 
-    if (choice < 1 || choice > static_cast<int>(fileList.size())) {
-        cout << "Invalid choice: please select a number between 1 and " << fileList.size() << ".\n";
-        cout << "Press Enter to continue...\n";
-        cin.clear(); // Clear error flags
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        return;
+    error_code ec;
+    fs::recursive_directory_iterator it(top, fs::directory_options::skip_permission_denied, ec);
+    size_t matched = 0;
+    for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        const string path = it->path().string();
+        if (it->is_directory(ec) && !it->is_symlink(ec)) {
+            if (!matcher->mayMatchUnder(path)) {
+                it.disable_recursion_pending(); // no include rule can match below
+                continue;
+            }
+            addDirectoryWatch(shardForDirectory(shards, path), path);
+        } else if (it->is_regular_file(ec) && matcher->matches(path)) {
+            trackRuleFile(path);
+            ++matched;
+        }
     }
+    if (ec) {
+        monitorErr() << "Error walking " << top << ": " << ec.message() << endl;
+    }
+    monitorOut() << "Watch rules matched " << matched << " files under " << top << endl;
+}
 
-    // Remove the selected file
-    string fileToRemove = fileList[choice - 1];
-    cout << "Debug: Attempting to remove file: " << fileToRemove << endl;
-    removeFileFromWatch(inotifyFd, fileToRemove, trackedFiles, watchDescriptors, isMonitoring);
-    cout << "File removed: " << fileToRemove << "\n";
-    cout << "Press Enter to continue...\n";
-    cin.clear(); // Clear error flags
-    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-    cout << "Debug: After ignore, returning to menu" << endl;
+void FileMonitor::trackRuleFile(const string& filePath) {
+    {
+        lock_guard<mutex> lock(mtx);
+        if (trackedFiles.count(filePath)) {
+            return;
+        }
+    }
+    addFile(filePath);
+    lock_guard<mutex> lock(mtx);
+    if (trackedFiles.count(filePath)) {
+        ruleTrackedFiles.insert(filePath);
+    }
 }
 
-// Starts the monitoring thread
+namespace {
+
+const size_t CONFIG_WATCH_BATCH = 1024;  // inotify_add_watch calls per shard lock
+
+// Length of the common tail of two buffers, compared a block at a time
+size_t commonSuffix(const vector<char>& a, const vector<char>& b, size_t limit) {
+    const size_t BLOCK = 4096;
+    size_t suffix = 0;
+    while (suffix + BLOCK <= limit &&
+           memcmp(a.data() + a.size() - suffix - BLOCK, b.data() + b.size() - suffix - BLOCK, BLOCK) == 0) {
+        suffix += BLOCK;
+    }
+    while (suffix < limit && a[a.size() - 1 - suffix] == b[b.size() - 1 - suffix]) {
+        ++suffix;
+    }
+    return suffix;
+}
+
+bool atLineStart(const vector<char>& text, size_t position) {
+    return position == 0 || text[position - 1] == '\n';
+}
+
+} // namespace
+
+bool FileMonitor::reloadConfig() {
+    MonitorConfig config;
+    if (!loadMonitorConfig(options.configPath, config)) {
+        return false;
+    }
+    return applyConfig(std::move(config));
+}
+
+bool FileMonitor::applyConfig(MonitorConfig config) {
+    TRACE_SPAN("config.apply");
+    lock_guard<mutex> reloadLock(configMtx);
+    auto started = chrono::steady_clock::now();
+
+    RuleMatcher probe;
+    auto policySet = make_shared<PolicySet>();
+    if (!probe.compile(config.rules) || !policySet->compile(config.policies)) {
+        monitorErr() << "Config rejected, keeping the previous one" << endl;
+        return false;
+    }
+    atomic_store(&policies, policySet->empty() ? shared_ptr<const PolicySet>() : shared_ptr<const PolicySet>(policySet));
+
+    // Rules from watch_rules.txt stay unless the config takes them over. They
+    // are applied first, so listed files the new rules untracked are restored below.
+    bool rulesChanged = config.roots != ruleRoots || config.rules.size() != activeRules.size();
+    for (size_t i = 0; !rulesChanged && i < config.rules.size(); ++i) {
+        rulesChanged = config.rules[i].pattern != activeRules[i].pattern || config.rules[i].include != activeRules[i].include;
+    }
+    const bool declaresRules = !config.roots.empty() || !config.rules.empty();
+    rulesChanged = rulesChanged && (declaresRules || configManagesRules);
+    if (rulesChanged) {
+        setWatchRules(config.roots, config.rules);
+        configManagesRules = declaresRules;
+    }
+
+    // Only the lines between the common prefix and suffix of the previous
+    // and the new text can differ; those are diffed line by line, so an
+    // edit costs about a memcmp over the file plus work for the edited lines
+    const vector<char>& before = appliedConfigText;
+    const vector<char>& after = config.text;
+    const size_t shorter = min(before.size(), after.size());
+    size_t prefix = 0;
+    while (prefix < shorter) {
+        size_t step = min<size_t>(4096, shorter - prefix);
+        if (memcmp(before.data() + prefix, after.data() + prefix, step) != 0) {
+            while (before[prefix] == after[prefix]) {
+                ++prefix;
+            }
+            break;
+        }
+        prefix += step;
+    }
+    while (prefix > 0 && !atLineStart(after, prefix)) {
+        --prefix;
+    }
+    size_t suffix = commonSuffix(before, after, shorter - prefix);
+    while (suffix > 0 && !(atLineStart(before, before.size() - suffix) && atLineStart(after, after.size() - suffix))) {
+        --suffix;
+    }
+    string removedText;
+    string addedText;
+    diffConfigLines(string_view(before.data() + prefix, before.size() - prefix - suffix),
+                    string_view(after.data() + prefix, after.size() - prefix - suffix), removedText, addedText);
+    vector<ConfigFile> dropped;
+    vector<ConfigFile> listed;
+    parseConfigFiles(removedText, dropped);
+    parseConfigFiles(addedText, listed);
+
+    // The diff only says which paths to look at. Each of them, and each
+    // listed path still missing from an earlier reload, is compared with
+    // what is tracked now, so failed watches are retried, files removed
+    // from the menu come back and a moved line is never unwatched.
+    vector<string> toAdd;
+    vector<string> removed;
+    {
+        lock_guard<mutex> lock(mtx);
+        vector<pair<const string, ConfigTracked>*> touched;  // nodes do not move on rehash
+        auto touch = [&touched](pair<const string, ConfigTracked>& entry) {
+            if (!entry.second.touched) {
+                entry.second.touched = true;
+                touched.push_back(&entry);
+            }
+        };
+        for (const auto& file : listed) {
+            auto& entry = *configFiles.try_emplace(string(file.path)).first;
+            ++(file.poll ? entry.second.pollLines : entry.second.fileLines);
+            touch(entry);
+        }
+        for (const auto& file : dropped) {
+            auto entry = configFiles.find(string(file.path));
+            if (entry != configFiles.end()) {
+                uint32_t& lines = file.poll ? entry->second.pollLines : entry->second.fileLines;
+                lines -= lines > 0;
+                touch(*entry);
+            }
+        }
+        for (const auto& path : configMissing) {
+            auto entry = configFiles.find(path);
+            if (entry != configFiles.end()) {
+                touch(*entry);
+            }
+        }
+        configMissing.clear();  // refilled with what still cannot be tracked
+        for (auto* entry : touched) {
+            const string& path = entry->first;
+            ConfigTracked& state = entry->second;
+            state.touched = false;
+            const bool tracked = trackedFiles.count(path) != 0;
+            if (state.fileLines == 0 && state.pollLines == 0) {
+                if (state.owned && tracked) {
+                    removed.push_back(path);
+                }
+                configFiles.erase(string(path));
+            } else if (!tracked) {
+                toAdd.push_back(path);
+            } else if (state.owned && poller.contains(path) != (state.pollLines > 0)) {
+                removed.push_back(path); // switched between "file" and "poll"
+                toAdd.push_back(path);
+            }
+        }
+    }
+    untrackFiles(removed);
+    size_t addedCount = trackConfigFiles(toAdd);
+
+    const size_t entries = config.files.size();
+    appliedConfigText = std::move(config.text);
+
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started);
+    monitorOut() << "Config applied: " << entries << " files listed, " << addedCount << " added, "
+                 << removed.size() << " removed" << (rulesChanged ? ", rules re-applied" : "") << " in "
+                 << elapsed.count() / 1000.0 << " ms" << endl;
+    return true;
+}
+
+// Stops tracking filePaths, removing inotify watches in one pass per shard
+void FileMonitor::untrackFiles(const vector<string>& filePaths) {
+    unordered_map<InotifyShard*, unordered_set<string>> byShard;
+    {
+        lock_guard<mutex> lock(mtx);
+        for (const auto& filePath : filePaths) {
+            if (poller.removePath(filePath) || fanotify.removeFile(filePath)) {
+                trackedFiles.erase(filePath);
+                configFileUntracked(filePath);
+            } else if (trackedFiles.erase(filePath)) {
+                configFileUntracked(filePath);
+                byShard[&shardForFile(shards, filePath)].insert(filePath);
+            }
+        }
+    }
+    for (const auto& shard : byShard) {
+        removeFilesFromWatch(*shard.first, shard.second);
+    }
+}
+
+// Starts tracking listed config entries, grouping inotify watches per shard.
+// Entries that cannot be watched go to configMissing for the next reload.
+size_t FileMonitor::trackConfigFiles(const vector<string>& filePaths) {
+    vector<pair<string, bool>> fresh;  // path, poll
+    {
+        lock_guard<mutex> lock(mtx);
+        for (const auto& path : filePaths) {
+            auto entry = configFiles.find(path);
+            if (entry == configFiles.end()) {
+                continue;
+            }
+            if (!trackedFiles.count(path)) { // else tracked from the menu, tracked_files.txt or rules
+                fresh.emplace_back(path, entry->second.pollLines > 0);
+            }
+        }
+    }
+    unordered_map<InotifyShard*, vector<string>> byShard;
+    size_t added = 0;
+    auto tracked = [&](const string& path) { // mtx must be held
+        configFiles[path].owned = true;
+        ++added;
+    };
+    auto addPolled = [&](const string& path) {
+        lock_guard<mutex> lock(mtx);
+        if (trackedFiles.insert(path).second) {
+            poller.addPath(path);
+            tracked(path);
+        }
+    };
+    for (auto& file : fresh) {
+        string& path = file.first;
+        if (file.second || isRemoteFilesystem(path)) {
+            addPolled(path);
+        } else if (fanotify.addFile(path)) {
+            lock_guard<mutex> lock(mtx);
+            if (trackedFiles.insert(path).second) {
+                tracked(path);
+            }
+        } else {
+            byShard[&shardForFile(shards, path)].push_back(std::move(path));
+        }
+    }
+    vector<string> batch;
+    vector<string> failed;
+    for (const auto& shard : byShard) {
+        for (size_t start = 0; start < shard.second.size(); start += CONFIG_WATCH_BATCH) {
+            size_t end = min(start + CONFIG_WATCH_BATCH, shard.second.size());
+            batch.assign(shard.second.begin() + start, shard.second.begin() + end);
+            failed.clear();
+            addFilesToWatch(*shard.first, batch, failed);
+            unordered_set<string> refused(failed.begin(), failed.end());
+            {
+                lock_guard<mutex> lock(mtx);
+                for (const auto& path : batch) {
+                    if (!refused.count(path)) {
+                        trackedFiles.insert(path);
+                        tracked(path);
+                    }
+                }
+            }
+            for (const auto& path : failed) {
+                error_code ec;
+                if (fs::exists(path, ec)) {
+                    addPolled(path); // same fallback as addFile()
+                } else {
+                    monitorErr() << "Config: cannot watch " << path << ", retrying on the next reload" << endl;
+                    lock_guard<mutex> lock(mtx);
+                    configMissing.insert(path);
+                }
+            }
+        }
+    }
+    return added;
+}
+
+// A listed config file stopped being tracked; it is restored on the next
+// reload unless the config drops it. mtx must be held.
+void FileMonitor::configFileUntracked(const string& filePath) {
+    auto entry = configFiles.find(filePath);
+    if (entry != configFiles.end()) {
+        entry->second.owned = false;
+        configMissing.insert(filePath);
+    }
+}
+
+// Tracked because of the config, so not saved to tracked_files.txt; mtx must be held
+bool FileMonitor::isConfigFile(const string& filePath) const {
+    auto entry = configFiles.find(filePath);
+    return entry != configFiles.end() && entry->second.owned;
+}
+
+// Handles entries created in or moved into rule-watched directories
+void FileMonitor::onDirectoryEntries(const vector<DirectoryEntryEvent>& entries) {
+    vector<string> arrived;
+    shared_ptr<const RuleMatcher> matcher = atomic_load(&ruleMatcher);
+    for (const auto& entry : entries) {
+        if (entry.mask & IN_ISDIR) {
+            watchTree(entry.path); // also picks up files created before the watch existed
+            continue;
+        }
+        if (!matcher->matches(entry.path)) {
+            continue;
+        }
+        if (entry.mask & IN_MOVED_TO) {
+            // A rename replaced the inode, so the old watch no longer sees the file
+            lock_guard<mutex> lock(mtx);
+            if (ruleTrackedFiles.count(entry.path)) {
+                removeTrackedFile(entry.path);
+                ruleTrackedFiles.erase(entry.path);
+            }
+        }
+        trackRuleFile(entry.path);
+
+        // Data written before the watch was added would otherwise be missed
+        error_code ec;
+        if ((entry.mask & IN_MOVED_TO) || fs::file_size(entry.path, ec) > 0) {
+            arrived.push_back(entry.path);
+        }
+    }
+    if (!arrived.empty()) {
+        dispatchPaths(arrived, IN_MOVED_TO);
+    }
+}
+
+// Hands a batch to every subscriber. Shard readers call this concurrently.
+void FileMonitor::dispatch(const EventBatch& batch) {
+    shared_lock<shared_mutex> lock(subscribersMtx);
+    for (const auto& subscriber : subscribers) {
+        subscriber.second(batch);
+    }
+}
+
+// Built-in subscriber that keeps the original backup behaviour. Each reader
+// thread appends through its own stream so parallel backups never share one.
+// The batch is journaled first; the commits are made durable in groups.
+// Events inside a burst are left to the burst's snapshot.
+void FileMonitor::backupSubscriber(const EventBatch& batch) {
+    thread_local ofstream backupLog;
+    if (!backupLog.is_open()) {
+        backupLog.open("file_monitor.log", ios::app);
+    }
+    const bool journaled = journal.isOpen();
+    uint64_t id = 0;
+    if (journaled) {
+        TRACE_SPAN("journal.intents");
+        id = journal.recordIntents(batch);
+    }
+    shared_ptr<const PolicySet> policySet = atomic_load(&policies);
+    for (const auto& event : batch) {
+        const uint64_t eventId = id++;
+        const PathPolicy policy = policySet ? policySet->lookup(event.path) : PathPolicy();
+        if (!policy.backup) {
+            backupCompleted(eventId, "");
+            continue;
+        }
+        string filePath(event.path);
+        if (options.burstSnapshots && policy.burst && bursts.absorb(filePath, event.timestampNs, eventId)) {
+            continue;
+        }
+        string backupPath;
+        backupFile(filePath, changes, backupLog, &backupPath);
+        backupCompleted(eventId, backupPath);
+    }
+}
+
+int FileMonitor::subscribe(EventCallback callback) {
+    unique_lock<shared_mutex> lock(subscribersMtx);
+    int id = nextSubscriberId++;
+    subscribers.emplace_back(id, std::move(callback));
+    return id;
+}
+
+void FileMonitor::unsubscribe(int subscriberId) {
+    unique_lock<shared_mutex> lock(subscribersMtx);
+    subscribers.erase(remove_if(subscribers.begin(), subscribers.end(),
+                                [subscriberId](const auto& s) { return s.first == subscriberId; }),
+                      subscribers.end());
+}
+
+// Starts one reader thread per inotify shard plus the polling and fanotify readers
 void FileMonitor::startMonitoring() {
-    startMonitoringThread(isMonitoring, monitoringThread, inotifyFd, trackedFiles, watchDescriptors, mtx);
+    if (isMonitoring) {
+        monitorOut() << "Monitoring is already running!" << endl;
+        return;
+    }
+    startMonitoringThreads(isMonitoring, shards,
+                           [this](const EventBatch& batch) { dispatch(batch); },
+                           [this](const vector<DirectoryEntryEvent>& entries) { onDirectoryEntries(entries); });
+    poller.start();
+    fanotify.start();
+    if (options.backups && options.burstSnapshots) {
+        bursts.start();
+    }
+    if (options.backups && options.compactBackups) {
+        compactor.start();
+    }
 }
 
-// Stops the monitoring thread
+// Stops all reader threads, polling workers and the fanotify reader
 void FileMonitor::stopMonitoring() {
-    cout << "Stopping monitoring..." << endl;
-    if (inotifyFd != -1) {
-        close(inotifyFd);
-        inotifyFd = -1;
-    }
-    stopMonitoringThread(isMonitoring, monitoringThread);
-    cout << "Monitoring stopped in FileMonitor." << endl;
+    monitorOut() << "Stopping monitoring..." << endl;
+    poller.stop();
+    fanotify.stop();
+    compactor.stop();
+    stopMonitoringThreads(isMonitoring, shards);
+    bursts.stop();
+    journal.flush();
+    monitorOut() << "Monitoring stopped in FileMonitor." << endl;
 }
 
-// Lists all tracked files
-void FileMonitor::listTrackedFiles() const {
-    listTrackedFilesImpl(trackedFiles, mtx);
+void FileMonitor::shutdown() {
+    configWatcher.stop();
+    stopMonitoring();
+    journal.close();
+    replicator.stop();
+    changes.close();
 }
 
-// Opens a file selection interface and returns the selected file path
-string FileMonitor::browseAndSelectFile(const string& startDir) const {
-    return browseAndSelectFileImpl(startDir, dirHistory, backStack);
+// Returns a snapshot of all tracked files
+vector<string> FileMonitor::trackedFileList() const {
+    lock_guard<mutex> lock(mtx);
+    return vector<string>(trackedFiles.begin(), trackedFiles.end());
 }
@@ -0,0 +1,186 @@
+#include "FuzzySearch.h"
+#include <algorithm>
+#include <cctype>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+const size_t NOT_FOUND = string_view::npos;
+const uint32_t DEADLINE_CHECK_EVERY = 1024;  // candidates between clock reads
+
+char foldCase(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+// First position >= from holding c in either ASCII case
+size_t findFolded(string_view text, size_t from, char lower) {
+    const char upper = (lower >= 'a' && lower <= 'z') ? static_cast<char>(lower - 'a' + 'A') : lower;
+    const char* data = text.data();
+    const size_t size = text.size();
+#ifdef __SSE2__
+    const __m128i lowerVec = _mm_set1_epi8(lower);
+    const __m128i upperVec = _mm_set1_epi8(upper);
+    for (; from + 16 <= size; from += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + from));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, lowerVec), _mm_cmpeq_epi8(block, upperVec)));
+        if (mask != 0) {
+            return from + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+    }
+#endif
+    for (; from < size; ++from) {
+        if (data[from] == lower || data[from] == upper) {
+            return from;
+        }
+    }
+    return NOT_FOUND;
+}
+
+bool isBoundary(char c) {
+    return c == '/' || c == '_' || c == '-' || c == '.' || c == ' ';
+}
+
+} // namespace
+
+int fuzzyScore(string_view text, string_view query) {
+    if (query.empty()) {
+        return 0;
+    }
+    // Prefilter: the first in-order occurrence of every query character
+    size_t position = 0;
+    size_t first = NOT_FOUND;
+    for (char c : query) {
+        size_t found = findFolded(text, position, c);
+        if (found == NOT_FOUND) {
+            return -1;
+        }
+        if (first == NOT_FOUND) {
+            first = found;
+        }
+        position = found + 1;
+    }
+
+    // Walk back from the end of that match to the latest start, which
+    // gives the tightest window ending there
+    size_t start = first;
+    size_t remaining = query.size();
+    for (size_t p = position; p-- > first && remaining > 0; ) {
+        if (foldCase(text[p]) == query[remaining - 1]) {
+            if (--remaining == 0) {
+                start = p;
+            }
+        }
+    }
+
+    int score = 0;
+    size_t previous = NOT_FOUND;
+    position = start;
+    for (char c : query) {
+        size_t p = findFolded(text, position, c);
+        score += 16;
+        if (previous != NOT_FOUND) {
+            score += p == previous + 1 ? 12 : -static_cast<int>(min<size_t>(p - previous - 1, 8));
+        }
+        if (p == 0 || isBoundary(text[p - 1])) {
+            score += 10;
+        } else if (isupper(static_cast<unsigned char>(text[p])) && islower(static_cast<unsigned char>(text[p - 1]))) {
+            score += 6;
+        }
+        previous = p;
+        position = p + 1;
+    }
+    // Prefer hits in the file name over hits in parent directories, and short names
+    size_t slash = text.rfind('/');
+    if (slash == NOT_FOUND || start > slash) {
+        score += 8;
+    }
+    score -= static_cast<int>(min<size_t>(text.size() / 8, 16));
+    return max(score, 0);
+}
+
+void FuzzySearcher::setQuery(const string& query) {
+    string folded(query.size(), '\0');
+    transform(query.begin(), query.end(), folded.begin(), foldCase);
+    const bool extends = !lowered.empty() && folded.size() > lowered.size() &&
+                         folded.compare(0, lowered.size(), lowered) == 0;
+    text = query;
+    if (extends) {
+        // Only candidates that matched the shorter query can match this one:
+        // the matches so far, previous matches not rescanned yet, and the
+        // candidates never scanned at all (from nextIndex on)
+        vector<uint32_t> candidates;
+        candidates.reserve(matches.size() + narrowFrom.size() - narrowPosition);
+        for (const auto& match : matches) {
+            candidates.push_back(match.index);
+        }
+        candidates.insert(candidates.end(), narrowFrom.begin() + narrowPosition, narrowFrom.end());
+        narrowFrom.swap(candidates);
+        narrowPosition = 0;
+    } else {
+        narrowFrom.clear();
+        narrowPosition = 0;
+        nextIndex = 0;
+    }
+    lowered.swap(folded);
+    matches.clear();
+    done = lowered.empty();
+}
+
+void FuzzySearcher::reset() {
+    string query = text;
+    setQuery("");
+    setQuery(query);
+}
+
+bool FuzzySearcher::scan(uint32_t count, const CandidateSource& candidate,
+                         chrono::steady_clock::time_point deadline) {
+    if (lowered.empty()) {
+        done = true;
+        return true;
+    }
+    done = false;
+    uint32_t sinceCheck = 0;
+    auto consider = [&](uint32_t index) {
+        string_view value = candidate(index);
+        if (!value.empty()) {
+            int score = fuzzyScore(value, lowered);
+            if (score >= 0) {
+                matches.push_back({index, score});
+            }
+        }
+        if (++sinceCheck == DEADLINE_CHECK_EVERY) {
+            sinceCheck = 0;
+            return chrono::steady_clock::now() < deadline;
+        }
+        return true;
+    };
+    while (narrowPosition < narrowFrom.size()) {
+        if (!consider(narrowFrom[narrowPosition++])) {
+            return false;
+        }
+    }
+    while (nextIndex < count) {
+        if (!consider(nextIndex++)) {
+            return false;
+        }
+    }
+    done = true;
+    return true;
+}
+
+vector<uint32_t> FuzzySearcher::ranked(size_t limit) const {
+    vector<FuzzyMatch> best(matches);
+    limit = min(limit, best.size());
+    partial_sort(best.begin(), best.begin() + limit, best.end(), [](const FuzzyMatch& a, const FuzzyMatch& b) {
+        return a.score != b.score ? a.score > b.score : a.index < b.index;
+    });
+    vector<uint32_t> indices(limit);
+    for (size_t i = 0; i < limit; ++i) {
+        indices[i] = best[i].index;
+    }
+    return indices;
+}
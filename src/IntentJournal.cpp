@@ -0,0 +1,278 @@
+#include "IntentJournal.h"
+#include "ChangeJournal.h"
+#include "Log.h"
+#include "Trace.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Records: "I <id> <length> <path>\n" for an intent, "C <id>\n" for a
+// commit. The length lets a path contain newlines. A record without its
+// newline is a torn write from a crash and is ignored.
+void appendIntent(string& records, uint64_t id, string_view path) {
+    records += "I " + to_string(id) + " " + to_string(path.size()) + " ";
+    records.append(path.data(), path.size());
+    records += '\n';
+}
+
+// Parses the record at start and returns the offset after it, or npos at a
+// torn tail. kind is 0 for a record that cannot be parsed.
+size_t parseRecord(const string& contents, size_t start, char& kind, uint64_t& id, string& path) {
+    const size_t lineEnd = contents.find('\n', start);
+    if (lineEnd == string::npos) {
+        return string::npos;
+    }
+    istringstream in(contents.substr(start, lineEnd - start));
+    size_t length = 0;
+    if (!(in >> kind >> id) || (kind != 'I' && kind != 'C') ||
+        (kind == 'I' && (!(in >> length) || in.get() != ' ' || length == 0))) {
+        kind = 0;
+        return lineEnd + 1;
+    }
+    if (kind == 'C') {
+        return lineEnd + 1;
+    }
+    const size_t pathStart = start + static_cast<size_t>(in.tellg());
+    if (pathStart + length >= contents.size()) {
+        return string::npos;
+    }
+    if (contents[pathStart + length] != '\n') {
+        kind = 0;
+        return lineEnd + 1;
+    }
+    path = contents.substr(pathStart, length);
+    return pathStart + length + 1;
+}
+
+void syncPath(const string& path, int flags) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | flags);
+    if (fd == -1) {
+        return; // already compacted or removed; nothing left to make durable
+    }
+    fdatasync(fd);
+    ::close(fd);
+}
+
+string parentDirectory(const string& path) {
+    string parent = fs::path(path).parent_path().string();
+    return parent.empty() ? "." : parent;
+}
+
+} // namespace
+
+IntentJournal::IntentJournal(ChangeJournal& changes, JournalOptions options)
+    : changes(changes), options(std::move(options)), fd(-1), nextId(1), outstanding(0), running(false) {}
+
+IntentJournal::~IntentJournal() {
+    close();
+}
+
+bool IntentJournal::open(vector<PendingIntent>& pending) {
+    close();
+    map<uint64_t, string> intents;
+    {
+        ifstream in(options.path, ios::binary);
+        string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        size_t start = 0;
+        while (start < contents.size()) {
+            char kind;
+            uint64_t id;
+            string path;
+            start = parseRecord(contents, start, kind, id, path);
+            if (start == string::npos) {
+                break;
+            }
+            if (kind == 'I') {
+                intents[id] = std::move(path);
+            } else if (kind == 'C') {
+                intents.erase(id);
+            }
+            if (kind != 0) {
+                nextId = max(nextId, id + 1);
+            }
+        }
+    }
+
+    // Start from a journal holding only the unfinished intents
+    const string tmpPath = options.path + ".tmp";
+    {
+        ofstream out(tmpPath, ios::binary | ios::trunc);
+        string records;
+        for (const auto& intent : intents) {
+            appendIntent(records, intent.first, intent.second);
+        }
+        out << records;
+        if (!out) {
+            monitorErr() << "Failed to write " << tmpPath << ": " << strerror(errno) << endl;
+            return false;
+        }
+    }
+    syncPath(tmpPath, 0);
+    if (rename(tmpPath.c_str(), options.path.c_str()) == -1) {
+        monitorErr() << "Failed to replace " << options.path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    syncPath(parentDirectory(options.path), O_DIRECTORY);
+
+    fd = ::open(options.path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd == -1) {
+        monitorErr() << "Failed to open " << options.path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    pending.clear();
+    for (auto& intent : intents) {
+        pending.push_back({intent.first, std::move(intent.second)});
+    }
+    outstanding = pending.size();
+    running = true;
+    flusher = thread([this]() { flusherLoop(); });
+    return true;
+}
+
+void IntentJournal::close() {
+    if (running.exchange(false)) {
+        {
+            lock_guard<mutex> lock(queueMtx);
+        }
+        wake.notify_all();
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+    }
+    if (fd != -1) {
+        groupCommit();
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+uint64_t IntentJournal::recordIntents(const EventBatch& batch) {
+    lock_guard<mutex> lock(writeMtx);
+    uint64_t first = nextId;
+    string records;
+    for (const auto& event : batch) {
+        appendIntent(records, nextId++, event.path);
+    }
+    outstanding += batch.size();
+    appendRecords(records);
+    return first;
+}
+
+void IntentJournal::complete(uint64_t id, const string& backupPath) {
+    bool wasEmpty;
+    {
+        lock_guard<mutex> lock(queueMtx);
+        wasEmpty = completed.empty();
+        completed.push_back({id, backupPath});
+    }
+    if (wasEmpty) {
+        wake.notify_one();
+    }
+}
+
+void IntentJournal::flush() {
+    groupCommit();
+}
+
+void IntentJournal::flusherLoop() {
+    while (running) {
+        unique_lock<mutex> lock(queueMtx);
+        wake.wait(lock, [this]() { return !running || !completed.empty(); });
+        // Let concurrent backups join this group before paying for the fsyncs
+        wake.wait_for(lock, options.groupCommitInterval, [this]() { return !running; });
+        lock.unlock();
+        groupCommit();
+    }
+}
+
+// Syncs the copies, then the change journal, and only then writes the commit
+// records, so a commit on disk always implies durable backup data
+void IntentJournal::groupCommit() {
+    lock_guard<mutex> commitLock(commitMtx);
+    vector<Completion> group;
+    {
+        lock_guard<mutex> lock(queueMtx);
+        group.swap(completed);
+    }
+    if (group.empty() || fd == -1) {
+        return;
+    }
+    TRACE_SPAN("journal.group_commit");
+
+    // One fdatasync per copy and one fsync per directory holding copies; a
+    // whole-filesystem syncfs would also wait for unrelated writers
+    set<string> directories;
+    for (const auto& completion : group) {
+        if (!completion.backupPath.empty()) {
+            syncPath(completion.backupPath, 0);
+            directories.insert(parentDirectory(completion.backupPath));
+        }
+    }
+    for (const auto& directory : directories) {
+        syncPath(directory, O_DIRECTORY);
+    }
+    if (!directories.empty()) {
+        changes.sync();
+    }
+
+    // The listener (the replication queue) syncs its own records before the
+    // commit records exist; a crash in between only replays the intents
+    if (onCommit) {
+        vector<string> committed;
+        for (const auto& completion : group) {
+            if (!completion.backupPath.empty()) {
+                committed.push_back(completion.backupPath);
+            }
+        }
+        if (!committed.empty()) {
+            onCommit(committed);
+        }
+    }
+
+    string records;
+    for (const auto& completion : group) {
+        records += "C " + to_string(completion.id) + "\n";
+    }
+    lock_guard<mutex> lock(writeMtx);
+    if (appendRecords(records) && fdatasync(fd) == -1) {
+        monitorErr() << "fdatasync " << options.path << ": " << strerror(errno) << endl;
+    }
+    outstanding -= min<uint64_t>(outstanding, group.size());
+
+    // Nothing in flight: the history is useless, start the file over
+    struct stat st;
+    if (outstanding == 0 && fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) > options.truncateAbove) {
+        if (ftruncate(fd, 0) == 0) {
+            fdatasync(fd);
+        }
+    }
+}
+
+bool IntentJournal::appendRecords(const string& records) {
+    size_t written = 0;
+    while (written < records.size()) {
+        ssize_t n = ::write(fd, records.data() + written, records.size() - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            monitorErr() << "Failed to append to " << options.path << ": " << strerror(errno) << endl;
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
@@ -0,0 +1,27 @@
+#include "Log.h"
+#include <iostream>
+
+using namespace std;
+
+namespace {
+
+// A stream without a buffer: every write fails silently
+ostream nullStream(nullptr);
+
+ostream* outStream = &cout;
+ostream* errStream = &cerr;
+
+} // namespace
+
+void setMonitorOutput(ostream* out, ostream* err) {
+    outStream = out ? out : &nullStream;
+    errStream = err ? err : &nullStream;
+}
+
+ostream& monitorOut() {
+    return *outStream;
+}
+
+ostream& monitorErr() {
+    return *errStream;
+}
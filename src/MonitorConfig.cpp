@@ -0,0 +1,348 @@
+#include "MonitorConfig.h"
+#include "Log.h"
+#include <filesystem>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <limits.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const int RELOAD_DEBOUNCE_MS = 100;  // editors write a file in several steps
+
+// eventfd of the running watcher, written by requestConfigReload()
+atomic<int> reloadEventFd{-1};
+
+string_view trim(string_view text) {
+    const char* spaces = " \t\r";
+    size_t first = text.find_first_not_of(spaces);
+    if (first == string_view::npos) {
+        return string_view();
+    }
+    size_t last = text.find_last_not_of(spaces);
+    return text.substr(first, last - first + 1);
+}
+
+// Splits off the first whitespace-separated word of text
+string_view nextWord(string_view& text) {
+    text = trim(text);
+    size_t end = text.find_first_of(" \t");
+    string_view word = text.substr(0, end);
+    text = end == string_view::npos ? string_view() : trim(text.substr(end));
+    return word;
+}
+
+bool readWholeFile(const string& fileName, vector<char>& text) {
+    int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    text.resize(ok ? static_cast<size_t>(st.st_size) : 0);
+    size_t done = 0;
+    while (ok && done < text.size()) {
+        ssize_t n = ::read(fd, text.data() + done, text.size() - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        done += static_cast<size_t>(n);
+    }
+    text.resize(done); // the file may have shrunk meanwhile
+    ::close(fd);
+    return ok;
+}
+
+bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Splits text into lines with memchr and hands "file"/"poll" entries to
+// files. The other directives go to config, or are skipped when it is null
+// (reparsing a fragment). A million-entry config parses in tens of
+// milliseconds, without a string per line.
+void parseConfigText(string_view text, const string& fileName, MonitorConfig* config, vector<ConfigFile>& files) {
+    const char* p = text.data();
+    const char* const end = p + text.size();
+    size_t lineNumber = 0;
+    while (p < end) {
+        const char* newline = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)));
+        const char* lineEnd = newline ? newline : end;
+        const char* first = p;
+        p = newline ? newline + 1 : end;
+        ++lineNumber;
+
+        while (first < lineEnd && isBlank(*first)) {
+            ++first;
+        }
+        while (lineEnd > first && isBlank(lineEnd[-1])) {
+            --lineEnd;
+        }
+        if (first == lineEnd || *first == '#') {
+            continue;
+        }
+        const char* keywordEnd = first;
+        while (keywordEnd < lineEnd && !isBlank(*keywordEnd)) {
+            ++keywordEnd;
+        }
+        string_view keyword(first, static_cast<size_t>(keywordEnd - first));
+        const char* valueStart = keywordEnd;
+        while (valueStart < lineEnd && isBlank(*valueStart)) {
+            ++valueStart;
+        }
+        string_view value(valueStart, static_cast<size_t>(lineEnd - valueStart));
+        if (value.empty()) {
+            if (config) {
+                monitorErr() << fileName << ":" << lineNumber << ": missing value after '" << keyword << "'" << endl;
+            }
+            continue;
+        }
+        if (keyword == "file" || keyword == "poll") {
+            files.push_back({value, keyword == "poll"});
+        } else if (!config) {
+            continue;
+        } else if (keyword == "root") {
+            config->roots.emplace_back(value);
+        } else if (keyword == "include" || keyword == "exclude") {
+            config->rules.push_back({string(value), keyword == "include"});
+        } else if (keyword == "policy") {
+            PathPolicy policy;
+            policy.pattern = string(nextWord(value));
+            bool valid = !value.empty();
+            while (valid && !value.empty()) {
+                string_view option = nextWord(value);
+                if (option == "backup" || option == "nobackup") {
+                    policy.backup = option == "backup";
+                    policy.overrides |= POLICY_BACKUP;
+                } else if (option == "burst" || option == "noburst") {
+                    policy.burst = option == "burst";
+                    policy.overrides |= POLICY_BURST;
+                } else {
+                    valid = false;
+                }
+            }
+            if (!valid) {
+                monitorErr() << fileName << ":" << lineNumber << ": expected 'policy <glob> [no]backup|[no]burst...'" << endl;
+                continue;
+            }
+            config->policies.push_back(std::move(policy));
+        } else {
+            monitorErr() << fileName << ":" << lineNumber << ": unknown keyword '" << keyword << "'" << endl;
+        }
+    }
+}
+
+// The line starting at position, with its newline
+string_view lineAt(string_view text, size_t position) {
+    size_t end = text.find('\n', position);
+    return text.substr(position, end == string_view::npos ? string_view::npos : end + 1 - position);
+}
+
+// Start of the line equal to line within the next few lines after from, or npos
+size_t findLineAhead(string_view text, size_t from, string_view line) {
+    const int LOOKAHEAD = 64;
+    for (int n = 0; n < LOOKAHEAD && from < text.size(); ++n) {
+        string_view candidate = lineAt(text, from);
+        if (candidate == line) {
+            return from;
+        }
+        from += candidate.size();
+    }
+    return string_view::npos;
+}
+
+} // namespace
+
+bool loadMonitorConfig(const string& fileName, MonitorConfig& config) {
+    config = MonitorConfig();
+    if (!readWholeFile(fileName, config.text)) {
+        return false;
+    }
+    parseConfigText(string_view(config.text.data(), config.text.size()), fileName, &config, config.files);
+    return true;
+}
+
+void parseConfigFiles(string_view text, vector<ConfigFile>& files) {
+    parseConfigText(text, string(), nullptr, files);
+}
+
+// Collects the lines only in before and the lines only in after, matching
+// equal lines greedily with a short lookahead. A line that moved further
+// counts as removed and re-added, which the per-entry line counts absorb.
+void diffConfigLines(string_view before, string_view after, string& removed, string& added) {
+    size_t i = 0;
+    size_t j = 0;
+    while (i < before.size() && j < after.size()) {
+        string_view a = lineAt(before, i);
+        string_view b = lineAt(after, j);
+        if (a == b) {
+            i += a.size();
+            j += b.size();
+            continue;
+        }
+        size_t resyncBefore = findLineAhead(before, i + a.size(), b);  // lines were deleted
+        size_t resyncAfter = findLineAhead(after, j + b.size(), a);    // lines were inserted
+        if (resyncBefore != string_view::npos && (resyncAfter == string_view::npos || resyncBefore - i <= resyncAfter - j)) {
+            removed.append(before.substr(i, resyncBefore - i));
+            i = resyncBefore;
+        } else if (resyncAfter != string_view::npos) {
+            added.append(after.substr(j, resyncAfter - j));
+            j = resyncAfter;
+        } else {
+            removed.append(a);
+            added.append(b);
+            i += a.size();
+            j += b.size();
+        }
+        for (string* lines : {&removed, &added}) {
+            if (!lines->empty() && lines->back() != '\n') {
+                lines->push_back('\n');
+            }
+        }
+    }
+    removed.append(before.substr(i));
+    added.append(after.substr(j));
+}
+
+bool PolicySet::compile(const vector<PathPolicy>& policies) {
+    compiled.clear();
+    for (const auto& policy : policies) {
+        RuleMatcher matcher;
+        if (!matcher.compile({{policy.pattern, true}})) {
+            monitorErr() << "Invalid policy pattern: " << policy.pattern << endl;
+            compiled.clear();
+            return false;
+        }
+        compiled.emplace_back(std::move(matcher), policy);
+    }
+    return true;
+}
+
+// Each matching line sets only the options it names; later lines win
+PathPolicy PolicySet::lookup(string_view path) const {
+    PathPolicy result;
+    for (const auto& entry : compiled) {
+        if (!entry.first.matches(path)) {
+            continue;
+        }
+        if (entry.second.overrides & POLICY_BACKUP) {
+            result.backup = entry.second.backup;
+        }
+        if (entry.second.overrides & POLICY_BURST) {
+            result.burst = entry.second.burst;
+        }
+    }
+    return result;
+}
+
+ConfigWatcher::~ConfigWatcher() {
+    stop();
+}
+
+bool ConfigWatcher::start(const string& path, function<void()> onChange) {
+    if (running) {
+        return false;
+    }
+    fs::path absolute = fs::absolute(path).lexically_normal();
+    string directory = absolute.parent_path().string();
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotifyFd == -1 || eventFd == -1 ||
+        inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1) {
+        monitorErr() << "Cannot watch " << path << " for changes: " << strerror(errno) << endl;
+        if (inotifyFd != -1) {
+            ::close(inotifyFd);
+            inotifyFd = -1;
+        }
+        if (eventFd != -1) {
+            ::close(eventFd);
+        }
+        return false;
+    }
+    reloadEventFd = eventFd;
+    running = true;
+    worker = thread([this, directory, name = absolute.filename().string(), onChange]() {
+        watchLoop(directory, name, onChange);
+    });
+    return true;
+}
+
+void ConfigWatcher::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    requestConfigReload(); // wakes the loop, which then sees running == false
+    worker.join();
+    ::close(reloadEventFd.exchange(-1));
+    ::close(inotifyFd);
+    inotifyFd = -1;
+}
+
+void ConfigWatcher::watchLoop(string directory, string name, function<void()> onChange) {
+    const size_t BUF_LEN = 64 * (sizeof(inotify_event) + NAME_MAX + 1);
+    vector<char> buffer(BUF_LEN);
+    pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {reloadEventFd, POLLIN, 0}};
+    bool pending = false;
+    while (running) {
+        // After a change, wait until the file has been quiet for a moment
+        int ready = poll(fds, 2, pending ? RELOAD_DEBOUNCE_MS : -1);
+        if (!running) {
+            break;
+        }
+        if (ready == 0 && pending) {
+            pending = false;
+            monitorOut() << "Reloading " << directory << "/" << name << endl;
+            onChange();
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            ssize_t n;
+            while ((n = ::read(inotifyFd, buffer.data(), buffer.size())) > 0) {
+                for (char* p = buffer.data(); p < buffer.data() + n; ) {
+                    auto* event = reinterpret_cast<inotify_event*>(p);
+                    if (event->len > 0 && name == event->name) {
+                        pending = true;
+                    }
+                    p += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (::read(fds[1].fd, &count, sizeof(count)) > 0) {
+                pending = true;
+            }
+        }
+    }
+}
+
+void requestConfigReload() {
+    int fd = reloadEventFd.load();
+    if (fd != -1) {
+        uint64_t one = 1;
+        ssize_t written = ::write(fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+void installConfigReloadSignal() {
+    struct sigaction action = {};
+    action.sa_handler = [](int) { requestConfigReload(); };
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, nullptr);
+}
@@ -1,4 +1,7 @@
 #include "Monitoring.h"
+#include "ChangeJournal.h"
+#include "Log.h"
+#include "Trace.h"
 #include <filesystem>
 #include <fstream>
 #include <chrono>
@@ -7,51 +10,96 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <cstring>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/inotify.h>
-#include <iostream>
+#include <sstream>
+#include <vector>
 #include <errno.h>
 
 using namespace std;
 
 namespace fs = std::filesystem;
 
-void addFileToWatch(int inotifyFd, const string& filePath, 
-                    unordered_set<string>& trackedFiles, 
-                    unordered_map<int, string>& watchDescriptors, 
-                    mutex& mtx) {
-    lock_guard<mutex> lock(mtx);
-    if (trackedFiles.find(filePath) != trackedFiles.end()) {
-        cout << "File is already being tracked: " << filePath << endl;
-        return;
+bool openInotifyShards(InotifyShards& shards, size_t count, bool pinReaders) {
+    vector<int> cpus;
+    cpu_set_t allowed;
+    if (pinReaders && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
     }
 
-    int wd = inotify_add_watch(inotifyFd, filePath.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO);
-    if (wd == -1) {
-        cerr << "Error adding file to watch: " << filePath << " - ";
-        perror("inotify_add_watch");
-        return;
+    for (size_t i = 0; i < max<size_t>(1, count); ++i) {
+        auto shard = make_unique<InotifyShard>();
+        shard->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (shard->inotifyFd == -1) {
+            monitorErr() << "inotify_init1: " << strerror(errno) << endl;
+            closeInotifyShards(shards);
+            return false;
+        }
+        shard->cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        shards.push_back(move(shard));
     }
+    return true;
+}
 
-    trackedFiles.insert(filePath);
-    watchDescriptors[wd] = filePath;
-    cout << "Added file to track: " << filePath << " (wd: " << wd << ")" << endl;
+void closeInotifyShards(InotifyShards& shards) {
+    for (auto& shard : shards) {
+        if (shard->inotifyFd != -1) {
+            close(shard->inotifyFd);
+            shard->inotifyFd = -1;
+        }
+    }
+    shards.clear();
 }
 
-void removeFileFromWatch(int inotifyFd, const string& filePath, 
-                         unordered_set<string>& trackedFiles, 
-                         unordered_map<int, string>& watchDescriptors, 
-                         bool isMonitoring) {
-    cout << "Debug: Entering removeFileFromWatch for file: " << filePath << endl;
-    cout << "Debug: isMonitoring = " << (isMonitoring ? "true" : "false") << ", inotifyFd = " << inotifyFd << endl;
+InotifyShard& shardForDirectory(const InotifyShards& shards, const string& dirPath) {
+    return *shards[hash<string>()(dirPath) % shards.size()];
+}
 
-    auto it = trackedFiles.find(filePath);
-    if (it == trackedFiles.end()) {
-        cout << "Error: File not found in tracking list: " << filePath << endl;
-        return;
+InotifyShard& shardForFile(const InotifyShards& shards, const string& filePath) {
+    return shardForDirectory(shards, fs::path(filePath).parent_path().string());
+}
+
+bool addFileToWatch(InotifyShard& shard, const string& filePath) {
+    TRACE_SPAN("addFileToWatch");
+    lock_guard<mutex> lock(shard.mtx);
+    int wd = inotify_add_watch(shard.inotifyFd, filePath.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd == -1) {
+        monitorErr() << "Error adding file to watch: " << filePath << " - inotify_add_watch: " << strerror(errno) << endl;
+        return false;
+    }
+
+    shard.watchDescriptors[wd] = filePath;
+    monitorOut() << "Added file to track: " << filePath << " (wd: " << wd << ")" << endl;
+    return true;
+}
+
+int addDirectoryWatch(InotifyShard& shard, const string& dirPath) {
+    lock_guard<mutex> lock(shard.mtx);
+    // IN_MASK_ADD keeps any file-style watch that already exists on this inode
+    int wd = inotify_add_watch(shard.inotifyFd, dirPath.c_str(), IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_MASK_ADD);
+    if (wd == -1) {
+        monitorErr() << "Error adding directory to watch: " << dirPath << " - inotify_add_watch: " << strerror(errno) << endl;
+        return -1;
     }
+    shard.directoryWatches[wd] = dirPath;
+    return wd;
+}
+
+void removeFileFromWatch(InotifyShard& shard, const string& filePath,
+                         bool isMonitoring) {
+    TRACE_SPAN("removeFileFromWatch");
+    lock_guard<mutex> lock(shard.mtx);
+    monitorOut() << "Debug: Entering removeFileFromWatch for file: " << filePath << endl;
+    monitorOut() << "Debug: isMonitoring = " << (isMonitoring ? "true" : "false") << ", inotifyFd = " << shard.inotifyFd << endl;
 
     int wdToRemove = -1;
-    for (const auto& pair : watchDescriptors) {
+    for (const auto& pair : shard.watchDescriptors) {
         if (pair.second == filePath) {
             wdToRemove = pair.first;
             break;
@@ -59,146 +107,290 @@ void removeFileFromWatch(int inotifyFd, const string& filePath,
     }
 
     if (wdToRemove != -1) {
-        cout << "Debug: Found watch descriptor " << wdToRemove << " for file: " << filePath << endl;
-        if (isMonitoring && inotifyFd != -1) { // Only attempt to remove watch if monitoring is active and inotifyFd is valid
-            cout << "Debug: Attempting inotify_rm_watch for wd: " << wdToRemove << endl;
-            int ret = inotify_rm_watch(inotifyFd, wdToRemove);
-            if (ret == -1) {
-                cerr << "Error removing watch descriptor " << wdToRemove << " for file: " << filePath << " - ";
-                perror("inotify_rm_watch");
-            } else {
-                cout << "Debug: Successfully removed watch descriptor " << wdToRemove << " for file: " << filePath << endl;
-            }
+        monitorOut() << "Debug: Found watch descriptor " << wdToRemove << " for file: " << filePath << endl;
+        int ret = inotify_rm_watch(shard.inotifyFd, wdToRemove);
+        if (ret == -1) {
+            monitorErr() << "Error removing watch descriptor " << wdToRemove << " for file: " << filePath << " - inotify_rm_watch: " << strerror(errno) << endl;
         } else {
-            cout << "Debug: Monitoring is not active or inotifyFd is invalid, skipping inotify_rm_watch for file: " << filePath << endl;
+            monitorOut() << "Debug: Successfully removed watch descriptor " << wdToRemove << " for file: " << filePath << endl;
         }
-        watchDescriptors.erase(wdToRemove);
-        cout << "Debug: Removed watch descriptor from watchDescriptors" << endl;
+        shard.watchDescriptors.erase(wdToRemove);
+        monitorOut() << "Debug: Removed watch descriptor from watchDescriptors" << endl;
     } else {
-        cerr << "Could not find watch descriptor for file: " << filePath << endl;
+        monitorErr() << "Could not find watch descriptor for file: " << filePath << endl;
     }
+    monitorOut() << "Debug: Exiting removeFileFromWatch" << endl;
+}
 
-    trackedFiles.erase(it);
-    cout << "Debug: Removed file from trackedFiles: " << filePath << endl;
-    cout << "Debug: Exiting removeFileFromWatch" << endl;
+size_t addFilesToWatch(InotifyShard& shard, const vector<string>& filePaths, vector<string>& failed) {
+    TRACE_SPAN("addFilesToWatch");
+    lock_guard<mutex> lock(shard.mtx);
+    size_t added = 0;
+    for (const auto& filePath : filePaths) {
+        int wd = inotify_add_watch(shard.inotifyFd, filePath.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd == -1) {
+            failed.push_back(filePath);
+            continue;
+        }
+        shard.watchDescriptors[wd] = filePath;
+        ++added;
+    }
+    return added;
 }
 
-void startMonitoringThread(bool& isMonitoring, thread& monitoringThread, 
-                          int inotifyFd, const unordered_set<string>& trackedFiles, 
-                          const unordered_map<int, string>& watchDescriptors, 
-                          mutex& mtx) {
-    if (isMonitoring) {
-        cout << "Monitoring is already running!" << endl;
-        return;
+size_t removeFilesFromWatch(InotifyShard& shard, const unordered_set<string>& filePaths) {
+    TRACE_SPAN("removeFilesFromWatch");
+    lock_guard<mutex> lock(shard.mtx);
+    size_t removed = 0;
+    for (auto it = shard.watchDescriptors.begin(); it != shard.watchDescriptors.end() && removed < filePaths.size(); ) {
+        if (filePaths.count(it->second)) {
+            inotify_rm_watch(shard.inotifyFd, it->first);
+            it = shard.watchDescriptors.erase(it);
+            ++removed;
+        } else {
+            ++it;
+        }
     }
+    return removed;
+}
 
-    isMonitoring = true;
-    monitoringThread = thread([inotifyFd, &trackedFiles, &watchDescriptors, &mtx, &isMonitoring]() {
-        const size_t EVENT_SIZE = sizeof(struct inotify_event);
-        const size_t BUF_LEN = 1024 * (EVENT_SIZE + 16);
-        char buffer[BUF_LEN];
-
-        ofstream log("file_monitor.log", ios::app);
-        if (!log.is_open()) {
-            cerr << "Failed to open file_monitor.log" << endl;
-            isMonitoring = false;
-            return;
-        }
-
-        while (isMonitoring) {
-            ssize_t length = read(inotifyFd, buffer, BUF_LEN);
-            if (length < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    usleep(100000); // Sleep for 100ms
-                    continue;
-                } else if (errno == EBADF) {
-                    log << "inotify file descriptor closed, stopping monitoring thread." << endl;
-                    break;
-                } else {
-                    log << "Error reading inotify: " << strerror(errno) << endl;
-                    break;
-                }
+size_t removeDirectoryWatches(InotifyShard& shard, const function<bool(const string&)>& drop) {
+    lock_guard<mutex> lock(shard.mtx);
+    size_t removed = 0;
+    for (auto it = shard.directoryWatches.begin(); it != shard.directoryWatches.end(); ) {
+        if (drop(it->second)) {
+            inotify_rm_watch(shard.inotifyFd, it->first);
+            it = shard.directoryWatches.erase(it);
+            ++removed;
+        } else {
+            ++it;
+        }
+    }
+    return removed;
+}
+
+namespace {
+
+// Creates dest exclusively, so concurrent backups of same-named files in the
+// same second never share a copy; later ones get "-2", "-3"... appended
+bool reserveBackupPath(fs::path& dest) {
+    const string base = dest.string();
+    for (int suffix = 2;; ++suffix) {
+        int fd = ::open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            ::close(fd);
+            return true;
+        }
+        if (errno != EEXIST) {
+            return false;
+        }
+        dest = base + "-" + to_string(suffix);
+    }
+}
+
+} // namespace
+
+bool backupFile(const string& filePath, ChangeJournal& changes, ostream& log, string* backupPath) {
+    TRACE_SPAN("backupFile");
+    auto now = chrono::system_clock::now();
+    auto now_time = chrono::system_clock::to_time_t(now);
+    tm now_tm;
+    localtime_r(&now_time, &now_tm); // backups run on several threads at once
+    ostringstream timestamp;
+    timestamp << put_time(&now_tm, "%Y-%m-%d %H:%M:%S");
+
+    fs::path src(filePath);
+    fs::path dest = "backups/" + src.filename().string() + "_" + timestamp.str();
+    try {
+        {
+            TRACE_SPAN("backup.exists");
+            if (!fs::exists(filePath)) {
+                log << timestamp.str() << ": File does not exist: " << filePath << endl;
+                return false;
+            }
+            if (!fs::exists("backups")) {
+                fs::create_directory("backups");
+                log << timestamp.str() << ": Created backups directory" << endl;
             }
+        }
+        {
+            TRACE_SPAN("backup.copy_file");
+            if (!reserveBackupPath(dest)) {
+                log << timestamp.str() << ": Cannot create " << dest << ": " << strerror(errno) << endl;
+                return false;
+            }
+            try {
+                fs::copy_file(src, dest, fs::copy_options::overwrite_existing);
+            } catch (const fs::filesystem_error&) {
+                error_code ec;
+                fs::remove(dest, ec); // the empty reservation
+                throw;
+            }
+        }
+        log << timestamp.str() << ": Created backup: " << dest << endl;
+        if (backupPath) {
+            *backupPath = dest.string();
+        }
+
+        if (!changes.record(filePath, dest.string(), ChangeKind::Backup)) {
+            log << timestamp.str() << ": Failed to record change: " << strerror(errno) << endl;
+            return false;
+        }
+        log << timestamp.str() << ": Logged change: " << filePath << endl;
+    } catch (const fs::filesystem_error& e) {
+        log << timestamp.str() << ": Error during backup or logging: " << e.what() << endl;
+        return false;
+    }
+    return true;
+}
+
+namespace {
+
+// Reader loop of one shard: decodes its inotify queue and looks up its own registry
+void readShard(InotifyShard& shard, atomic<bool>& isMonitoring,
+                      const EventDispatcher& dispatch,
+                      const DirectoryEventHandler& onDirectoryEntries) {
+    const size_t EVENT_SIZE = sizeof(struct inotify_event);
+    const size_t BUF_LEN = 1024 * (EVENT_SIZE + 16);
+    char buffer[BUF_LEN];
+    // One read() can never decode into more events than this, so the
+    // buffer is allocated once and reused for every batch
+    vector<FileEvent> events;
+    events.reserve(BUF_LEN / EVENT_SIZE);
+    vector<string> names;      // copies of registry paths, owned here while subscribers run
+    vector<uint32_t> masks;
+    vector<DirectoryEntryEvent> created;
+
+    if (shard.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(shard.cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
 
-            if (length == 0) {
-                log << "Read returned 0, stopping monitoring thread." << endl;
+    ofstream log("file_monitor.log", ios::app);
+    if (!log.is_open()) {
+        monitorErr() << "Failed to open file_monitor.log" << endl;
+        return;
+    }
+
+    pollfd pfd{shard.inotifyFd, POLLIN, 0};
+    while (isMonitoring) {
+        ssize_t length;
+        {
+            TRACE_SPAN("inotify.read");
+            length = read(shard.inotifyFd, buffer, BUF_LEN);
+        }
+        if (length < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                poll(&pfd, 1, 100); // wake at least every 100ms to notice stop requests
+                continue;
+            } else if (errno == EBADF) {
+                log << "inotify file descriptor closed, stopping monitoring thread." << endl;
+                break;
+            } else {
+                log << "Error reading inotify: " << strerror(errno) << endl;
                 break;
             }
+        }
+
+        if (length == 0) {
+            log << "Read returned 0, stopping monitoring thread." << endl;
+            break;
+        }
 
+        created.clear();
+        size_t count = 0;
+        {
+            // Only the registry lookups run under the shard lock; the names are
+            // copied out so subscribers' I/O never blocks addFile/removeFile
+            unique_lock<mutex> lock(shard.mtx, defer_lock);
+            {
+                TRACE_SPAN("shard.lock_wait");
+                lock.lock();
+            }
+            TRACE_SPAN("inotify.batch");
             for (char* ptr = buffer; ptr < buffer + length; ) {
                 struct inotify_event* event = reinterpret_cast<struct inotify_event*>(ptr);
+                ptr += EVENT_SIZE + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    log << "inotify queue overflow on fd " << shard.inotifyFd << ", events were lost" << endl;
+                    continue;
+                }
+                // Entries appearing in a rule-watched directory carry the child's name
+                if (event->len > 0 && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    auto dir = shard.directoryWatches.find(event->wd);
+                    if (dir != shard.directoryWatches.end()) {
+                        created.push_back({dir->second + "/" + event->name, event->mask});
+                    }
+                    continue;
+                }
                 if (event->mask & (IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO)) {
-                    lock_guard<mutex> lock(mtx);
-                    auto it = watchDescriptors.find(event->wd);
-                    if (it != watchDescriptors.end()) {
-                        const string& filePath = it->second;
-                        auto now = chrono::system_clock::now();
-                        auto now_time = chrono::system_clock::to_time_t(now);
-                        tm now_tm = *localtime(&now_time);
-                        ostringstream timestamp;
-                        timestamp << put_time(&now_tm, "%Y-%m-%d %H:%M:%S");
-
-                        fs::path src(filePath);
-                        fs::path dest = "backups/" + src.filename().string() + "_" + timestamp.str();
-                        try {
-                            if (!fs::exists(filePath)) {
-                                log << timestamp.str() << ": File does not exist: " << filePath << endl;
-                                continue;
-                            }
-                            if (!fs::exists("backups")) {
-                                fs::create_directory("backups");
-                                log << timestamp.str() << ": Created backups directory" << endl;
-                            }
-                            fs::copy_file(src, dest, fs::copy_options::overwrite_existing);
-                            log << timestamp.str() << ": Created backup: " << dest << endl;
-
-                            ofstream changeLog("changes.log", ios::app);
-                            if (!changeLog.is_open()) {
-                                log << timestamp.str() << ": Failed to open changes.log: " << strerror(errno) << endl;
-                                continue;
-                            }
-                            changeLog << timestamp.str() << ": " << filePath << " (backup: " << dest << ")" << endl;
-                            changeLog.close();
-                            log << timestamp.str() << ": Logged change to changes.log: " << filePath << endl;
-                        } catch (const fs::filesystem_error& e) {
-                            log << timestamp.str() << ": Error during backup or logging: " << e.what() << endl;
+                    auto it = shard.watchDescriptors.find(event->wd);
+                    if (it != shard.watchDescriptors.end()) {
+                        if (count == names.size()) {
+                            names.emplace_back();
+                            masks.emplace_back();
                         }
+                        names[count] = it->second;
+                        masks[count] = event->mask;
+                        ++count;
                     } else {
                         log << "Watch descriptor not found: " << event->wd << endl;
                     }
                 }
-                ptr += EVENT_SIZE + event->len;
             }
         }
-        log.close();
-        cout << "Monitoring thread exited." << endl;
-    });
-    cout << "File monitoring started." << endl;
+        if (count > 0) {
+            int64_t now = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::system_clock::now().time_since_epoch()).count();
+            events.clear();
+            for (size_t i = 0; i < count; ++i) {
+                events.push_back({names[i], masks[i], now});
+            }
+            TRACE_SPAN("dispatch");
+            dispatch(EventBatch(events.data(), events.size()));
+        }
+        if (!created.empty()) {
+            TRACE_SPAN("directoryEntries");
+            onDirectoryEntries(created);
+        }
+    }
+    log.close();
+    monitorOut() << "Monitoring thread exited." << endl;
 }
 
-void stopMonitoringThread(bool& isMonitoring, thread& monitoringThread) {
-    if (!isMonitoring) return;
+} // namespace
 
-    isMonitoring = false;
-    if (monitoringThread.joinable()) {
-        monitoringThread.join();
-        cout << "Monitoring thread joined successfully." << endl;
-    } else {
-        cout << "Monitoring thread not joinable." << endl;
+void startMonitoringThreads(atomic<bool>& isMonitoring, InotifyShards& shards,
+                            EventDispatcher dispatch,
+                            DirectoryEventHandler onDirectoryEntries) {
+    if (isMonitoring) {
+        monitorOut() << "Monitoring is already running!" << endl;
+        return;
     }
-    cout << "File monitoring stopped." << endl;
-}
 
-void listTrackedFilesImpl(const unordered_set<string>& trackedFiles, 
-                         mutex& mtx) {
-    lock_guard<mutex> lock(mtx);
-    if (trackedFiles.empty()) {
-        cout << "No files are being tracked." << endl;
-        return;
+    isMonitoring = true;
+    for (auto& shard : shards) {
+        InotifyShard* s = shard.get();
+        s->reader = thread([s, &isMonitoring, dispatch, onDirectoryEntries]() {
+            readShard(*s, isMonitoring, dispatch, onDirectoryEntries);
+        });
     }
+    monitorOut() << "File monitoring started (" << shards.size() << " inotify readers)." << endl;
+}
+
+void stopMonitoringThreads(atomic<bool>& isMonitoring, InotifyShards& shards) {
+    if (!isMonitoring) return;
 
-    cout << "Tracked files:" << endl;
-    for (const auto& file : trackedFiles) {
-        cout << " - " << file << endl;
+    isMonitoring = false;
+    for (auto& shard : shards) {
+        if (shard->reader.joinable()) {
+            shard->reader.join();
+            monitorOut() << "Monitoring thread joined successfully." << endl;
+        } else {
+            monitorOut() << "Monitoring thread not joinable." << endl;
+        }
     }
+    monitorOut() << "File monitoring stopped." << endl;
 }
@@ -0,0 +1,55 @@
+#include "PathIndex.h"
+#include "DirectoryCache.h"
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+PathIndex::PathIndex(string root)
+    : rootPath(std::move(root)), offsets{0}, stopping(false), done(false) {
+    builder = thread([this]() { build(); });
+}
+
+PathIndex::~PathIndex() {
+    stopping = true;
+    builder.join();
+}
+
+string_view PathIndex::path(uint32_t index) const {
+    return string_view(names).substr(offsets[index], offsets[index + 1] - offsets[index]);
+}
+
+// Breadth-first, so shallow paths are searchable first. Symlinked
+// directories are listed but not entered, which keeps the walk finite.
+void PathIndex::build() {
+    deque<string> pending{""};
+    while (!pending.empty() && !stopping) {
+        string relative = std::move(pending.front());
+        pending.pop_front();
+        string absolute = relative.empty() ? rootPath : (rootPath == "/" ? "/" : rootPath + "/") + relative;
+        int fd = open(absolute.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd == -1) {
+            continue;
+        }
+        readDirectoryChunks(fd, [&](vector<DirEntry>& chunk) {
+            lock_guard<mutex> lock(mtx);
+            for (const auto& entry : chunk) {
+                if (types.size() >= PATH_INDEX_MAX_ENTRIES || names.size() > UINT32_MAX / 2) {
+                    stopping = true;
+                    return;
+                }
+                string path = relative.empty() ? entry.name : relative + "/" + entry.name;
+                names += path;
+                offsets.push_back(static_cast<uint32_t>(names.size()));
+                types.push_back(entry.type);
+                if (entry.type == DT_DIR) {
+                    pending.push_back(std::move(path));
+                }
+            }
+        });
+        close(fd);
+    }
+    done = true;
+}
@@ -0,0 +1,257 @@
+#include "Polling.h"
+#include "Log.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+using namespace std;
+
+namespace {
+
+// Filesystem magic numbers from statfs(2)
+const long NFS_SUPER_MAGIC = 0x6969;
+const long SMB_SUPER_MAGIC = 0x517B;
+const long CIFS_MAGIC_NUMBER = 0xFF534D42;
+const long SMB2_MAGIC_NUMBER = 0xFE534D42;
+const long FUSE_SUPER_MAGIC = 0x65735546;
+
+chrono::nanoseconds threadCpuTime() {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return chrono::seconds(ts.tv_sec) + chrono::nanoseconds(ts.tv_nsec);
+}
+
+} // namespace
+
+bool isRemoteFilesystem(const string& path) {
+    struct statfs info;
+    if (statfs(path.c_str(), &info) != 0) {
+        return false;
+    }
+    long type = static_cast<long>(info.f_type) & 0xFFFFFFFFL;
+    return type == NFS_SUPER_MAGIC || type == SMB_SUPER_MAGIC ||
+           type == CIFS_MAGIC_NUMBER || type == SMB2_MAGIC_NUMBER ||
+           type == FUSE_SUPER_MAGIC;
+}
+
+PollingWatcher::PollingWatcher(ChangeCallback onChange, PollingOptions options)
+    : onChange(std::move(onChange)), options(options), running(false) {
+    size_t count = max<size_t>(1, this->options.workerThreads);
+    for (size_t i = 0; i < count; ++i) {
+        shards.push_back(make_unique<Shard>());
+    }
+}
+
+PollingWatcher::~PollingWatcher() {
+    stop();
+}
+
+PollingWatcher::Shard& PollingWatcher::shardFor(const string& filePath) const {
+    return *shards[hash<string>()(filePath) % shards.size()];
+}
+
+bool PollingWatcher::addPath(const string& filePath) {
+    Shard& shard = shardFor(filePath);
+    lock_guard<mutex> lock(shard.mtx);
+    if (shard.index.count(filePath)) {
+        return false;
+    }
+
+    size_t slot;
+    if (!shard.freeSlots.empty()) {
+        slot = shard.freeSlots.back();
+        shard.freeSlots.pop_back();
+    } else {
+        slot = shard.slots.size();
+        shard.slots.emplace_back();
+    }
+    FileState& state = shard.slots[slot];
+    uint32_t generation = state.generation + 1;
+    state = FileState();
+    state.path = filePath;
+    state.interval = options.minInterval;
+    state.generation = generation;
+
+    shard.index[filePath] = slot;
+    shard.dueHeap.push_back({Clock::now(), slot, generation});
+    push_heap(shard.dueHeap.begin(), shard.dueHeap.end(), greater<DueEntry>());
+    shard.wake.notify_one();
+    return true;
+}
+
+bool PollingWatcher::removePath(const string& filePath) {
+    Shard& shard = shardFor(filePath);
+    lock_guard<mutex> lock(shard.mtx);
+    auto it = shard.index.find(filePath);
+    if (it == shard.index.end()) {
+        return false;
+    }
+    // The heap entry goes stale through the generation bump and is dropped when popped
+    FileState& state = shard.slots[it->second];
+    state.path.clear();
+    state.generation++;
+    shard.freeSlots.push_back(it->second);
+    shard.index.erase(it);
+    return true;
+}
+
+bool PollingWatcher::contains(const string& filePath) const {
+    Shard& shard = shardFor(filePath);
+    lock_guard<mutex> lock(shard.mtx);
+    return shard.index.count(filePath) != 0;
+}
+
+size_t PollingWatcher::size() const {
+    size_t total = 0;
+    for (const auto& shard : shards) {
+        lock_guard<mutex> lock(shard->mtx);
+        total += shard->index.size();
+    }
+    return total;
+}
+
+void PollingWatcher::start() {
+    if (running.exchange(true)) {
+        return;
+    }
+    for (auto& shard : shards) {
+        Shard* s = shard.get();
+        s->worker = thread([this, s]() { workerLoop(*s); });
+    }
+    monitorOut() << "Polling started for " << size() << " files on " << shards.size() << " threads." << endl;
+}
+
+void PollingWatcher::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    for (auto& shard : shards) {
+        {
+            lock_guard<mutex> lock(shard->mtx);
+        }
+        shard->wake.notify_all();
+    }
+    for (auto& shard : shards) {
+        if (shard->worker.joinable()) {
+            shard->worker.join();
+        }
+    }
+    monitorOut() << "Polling stopped." << endl;
+}
+
+void PollingWatcher::workerLoop(Shard& shard) {
+    struct Probe {
+        size_t slot;
+        uint32_t generation;
+        string path;
+        struct statx result;
+        bool ok;
+    };
+    vector<Probe> batch;
+    vector<string> changed;
+    const double workerBudget = options.cpuBudget / shards.size();
+
+    while (running) {
+        batch.clear();
+        {
+            unique_lock<mutex> lock(shard.mtx);
+            if (shard.dueHeap.empty()) {
+                shard.wake.wait_for(lock, options.maxInterval,
+                                    [&]() { return !running || !shard.dueHeap.empty(); });
+                continue;
+            }
+            Clock::time_point now = Clock::now();
+            Clock::time_point nextDue = shard.dueHeap.front().due;
+            if (nextDue > now) {
+                // Wake early if stopped or if a newly added path is due sooner
+                shard.wake.wait_until(lock, nextDue,
+                                      [&]() { return !running || shard.dueHeap.front().due < nextDue; });
+                continue;
+            }
+            while (!shard.dueHeap.empty() && batch.size() < options.batchSize &&
+                   shard.dueHeap.front().due <= now) {
+                pop_heap(shard.dueHeap.begin(), shard.dueHeap.end(), greater<DueEntry>());
+                DueEntry entry = shard.dueHeap.back();
+                shard.dueHeap.pop_back();
+                const FileState& state = shard.slots[entry.slot];
+                if (state.generation != entry.generation) {
+                    continue; // removed since it was scheduled
+                }
+                batch.push_back({entry.slot, entry.generation, state.path, {}, false});
+            }
+        }
+
+        // Stat the whole batch without holding the shard lock
+        auto cpuStart = threadCpuTime();
+        auto wallStart = Clock::now();
+        {
+            TRACE_SPAN("poll.statx_batch");
+            for (auto& probe : batch) {
+                probe.ok = statx(AT_FDCWD, probe.path.c_str(), AT_STATX_SYNC_AS_STAT,
+                                 STATX_MTIME | STATX_CTIME | STATX_SIZE | STATX_INO, &probe.result) == 0;
+            }
+        }
+
+        changed.clear();
+        {
+            lock_guard<mutex> lock(shard.mtx);
+            Clock::time_point now = Clock::now();
+            for (auto& probe : batch) {
+                FileState& state = shard.slots[probe.slot];
+                if (state.generation != probe.generation) {
+                    continue;
+                }
+                const struct statx& st = probe.result;
+                bool differs = probe.ok != state.exists ||
+                               (probe.ok && (st.stx_mtime.tv_sec != state.mtimeSec ||
+                                             st.stx_mtime.tv_nsec != state.mtimeNsec ||
+                                             st.stx_ctime.tv_sec != state.ctimeSec ||
+                                             st.stx_ctime.tv_nsec != state.ctimeNsec ||
+                                             st.stx_size != state.size ||
+                                             st.stx_ino != state.inode));
+                if (differs && state.primed && probe.ok) {
+                    changed.push_back(state.path);
+                }
+                if (probe.ok) {
+                    state.mtimeSec = st.stx_mtime.tv_sec;
+                    state.mtimeNsec = st.stx_mtime.tv_nsec;
+                    state.ctimeSec = st.stx_ctime.tv_sec;
+                    state.ctimeNsec = st.stx_ctime.tv_nsec;
+                    state.size = st.stx_size;
+                    state.inode = st.stx_ino;
+                }
+                state.exists = probe.ok;
+
+                // Hot files drop back to the minimum interval, cold ones back off by 1.5x
+                if (differs && state.primed) {
+                    state.interval = options.minInterval;
+                } else {
+                    state.interval = min(options.maxInterval, state.interval + state.interval / 2);
+                }
+                state.primed = true;
+                shard.dueHeap.push_back({now + state.interval, probe.slot, probe.generation});
+                push_heap(shard.dueHeap.begin(), shard.dueHeap.end(), greater<DueEntry>());
+            }
+        }
+        auto cpuUsed = threadCpuTime() - cpuStart;
+        auto wallUsed = Clock::now() - wallStart;
+
+        if (!changed.empty()) {
+            TRACE_SPAN("poll.onChange");
+            onChange(changed);
+        }
+
+        // Throttle so that statx work stays within this worker's share of the CPU budget
+        if (workerBudget > 0) {
+            auto minWall = chrono::duration_cast<Clock::duration>(cpuUsed / workerBudget);
+            if (minWall > wallUsed) {
+                unique_lock<mutex> lock(shard.mtx);
+                shard.wake.wait_for(lock, minWall - wallUsed, [this]() { return !running; });
+            }
+        }
+    }
+}
@@ -0,0 +1,797 @@
+#include "Replication.h"
+#include "BackupStore.h"
+#include "Log.h"
+#include "Trace.h"
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const size_t CHUNK_SIZE = 64 * 1024;
+const uint32_t MAX_FRAME_DATA = 1024 * 1024;
+const uint16_t MAX_PATH_LENGTH = 4096;
+const auto MAX_BACKOFF = chrono::seconds(30);
+
+// Wire protocol, integers in network byte order:
+//   monitor -> peer  'F' seq:u64 size:u64 pathLength:u16 path   start of a version
+//                    'D' length:u32 data                        file contents
+//                    'E'                                        end of the version
+//                    'B' seq:u64                                end of a batch
+//   peer -> monitor  'A' seq:u64                                batch stored durably
+const char FRAME_FILE = 'F';
+const char FRAME_DATA = 'D';
+const char FRAME_END_FILE = 'E';
+const char FRAME_BATCH = 'B';
+const char FRAME_ACK = 'A';
+
+void putU64(string& out, uint64_t value) {
+    value = htobe64(value);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+uint64_t getU64(const char* data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return be64toh(value);
+}
+
+bool sendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void syncPath(const string& path, int flags) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | flags);
+    if (fd != -1) {
+        fdatasync(fd);
+        ::close(fd);
+    }
+}
+
+bool writeAll(int fd, const string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Replaces path with contents so that a crash leaves either the old or the
+// new file: temp file, fdatasync, rename, then fsync of the directory
+bool replaceFile(const string& path, const string& contents) {
+    const string tmpPath = path + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        monitorErr() << "Replication: cannot write " << tmpPath << ": " << strerror(errno) << endl;
+        return false;
+    }
+    const bool written = writeAll(fd, contents) && fdatasync(fd) == 0;
+    const int error = errno;
+    ::close(fd);
+    if (!written || rename(tmpPath.c_str(), path.c_str()) == -1) {
+        monitorErr() << "Replication: cannot replace " << path << ": " << strerror(written ? errno : error) << endl;
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    const string directory = fs::path(path).parent_path().string();
+    syncPath(directory.empty() ? "." : directory, O_DIRECTORY);
+    return true;
+}
+
+// Versions must land below the target root, whatever the sender claims
+bool safeRelativePath(const string& relativePath, fs::path& out) {
+    fs::path path = fs::path(relativePath).lexically_normal();
+    if (path.empty() || path.is_absolute() || *path.begin() == "..") {
+        return false;
+    }
+    out = path;
+    return true;
+}
+
+// "host:port" or "port"; the host defaults to loopback
+bool splitHostPort(const string& address, string& host, string& port) {
+    size_t colon = address.rfind(':');
+    host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+    port = colon == string::npos ? address : address.substr(colon + 1);
+    return !host.empty() && !port.empty();
+}
+
+// Stores versions under a directory. Files are written as .part, fsynced
+// together at the end of a batch and only then renamed into place.
+class DirectoryTarget : public ReplicationTarget {
+public:
+    explicit DirectoryTarget(string root) : root(std::move(root)), fd(-1), acked(0) {}
+    ~DirectoryTarget() override { disconnect(); }
+
+    string name() const override { return root; }
+
+    bool connect() override {
+        error_code ec;
+        fs::create_directories(root, ec);
+        return fs::is_directory(root, ec);
+    }
+
+    void disconnect() override {
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+        for (const auto& file : batch) {
+            unlink(file.first.c_str());
+        }
+        batch.clear();
+    }
+
+    TransferResult beginFile(uint64_t sequence, const string& relativePath, uint64_t) override {
+        fs::path relative;
+        if (fd != -1) {
+            return TransferResult::Failed;
+        }
+        if (!safeRelativePath(relativePath, relative)) {
+            return TransferResult::Rejected;
+        }
+        fs::path dest = fs::path(root) / relative;
+        error_code ec;
+        fs::create_directories(dest.parent_path(), ec);
+        destPath = dest.string();
+        // Two versions of one path in a batch each get their own part file
+        partPath = destPath + "." + to_string(sequence) + ".part";
+        fd = ::open(partPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            monitorErr() << "Replication: cannot create " << partPath << ": " << strerror(errno) << endl;
+            // A name this filesystem cannot hold fails the same way every time
+            bool badName = errno == ENAMETOOLONG || errno == EINVAL || errno == EISDIR || errno == ENOTDIR;
+            return badName ? TransferResult::Rejected : TransferResult::Failed;
+        }
+        return TransferResult::Ok;
+    }
+
+    bool writeChunk(const char* data, size_t size) override {
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                monitorErr() << "Replication: write " << partPath << ": " << strerror(errno) << endl;
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    bool endFile() override {
+        if (fd == -1) {
+            return false;
+        }
+        ::close(fd);
+        fd = -1;
+        batch.emplace_back(partPath, destPath);
+        return true;
+    }
+
+    bool endBatch(uint64_t lastSequence) override {
+        // One round of fsyncs per batch instead of one per file
+        vector<string> directories;
+        for (const auto& file : batch) {
+            syncPath(file.first, 0);
+        }
+        for (const auto& file : batch) {
+            if (rename(file.first.c_str(), file.second.c_str()) == -1) {
+                monitorErr() << "Replication: rename " << file.first << ": " << strerror(errno) << endl;
+                return false;
+            }
+            directories.push_back(fs::path(file.second).parent_path().string());
+        }
+        sort(directories.begin(), directories.end());
+        directories.erase(unique(directories.begin(), directories.end()), directories.end());
+        for (const auto& directory : directories) {
+            syncPath(directory, O_DIRECTORY);
+        }
+        batch.clear();
+        acked = lastSequence;
+        return true;
+    }
+
+    bool pollAcknowledged(uint64_t& sequence, int) override {
+        sequence = max(sequence, acked);
+        return true;
+    }
+
+private:
+    string root;
+    int fd;
+    string partPath;
+    string destPath;
+    vector<pair<string, string>> batch;  // .part path, final path
+    uint64_t acked;
+};
+
+// Streams versions to runReplicationPeer and collects its acknowledgements
+class TcpTarget : public ReplicationTarget {
+public:
+    explicit TcpTarget(string address) : address(std::move(address)), fd(-1) {}
+    ~TcpTarget() override { disconnect(); }
+
+    string name() const override { return REPLICATION_TCP_PREFIX + address; }
+
+    bool connect() override {
+        string host, port;
+        if (!splitHostPort(address, host, port)) {
+            return false;
+        }
+        addrinfo hints = {};
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* results = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0) {
+            return false;
+        }
+        for (addrinfo* ai = results; ai && fd == -1; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd != -1 && ::connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(results);
+        if (fd == -1) {
+            return false;
+        }
+        // A stalled peer must not block the sender forever
+        timeval timeout{10, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        received.clear();
+        return true;
+    }
+
+    void disconnect() override {
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    TransferResult beginFile(uint64_t sequence, const string& relativePath, uint64_t size) override {
+        if (relativePath.empty() || relativePath.size() > MAX_PATH_LENGTH) {
+            return TransferResult::Rejected;
+        }
+        string frame(1, FRAME_FILE);
+        putU64(frame, sequence);
+        putU64(frame, size);
+        uint16_t length = htobe16(static_cast<uint16_t>(relativePath.size()));
+        frame.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        frame += relativePath;
+        return sendAll(fd, frame.data(), frame.size()) ? TransferResult::Ok : TransferResult::Failed;
+    }
+
+    bool writeChunk(const char* data, size_t size) override {
+        char header[5];
+        header[0] = FRAME_DATA;
+        uint32_t length = htobe32(static_cast<uint32_t>(size));
+        memcpy(header + 1, &length, sizeof(length));
+        return sendAll(fd, header, sizeof(header)) && sendAll(fd, data, size);
+    }
+
+    bool endFile() override {
+        return sendAll(fd, &FRAME_END_FILE, 1);
+    }
+
+    bool endBatch(uint64_t lastSequence) override {
+        string frame(1, FRAME_BATCH);
+        putU64(frame, lastSequence);
+        return sendAll(fd, frame.data(), frame.size());
+    }
+
+    bool pollAcknowledged(uint64_t& sequence, int timeoutMs) override {
+        pollfd pfd{fd, POLLIN, 0};
+        if (poll(&pfd, 1, timeoutMs) <= 0) {
+            return true;
+        }
+        char buffer[4096];
+        ssize_t n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            return false; // peer went away
+        }
+        if (n > 0) {
+            received.append(buffer, static_cast<size_t>(n));
+        }
+        size_t offset = 0;
+        while (received.size() - offset >= 9) {
+            if (received[offset] != FRAME_ACK) {
+                return false;
+            }
+            sequence = max(sequence, getU64(received.data() + offset + 1));
+            offset += 9;
+        }
+        received.erase(0, offset);
+        return true;
+    }
+
+private:
+    string address;
+    int fd;
+    string received;
+};
+
+// Buffered exact reads for the peer
+class SocketReader {
+public:
+    explicit SocketReader(int fd) : fd(fd), position(0), length(0) {}
+
+    bool read(void* out, size_t size) {
+        char* dest = static_cast<char*>(out);
+        while (size > 0) {
+            if (position == length) {
+                ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+                if (n <= 0) {
+                    if (n == -1 && errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                position = 0;
+                length = static_cast<size_t>(n);
+            }
+            size_t take = min(size, length - position);
+            memcpy(dest, buffer + position, take);
+            position += take;
+            dest += take;
+            size -= take;
+        }
+        return true;
+    }
+
+private:
+    int fd;
+    char buffer[CHUNK_SIZE];
+    size_t position;
+    size_t length;
+};
+
+void serveReplicationConnection(int fd, DirectoryTarget& store) {
+    auto reader = make_unique<SocketReader>(fd);
+    vector<char> data(CHUNK_SIZE);
+    uint64_t files = 0;
+    bool skipping = false; // a rejected version: its data is read and dropped
+    while (true) {
+        char type;
+        if (!reader->read(&type, 1)) {
+            break;
+        }
+        bool ok = false;
+        if (type == FRAME_FILE) {
+            char header[18];
+            if (reader->read(header, sizeof(header))) {
+                uint16_t pathLength;
+                memcpy(&pathLength, header + 16, sizeof(pathLength));
+                string path(be16toh(pathLength), '\0');
+                if (path.size() <= MAX_PATH_LENGTH && reader->read(&path[0], path.size())) {
+                    TransferResult result = store.beginFile(getU64(header), path, getU64(header + 8));
+                    skipping = result == TransferResult::Rejected;
+                    ok = result != TransferResult::Failed;
+                    if (skipping) {
+                        monitorErr() << "Replica peer: rejecting version " << path << endl;
+                    }
+                }
+            }
+        } else if (type == FRAME_DATA) {
+            uint32_t length;
+            ok = reader->read(&length, sizeof(length));
+            length = be32toh(length);
+            ok = ok && length <= MAX_FRAME_DATA;
+            while (ok && length > 0) {
+                size_t take = min<size_t>(length, data.size());
+                ok = reader->read(data.data(), take) && (skipping || store.writeChunk(data.data(), take));
+                length -= static_cast<uint32_t>(take);
+            }
+        } else if (type == FRAME_END_FILE) {
+            ok = skipping || store.endFile();
+            files += skipping ? 0 : 1;
+            skipping = false;
+        } else if (type == FRAME_BATCH) {
+            char sequence[8];
+            if (reader->read(sequence, sizeof(sequence)) && store.endBatch(getU64(sequence))) {
+                string ack(1, FRAME_ACK);
+                ack.append(sequence, sizeof(sequence));
+                ok = sendAll(fd, ack.data(), ack.size());
+            }
+        }
+        if (!ok) {
+            monitorErr() << "Replica peer: protocol or storage error, dropping connection" << endl;
+            break;
+        }
+    }
+    store.disconnect(); // discards the unfinished batch; the monitor re-sends it
+    monitorOut() << "Replica peer: connection closed after " << files << " versions" << endl;
+}
+
+} // namespace
+
+unique_ptr<ReplicationTarget> makeReplicationTarget(const string& spec) {
+    const string prefix = REPLICATION_TCP_PREFIX;
+    if (spec.compare(0, prefix.size(), prefix) == 0) {
+        return make_unique<TcpTarget>(spec.substr(prefix.size()));
+    }
+    return make_unique<DirectoryTarget>(spec);
+}
+
+Replicator::Replicator(ReplicationOptions options)
+    : options(std::move(options)), nextSequence(1), acknowledged(0), bytesSent(0),
+      connected(false), running(false) {}
+
+Replicator::~Replicator() {
+    stop();
+}
+
+bool Replicator::start() {
+    if (!enabled() || running) {
+        return false;
+    }
+    target = makeReplicationTarget(options.target);
+    {
+        ifstream state(options.statePath);
+        state >> acknowledged;
+    }
+    {
+        lock_guard<mutex> queueLock(queueMtx);
+        lock_guard<mutex> lock(mtx);
+        pending.clear();
+        ifstream queue(options.queuePath);
+        uint64_t sequence;
+        string path;
+        while (queue >> sequence && queue.get() && getline(queue, path)) {
+            if (sequence > acknowledged && !path.empty()) {
+                pending.push_back({sequence, path});
+            }
+            nextSequence = max(nextSequence, sequence + 1);
+        }
+        nextSequence = max(nextSequence, acknowledged + 1);
+        // Keep only the unacknowledged tail
+        string tail;
+        for (const auto& record : pending) {
+            tail += to_string(record.sequence) + " " + record.backupPath + "\n";
+        }
+        replaceFile(options.queuePath, tail);
+    }
+    monitorOut() << "Replicating backups to " << target->name() << " (" << pending.size()
+                 << " versions waiting)" << endl;
+    sendAllowedAt = chrono::steady_clock::now();
+    running = true;
+    sender = thread([this]() { senderLoop(); });
+    return true;
+}
+
+void Replicator::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+    }
+    wake.notify_all();
+    if (sender.joinable()) {
+        sender.join();
+    }
+    target->disconnect();
+}
+
+void Replicator::enqueue(const vector<string>& backupPaths) {
+    if (!enabled() || backupPaths.empty()) {
+        return;
+    }
+    // queueMtx keeps appends in sequence order; mtx is only held briefly, so
+    // the sender is never stuck behind the fdatasync
+    lock_guard<mutex> queueLock(queueMtx);
+    vector<Record> records;
+    {
+        lock_guard<mutex> lock(mtx);
+        for (const auto& path : backupPaths) {
+            if (!path.empty()) {
+                records.push_back({nextSequence++, path});
+            }
+        }
+    }
+    string lines;
+    for (const auto& record : records) {
+        lines += to_string(record.sequence) + " " + record.backupPath + "\n";
+    }
+    int fd = ::open(options.queuePath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1 || !writeAll(fd, lines) || fdatasync(fd) == -1) {
+        monitorErr() << "Failed to append to " << options.queuePath << ": " << strerror(errno) << endl;
+    }
+    if (fd != -1) {
+        ::close(fd);
+    }
+    {
+        lock_guard<mutex> lock(mtx);
+        pending.insert(pending.end(), records.begin(), records.end());
+    }
+    wake.notify_one();
+}
+
+ReplicationStats Replicator::stats() const {
+    lock_guard<mutex> lock(mtx);
+    return {nextSequence - 1, acknowledged, bytesSent, connected};
+}
+
+void Replicator::senderLoop() {
+    auto backoff = chrono::seconds(1);
+    uint64_t sent = 0;                 // last sequence sent on this connection
+    size_t inFlight = 0;               // batches sent and not acknowledged
+    deque<uint64_t> batchEnds;
+    vector<Record> batch;
+
+    while (running) {
+        if (!connected) {
+            if (!target->connect()) {
+                unique_lock<mutex> lock(mtx);
+                wake.wait_for(lock, backoff, [this]() { return !running; });
+                backoff = min<chrono::seconds>(backoff * 2, MAX_BACKOFF);
+                continue;
+            }
+            lock_guard<mutex> lock(mtx);
+            connected = true;
+            // Everything after the last acknowledgement is sent again
+            sent = acknowledged;
+            sentDictionaries.clear();
+            batchEnds.clear();
+            inFlight = 0;
+            monitorOut() << "Replication connected to " << target->name() << ", resuming after #" << acknowledged << endl;
+        }
+
+        batch.clear();
+        {
+            unique_lock<mutex> lock(mtx);
+            if (inFlight < options.maxInFlight && !pending.empty() && pending.back().sequence > sent) {
+                // pending holds consecutive sequences starting right after the acknowledgement
+                size_t first = sent >= pending.front().sequence ? sent + 1 - pending.front().sequence : 0;
+                for (size_t i = first; i < pending.size() && batch.size() < options.batchSize; ++i) {
+                    batch.push_back(pending[i]);
+                }
+            } else if (inFlight == 0) {
+                wake.wait_for(lock, chrono::seconds(1), [&]() {
+                    return !running || (!pending.empty() && pending.back().sequence > sent);
+                });
+                continue;
+            }
+        }
+
+        bool ok = true;
+        if (!batch.empty()) {
+            TRACE_SPAN("replication.batch");
+            for (const auto& record : batch) {
+                TransferResult result = sendVersion(record);
+                if (result == TransferResult::Rejected) {
+                    reject(record); // retrying would block the queue behind it forever
+                } else if (!(ok = result == TransferResult::Ok)) {
+                    break;
+                }
+            }
+            if (ok && (ok = target->endBatch(batch.back().sequence))) {
+                sent = batch.back().sequence;
+                batchEnds.push_back(sent);
+                ++inFlight;
+            }
+        }
+
+        // Pipelined: only wait for acknowledgements when the window is full
+        uint64_t ack;
+        {
+            lock_guard<mutex> lock(mtx);
+            ack = acknowledged;
+        }
+        if (ok) {
+            ok = target->pollAcknowledged(ack, batch.empty() ? 100 : 0);
+        }
+        if (ok) {
+            if (acknowledge(ack)) {
+                backoff = chrono::seconds(1);
+            }
+            while (!batchEnds.empty() && batchEnds.front() <= ack) {
+                batchEnds.pop_front();
+                --inFlight;
+            }
+        } else {
+            target->disconnect();
+            unique_lock<mutex> lock(mtx);
+            connected = false;
+            monitorErr() << "Replication to " << target->name() << " interrupted, will resume after #"
+                         << acknowledged << endl;
+            // A failure that repeats without progress backs off like a failed connect
+            wake.wait_for(lock, backoff, [this]() { return !running; });
+            backoff = min<chrono::seconds>(backoff * 2, MAX_BACKOFF);
+        }
+    }
+}
+
+// Streams one version. A raw version the compactor has recompressed in the
+// meantime is sent as its .fmz file; a version that is gone is skipped.
+TransferResult Replicator::sendVersion(const Record& record) {
+    string path = record.backupPath;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        path += BACKUP_COMPRESSED_SUFFIX;
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (fd == -1) {
+        monitorErr() << "Replication: skipping missing version " << record.backupPath << endl;
+        return TransferResult::Ok;
+    }
+    // A compressed version cannot be restored without its dictionary, so the
+    // dictionary goes first, in the same batch, once per connection
+    if (path != record.backupPath) {
+        string dictionary = backupDictionaryPath(path);
+        if (!dictionary.empty() && sentDictionaries.insert(dictionary).second) {
+            int dictionaryFd = ::open(dictionary.c_str(), O_RDONLY | O_CLOEXEC);
+            TransferResult result = dictionaryFd == -1 ? TransferResult::Failed
+                                                       : sendFile(record.sequence, dictionary, dictionaryFd);
+            if (result != TransferResult::Ok) {
+                monitorErr() << "Replication: cannot send dictionary " << dictionary << endl;
+                sentDictionaries.erase(dictionary);
+                ::close(fd);
+                return result;
+            }
+        }
+    }
+    return sendFile(record.sequence, path, fd);
+}
+
+// Streams an open file under its path below backups/ and closes it
+TransferResult Replicator::sendFile(uint64_t sequence, const string& path, int fd) {
+    const string prefix = "backups/";
+    string relative = path.compare(0, prefix.size(), prefix) == 0 ? path.substr(prefix.size())
+                                                                  : fs::path(path).filename().string();
+    struct stat st;
+    TransferResult result = fstat(fd, &st) == 0
+                                ? target->beginFile(sequence, relative, static_cast<uint64_t>(st.st_size))
+                                : TransferResult::Failed;
+    bool ok = result == TransferResult::Ok;
+    vector<char> buffer(CHUNK_SIZE);
+    while (ok) {
+        ssize_t n = ::read(fd, buffer.data(), buffer.size());
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        throttle(static_cast<size_t>(n));
+        ok = target->writeChunk(buffer.data(), static_cast<size_t>(n));
+        lock_guard<mutex> lock(mtx);
+        bytesSent += static_cast<uint64_t>(n);
+    }
+    ::close(fd);
+    if (result == TransferResult::Rejected) {
+        return result;
+    }
+    return ok && target->endFile() ? TransferResult::Ok : TransferResult::Failed;
+}
+
+// Keeps a version the target refused out of the way of the rest of the
+// queue; the list lets it be copied by hand
+void Replicator::reject(const Record& record) {
+    monitorErr() << "Replication: " << target->name() << " refused " << record.backupPath << ", listed in "
+                 << options.rejectedPath << endl;
+    ofstream rejected(options.rejectedPath, ios::app);
+    rejected << record.sequence << " " << record.backupPath << "\n";
+}
+
+// Token bucket over wall time that allows at most one second of burst
+void Replicator::throttle(size_t bytes) {
+    if (options.bandwidthLimit == 0) {
+        return;
+    }
+    auto now = chrono::steady_clock::now();
+    sendAllowedAt = max(sendAllowedAt, now - chrono::seconds(1));
+    sendAllowedAt += chrono::nanoseconds(bytes * 1000000000ULL / options.bandwidthLimit);
+    if (sendAllowedAt > now) {
+        unique_lock<mutex> lock(mtx);
+        wake.wait_until(lock, sendAllowedAt, [this]() { return !running; });
+    }
+}
+
+bool Replicator::acknowledge(uint64_t sequence) {
+    {
+        lock_guard<mutex> lock(mtx);
+        if (sequence <= acknowledged) {
+            return false;
+        }
+        acknowledged = sequence;
+        while (!pending.empty() && pending.front().sequence <= sequence) {
+            pending.pop_front();
+        }
+    }
+    // Only the sender acknowledges, so the state is written without mtx and
+    // enqueue never waits on its fsyncs. The queue is only cut once the new
+    // state is durable; a longer queue is harmless, since records at or below
+    // the state are skipped on start.
+    if (!replaceFile(options.statePath, to_string(sequence) + "\n")) {
+        return true;
+    }
+    // An append in progress means the queue is not empty; the next
+    // acknowledgement cuts it instead
+    unique_lock<mutex> queueLock(queueMtx, try_to_lock);
+    if (queueLock.owns_lock()) {
+        lock_guard<mutex> lock(mtx);
+        if (pending.empty()) {
+            ofstream(options.queuePath, ios::trunc); // fully caught up
+        }
+    }
+    return true;
+}
+
+int runReplicationPeer(const string& listenAddress, const string& directory) {
+    string host, port;
+    if (!splitHostPort(listenAddress, host, port)) {
+        monitorErr() << "Invalid listen address: " << listenAddress << endl;
+        return 1;
+    }
+    addrinfo hints = {};
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* results = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0 || !results) {
+        monitorErr() << "Cannot resolve " << listenAddress << endl;
+        return 1;
+    }
+    int listener = socket(results->ai_family, results->ai_socktype | SOCK_CLOEXEC, results->ai_protocol);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (listener == -1 || ::bind(listener, results->ai_addr, results->ai_addrlen) == -1 || listen(listener, 4) == -1) {
+        monitorErr() << "Cannot listen on " << listenAddress << ": " << strerror(errno) << endl;
+        freeaddrinfo(results);
+        return 1;
+    }
+    freeaddrinfo(results);
+
+    DirectoryTarget store(directory);
+    if (!store.connect()) {
+        monitorErr() << "Cannot use " << directory << " as replica directory" << endl;
+        return 1;
+    }
+    monitorOut() << "Replica peer listening on " << host << ":" << port << ", storing into " << directory << endl;
+    while (true) {
+        int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            monitorErr() << "accept: " << strerror(errno) << endl;
+            return 1;
+        }
+        serveReplicationConnection(client, store);
+        ::close(client);
+    }
+}
@@ -0,0 +1,213 @@
+#include "Trace.h"
+#include "Log.h"
+#include <signal.h>
+
+using namespace std;
+
+#ifdef FILE_MONITOR_TRACING
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+namespace {
+
+static_assert((TRACE_RING_CAPACITY & (TRACE_RING_CAPACITY - 1)) == 0, "trace ring capacity must be a power of two");
+
+// Fields are relaxed atomics so that a dump may read a slot while its
+// owner overwrites it; torn slots are dropped by the head check
+struct TraceSlot {
+    atomic<const char*> name{nullptr};
+    atomic<int64_t> startNs{0};
+    atomic<int64_t> endNs{0};
+};
+
+struct ThreadTrace {
+    pid_t tid = 0;
+    string threadName;
+    atomic<uint64_t> head{0};   // spans ever recorded by the owner thread
+    TraceSlot slots[TRACE_RING_CAPACITY];
+};
+
+struct CopiedSpan {
+    const char* name;
+    int64_t startNs;
+    int64_t endNs;
+};
+
+mutex registryMtx;
+vector<shared_ptr<ThreadTrace>> registry; // rings outlive their threads until the process exits
+
+ThreadTrace& localTrace() {
+    thread_local shared_ptr<ThreadTrace> trace;
+    if (!trace) {
+        trace = make_shared<ThreadTrace>();
+        trace->tid = static_cast<pid_t>(syscall(SYS_gettid));
+        char name[16] = {};
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        trace->threadName = name;
+        lock_guard<mutex> lock(registryMtx);
+        registry.push_back(trace);
+    }
+    return *trace;
+}
+
+// Copies the spans of one ring that were not overwritten during the copy
+vector<CopiedSpan> copyRing(const ThreadTrace& trace) {
+    uint64_t head = trace.head.load(memory_order_acquire);
+    uint64_t first = head > TRACE_RING_CAPACITY ? head - TRACE_RING_CAPACITY : 0;
+    vector<CopiedSpan> spans;
+    spans.reserve(head - first);
+    for (uint64_t i = first; i < head; ++i) {
+        const TraceSlot& slot = trace.slots[i & (TRACE_RING_CAPACITY - 1)];
+        spans.push_back({slot.name.load(memory_order_relaxed), slot.startNs.load(memory_order_relaxed),
+                         slot.endNs.load(memory_order_relaxed)});
+    }
+    atomic_thread_fence(memory_order_acquire);
+    // The owner may have reused slots while we copied; it is at most one
+    // slot ahead of the head it has published
+    uint64_t after = trace.head.load(memory_order_relaxed);
+    uint64_t valid = after + 1 > TRACE_RING_CAPACITY ? after + 1 - TRACE_RING_CAPACITY : 0;
+    if (valid > first) {
+        spans.erase(spans.begin(), spans.begin() + min<uint64_t>(valid - first, spans.size()));
+    }
+    return spans;
+}
+
+void writeJsonString(ostream& out, const string& text) {
+    out << '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out << ' ';
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+int signalPipe[2] = {-1, -1};
+
+void onDumpSignal(int) {
+    int savedErrno = errno;
+    char byte = 1;
+    ssize_t ignored = write(signalPipe[1], &byte, 1);
+    (void)ignored;
+    errno = savedErrno;
+}
+
+} // namespace
+
+void traceRecord(const char* name, int64_t startNs, int64_t endNs) {
+    ThreadTrace& trace = localTrace();
+    uint64_t head = trace.head.load(memory_order_relaxed);
+    TraceSlot& slot = trace.slots[head & (TRACE_RING_CAPACITY - 1)];
+    slot.name.store(name, memory_order_relaxed);
+    slot.startNs.store(startNs, memory_order_relaxed);
+    slot.endNs.store(endNs, memory_order_relaxed);
+    trace.head.store(head + 1, memory_order_release);
+}
+
+bool dumpTrace(const string& path) {
+    vector<shared_ptr<ThreadTrace>> traces;
+    {
+        lock_guard<mutex> lock(registryMtx);
+        traces = registry;
+    }
+    ofstream out(path, ios::trunc);
+    if (!out.is_open()) {
+        monitorErr() << "Failed to open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    const pid_t pid = getpid();
+    size_t count = 0;
+    bool first = true;
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    out << fixed << setprecision(3);
+    for (const auto& trace : traces) {
+        out << (first ? "\n" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid
+            << ",\"tid\":" << trace->tid << ",\"args\":{\"name\":";
+        writeJsonString(out, trace->threadName.empty() ? "thread " + to_string(trace->tid) : trace->threadName);
+        out << "}}";
+        first = false;
+        for (const auto& span : copyRing(*trace)) {
+            if (!span.name) {
+                continue;
+            }
+            // Complete events ("X") take microseconds
+            out << ",\n{\"ph\":\"X\",\"name\":";
+            writeJsonString(out, span.name);
+            out << ",\"pid\":" << pid << ",\"tid\":" << trace->tid
+                << ",\"ts\":" << span.startNs / 1000.0 << ",\"dur\":" << (span.endNs - span.startNs) / 1000.0 << "}";
+            ++count;
+        }
+    }
+    out << "\n]}\n";
+    out.close();
+    if (!out) {
+        monitorErr() << "Failed to write " << path << endl;
+        return false;
+    }
+    monitorOut() << "Wrote " << count << " trace spans from " << traces.size() << " threads to " << path << endl;
+    return true;
+}
+
+void installTraceDumpSignal(const string& path) {
+    static pid_t installedFor = 0;
+    if (installedFor == getpid()) {
+        return;
+    }
+    if (signalPipe[0] != -1) {
+        // Inherited from the parent; its dumping thread is not running here
+        close(signalPipe[0]);
+        close(signalPipe[1]);
+    }
+    if (pipe2(signalPipe, O_CLOEXEC) == -1) {
+        monitorErr() << "pipe2: " << strerror(errno) << endl;
+        return;
+    }
+    installedFor = getpid();
+    thread([path, fd = signalPipe[0]]() {
+        char byte;
+        while (true) {
+            ssize_t n = read(fd, &byte, 1);
+            if (n == 1) {
+                dumpTrace(path);
+            } else if (n == 0 || errno != EINTR) {
+                return;
+            }
+        }
+    }).detach();
+
+    struct sigaction action = {};
+    action.sa_handler = onDumpSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, nullptr);
+}
+
+#else
+
+bool dumpTrace(const string& path) {
+    monitorErr() << "Tracing is not compiled in (build with -DFILE_MONITOR_TRACING), " << path << " not written" << endl;
+    return false;
+}
+
+// SIGUSR2 would otherwise terminate the monitor when --dump-trace is sent to it
+void installTraceDumpSignal(const string&) {
+    signal(SIGUSR2, SIG_IGN);
+}
+
+#endif // FILE_MONITOR_TRACING
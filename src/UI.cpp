@@ -1,6 +1,9 @@
 #include "UI.h"
 #include "Utils.h"
 #include "Navigation.h"
+#include "DirectoryCache.h"
+#include "FuzzySearch.h"
+#include "PathIndex.h"
 #include <filesystem>
 #include <dirent.h>
 #include <algorithm>
@@ -9,6 +12,8 @@
 #include <locale.h>
 #include <iostream>
 #include <unistd.h> // Added for sleep function
+#include <chrono>
+#include <memory>
 
 using namespace std;
 
@@ -42,6 +47,69 @@ void printColored(WINDOW* win, const string& text, int colorPair, bool highlight
     }
 }
 
+namespace {
+
+// Listings survive between calls, so returning to a directory is instant
+DirectoryCache& directoryCache() {
+    static DirectoryCache cache;
+    return cache;
+}
+
+struct ScreenLine {
+    string text;
+    int color;
+    bool highlight;
+
+    bool operator==(const ScreenLine& other) const {
+        return color == other.color && highlight == other.highlight && text == other.text;
+    }
+};
+
+// Virtual scrolling: only the lines that differ from the previous frame are
+// rewritten, so moving the cursor touches two lines instead of the screen
+void drawFrame(const vector<ScreenLine>& frame, vector<ScreenLine>& shown) {
+    bool changed = false;
+    for (size_t y = 0; y < max(frame.size(), shown.size()); ++y) {
+        if (y < frame.size() && y < shown.size() && frame[y] == shown[y]) {
+            continue;
+        }
+        move(static_cast<int>(y), 0);
+        clrtoeol();
+        if (y < frame.size()) {
+            string text = frame[y].text;
+            if (COLS > 0 && text.size() >= static_cast<size_t>(COLS)) {
+                text.resize(COLS - 1); // a wrapped line would shift every line below it
+            }
+            printColored(stdscr, text, frame[y].color, frame[y].highlight);
+        }
+        changed = true;
+    }
+    shown = frame;
+    if (changed) {
+        refresh();
+    }
+}
+
+string joinPath(const string& dir, const string& name) {
+    return dir == "/" ? "/" + name : dir + "/" + name;
+}
+
+bool passesFilter(char filter, char type) {
+    return filter == 0 ||
+           (filter == 'f' && type == DT_REG) ||
+           (filter == 'd' && type == DT_DIR) ||
+           (filter == 'l' && type == DT_LNK);
+}
+
+// Pads a control line to the box width
+string boxLine(const string& text) {
+    string line = "| " + text;
+    line.resize(81, ' ');
+    return line + "|";
+}
+
+} // namespace
+
 // Implements the file selection interface using ncurses
 string browseAndSelectFileImpl(const string& startDir, 
                               deque<string>& dirHistory, 
@@ -58,6 +126,7 @@ string browseAndSelectFileImpl(const string& startDir,
     noecho();
     keypad(stdscr, TRUE);
     curs_set(0);
+    set_escdelay(25); // Esc leaves search mode without a noticeable pause
     initColors();
 
     if (has_colors() == FALSE) {
@@ -66,178 +135,316 @@ string browseAndSelectFileImpl(const string& startDir,
         return "";
     }
 
-    string currentDir = startDir;
+    // Each keystroke gets this much scanning before the screen is redrawn;
+    // the rest of a long scan continues between keystrokes
+    const auto SEARCH_SLICE = chrono::milliseconds(12);
+
+    DirectoryCache& cache = directoryCache();
+    string currentDir = fs::absolute(startDir).lexically_normal().string();
+    if (currentDir.size() > 1 && currentDir.back() == '/') currentDir.pop_back();
     char filter = 0;
-    size_t page = 0;
     size_t itemsPerPage = 10; // Made variable to allow dynamic changes
-    size_t selectedItem = 0;
-    bool refreshNeeded = true;
-    vector<pair<string, char>> files;
-    size_t startIdx = 0;
+    size_t cursor = 0;        // index into view
+    size_t top = 0;           // first visible index
+    shared_ptr<DirectoryListing> listing;
+    uint64_t viewVersion = 0;
+    char viewFilter = 0;
+    vector<uint32_t> view;    // indices into listing->entries, or into pathIndex when searching recursively
+    vector<ScreenLine> shown;
+    vector<ScreenLine> frame;
 
-    while (true) {
-        if (refreshNeeded) {
-            clear();
-            // Header (increased length to 80 characters + 2 for borders)
-            printColored(stdscr, "+--------------------------------------------------------------------------------+\n", COLOR_HEADER);
-            printColored(stdscr, "| Select file to track (q - exit)                                                      |\n", COLOR_HEADER);
-            string dirLine = "| Current directory: " + fs::absolute(currentDir).string();
-            dirLine.resize(80, ' ');
-            dirLine += "|\n";
-            printColored(stdscr, dirLine, COLOR_HEADER);
-            printColored(stdscr, "+--------------------------------------------------------------------------------+\n", COLOR_HEADER);
-
-            // File list
-            files.clear();
-            DIR* dir = opendir(currentDir.c_str());
-            if (dir) {
-                struct dirent* entry;
-                while ((entry = readdir(dir)) != nullptr) {
-                    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                        continue;
+    // Type-to-search state
+    bool searching = false;
+    bool recursive = false;
+    string query;
+    FuzzySearcher searcher;
+    unique_ptr<PathIndex> pathIndex;
+    const void* searchSource = nullptr;   // candidate set the searcher's results belong to
+    char searchFilter = 0;
+    size_t rankedMatches = SIZE_MAX;      // searcher.matchCount() when view was last ranked
+    bool viewIsSearch = false;
 
-                    string fullPath = currentDir + "/" + entry->d_name;
-                    char type = entry->d_type;
-                    if (type == DT_UNKNOWN) {
-                        if (fs::is_directory(fullPath)) type = DT_DIR;
-                        else if (fs::is_symlink(fullPath)) type = DT_LNK;
-                        else if (fs::is_regular_file(fullPath)) type = DT_REG;
-                    }
-                    if (filter == 0 || 
-                        (filter == 'f' && type == DT_REG) ||
-                        (filter == 'd' && type == DT_DIR) ||
-                        (filter == 'l' && type == DT_LNK)) {
-                        files.emplace_back(fullPath, type);
-                    }
+    auto resetPosition = [&]() {
+        cursor = 0;
+        top = 0;
+    };
+    auto leaveSearch = [&]() {
+        searching = false;
+        query.clear();
+        searcher.setQuery("");
+        viewVersion = UINT64_MAX; // rebuild the plain listing
+        resetPosition();
+    };
+    auto changeDirectory = [&](string dir) {
+        if (dir.empty()) dir = "/";
+        currentDir = dir;
+        if (searching) leaveSearch();
+        resetPosition();
+    };
+
+    clear();
+    while (true) {
+        cache.pollInvalidations();
+        shared_ptr<DirectoryListing> latest = cache.get(currentDir);
+        const bool searchActive = searching && !query.empty();
+        if (searchActive) {
+            if (recursive && (!pathIndex || pathIndex->root() != currentDir)) {
+                pathIndex = make_unique<PathIndex>(currentDir);
+            }
+            listing = latest;
+            const void* source = recursive ? static_cast<const void*>(pathIndex.get()) : listing.get();
+            if (source != searchSource || filter != searchFilter) {
+                searchSource = source;
+                searchFilter = filter;
+                searcher.reset();
+                rankedMatches = SIZE_MAX;
+            }
+            auto deadline = chrono::steady_clock::now() + SEARCH_SLICE;
+            if (recursive) {
+                lock_guard<mutex> lock(pathIndex->mtx);
+                searcher.scan(pathIndex->size(), [&](uint32_t i) {
+                    return passesFilter(filter, pathIndex->type(i)) ? pathIndex->path(i) : string_view();
+                }, deadline);
+            } else {
+                lock_guard<mutex> lock(listing->mtx);
+                searcher.scan(static_cast<uint32_t>(listing->entries.size()), [&](uint32_t i) {
+                    const DirEntry& entry = listing->entries[i];
+                    return passesFilter(filter, entry.type) ? string_view(entry.name) : string_view();
+                }, deadline);
+            }
+            // Only the part of the ranking that can be scrolled to is sorted
+            size_t wanted = min(searcher.matchCount(), max<size_t>(1000, cursor + 2 * itemsPerPage));
+            if (!viewIsSearch || searcher.matchCount() != rankedMatches || view.size() < wanted) {
+                view = searcher.ranked(wanted);
+                rankedMatches = searcher.matchCount();
+                viewIsSearch = true;
+            }
+        } else if (viewIsSearch || latest != listing || latest->version != viewVersion || filter != viewFilter) {
+            listing = latest;
+            viewVersion = listing->version;
+            viewFilter = filter;
+            viewIsSearch = false;
+            lock_guard<mutex> lock(listing->mtx);
+            view.clear();
+            for (uint32_t index : listing->order) {
+                if (passesFilter(filter, listing->entries[index].type)) {
+                    view.push_back(index);
                 }
-                closedir(dir);
             }
+        }
+        if (cursor >= view.size()) cursor = view.empty() ? 0 : view.size() - 1;
+        if (cursor < top) top = cursor;
+        if (cursor >= top + itemsPerPage) top = cursor - itemsPerPage + 1;
+        const bool fromIndex = searchActive && recursive;
 
-            sort(files.begin(), files.end(), [](const auto& a, const auto& b) {
-                if (a.second == DT_DIR && b.second != DT_DIR) return true;
-                if (a.second != DT_DIR && b.second == DT_DIR) return false;
-                return a.first < b.first;
-            });
-
-            size_t totalPages = (files.size() + itemsPerPage - 1) / itemsPerPage;
-            startIdx = page * itemsPerPage;
-            size_t endIdx = min(startIdx + itemsPerPage, files.size());
+        frame.clear();
+        // Header (increased length to 80 characters + 2 for borders)
+        frame.push_back({"+--------------------------------------------------------------------------------+", COLOR_HEADER, false});
+        frame.push_back({"| Select file to track (q - exit)                                                      |", COLOR_HEADER, false});
+        string dirLine = "| Current directory: " + currentDir;
+        dirLine.resize(80, ' ');
+        dirLine += "|";
+        frame.push_back({dirLine, COLOR_HEADER, false});
+        frame.push_back({"+--------------------------------------------------------------------------------+", COLOR_HEADER, false});
 
-            // Page information
-            string pageInfo = "Page " + to_string(page + 1) + " of " + to_string(totalPages);
-            printColored(stdscr, pageInfo + "\n\n", COLOR_HEADER);
+        // Page information
+        const size_t total = searchActive ? searcher.matchCount() : view.size();
+        size_t totalPages = (total + itemsPerPage - 1) / itemsPerPage;
+        string pageInfo = "Page " + to_string(top / itemsPerPage + 1) + " of " + to_string(max<size_t>(1, totalPages)) +
+                          "   " + to_string(total) + (searchActive ? " matches" : " entries");
+        if (listing->failed) {
+            pageInfo += " (cannot read directory)";
+        } else if (searchActive && !searcher.complete()) {
+            pageInfo += " (searching...)";
+        } else if (fromIndex ? !pathIndex->complete() : !listing->complete) {
+            pageInfo += fromIndex ? " (indexing...)" : " (loading...)";
+        }
+        frame.push_back({pageInfo, COLOR_HEADER, false});
+        if (searching) {
+            frame.push_back({string(recursive ? "Search below: " : "Search: ") + query + "_", COLOR_HEADER, false});
+        } else {
+            frame.push_back({"", COLOR_HEADER, false});
+        }
 
-            // Display file list
-            for (size_t i = startIdx; i < endIdx; i++) {
-                bool isSelected = (i - startIdx == selectedItem);
-                string entry = "  " + to_string(i - startIdx + 1) + ". ";
+        // Only the visible window of the listing is formatted
+        {
+            unique_lock<mutex> lock(fromIndex ? pathIndex->mtx : listing->mtx);
+            for (size_t i = top; i < top + itemsPerPage; i++) {
+                if (i >= view.size()) {
+                    frame.push_back({"", COLOR_FILE, false});
+                    continue;
+                }
+                char type = fromIndex ? pathIndex->type(view[i]) : listing->entries[view[i]].type;
+                string entry = "  " + to_string(i + 1) + ". ";
                 int color;
-                switch (files[i].second) {
+                switch (type) {
                     case DT_DIR: color = COLOR_DIR; entry += "[DIR] "; break;
                     case DT_REG: color = COLOR_FILE; entry += "[FILE] "; break;
                     case DT_LNK: color = COLOR_LINK; entry += "[LINK] "; break;
                     default: color = COLOR_FILE; entry += "[?] ";
                 }
-                entry += fs::path(files[i].first).filename().string();
-                printColored(stdscr, entry + "\n", color, isSelected);
+                if (fromIndex) {
+                    entry += pathIndex->path(view[i]);
+                } else {
+                    entry += listing->entries[view[i]].name;
+                }
+                frame.push_back({entry, color, i == cursor});
             }
+        }
 
-            // Controls (increased length to 80 characters + 2 for borders)
-            printColored(stdscr, "\n+--------------------------------------------------------------------------------+\n", COLOR_HEADER);
-            printColored(stdscr, "| Controls:                                                                      |\n", COLOR_HEADER);
-            printColored(stdscr, "| Arrows: navigate   Enter: select   q: exit   Home: go to home directory       |\n", COLOR_HEADER);
-            printColored(stdscr, "| f/d/l/a: filters   +/-: page size   h: history   p: previous                  |\n", COLOR_HEADER);
-            printColored(stdscr, "+--------------------------------------------------------------------------------+\n", COLOR_HEADER);
-
-            refresh();
-            refreshNeeded = false;
+        // Controls (increased length to 80 characters + 2 for borders)
+        frame.push_back({"", COLOR_HEADER, false});
+        frame.push_back({"+--------------------------------------------------------------------------------+", COLOR_HEADER, false});
+        frame.push_back({"| Controls:                                                                      |", COLOR_HEADER, false});
+        if (searching) {
+            frame.push_back({boxLine("Type to search   Arrows: navigate   Enter: select   Esc: end search"), COLOR_HEADER, false});
+            frame.push_back({boxLine("Backspace: erase   Ctrl-R: search subdirectories too"), COLOR_HEADER, false});
+        } else {
+            frame.push_back({"| Arrows: navigate   Enter: select   q: exit   Home: go to home directory       |", COLOR_HEADER, false});
+            frame.push_back({"| f/d/l/a: filters   +/-: page size   h: history   p: previous   /: search      |", COLOR_HEADER, false});
         }
+        frame.push_back({"+--------------------------------------------------------------------------------+", COLOR_HEADER, false});
+        drawFrame(frame, shown);
 
+        // Wake up periodically so that streamed entries appear, and keep
+        // going immediately while a search is unfinished
+        const bool busy = searchActive && (!searcher.complete() ||
+                                           (recursive && !pathIndex->complete()));
+        timeout(busy ? 0 : 100);
         int ch = getch();
-        refreshNeeded = true;
+        if (ch == ERR) {
+            continue; // timeout: pick up streamed entries and invalidations
+        }
+
+        if (searching) {
+            bool queryChanged = false;
+            switch (ch) {
+                case 27: // Esc
+                    leaveSearch();
+                    continue;
+                case KEY_BACKSPACE: case 127: case 8:
+                    if (query.empty()) {
+                        leaveSearch();
+                        continue;
+                    }
+                    query.pop_back();
+                    queryChanged = true;
+                    break;
+                case 18: // Ctrl-R
+                    recursive = !recursive;
+                    resetPosition();
+                    continue;
+                case KEY_UP: case KEY_DOWN: case KEY_LEFT: case KEY_RIGHT: case '\n': case KEY_RESIZE:
+                    break; // handled below like in normal mode
+                default:
+                    if (ch >= 32 && ch < 127) {
+                        query += static_cast<char>(ch);
+                        queryChanged = true;
+                    }
+                    break;
+            }
+            if (queryChanged) {
+                searcher.setQuery(query);
+                rankedMatches = SIZE_MAX;
+                resetPosition();
+                continue;
+            }
+            if (ch != KEY_UP && ch != KEY_DOWN && ch != KEY_LEFT && ch != KEY_RIGHT && ch != '\n' && ch != KEY_RESIZE) {
+                continue;
+            }
+        }
 
         switch(ch) {
             case KEY_UP:
-                if (selectedItem > 0) selectedItem--;
+                if (cursor > 0) cursor--;
                 break;
             case KEY_DOWN:
-                if (selectedItem < min(itemsPerPage, files.size() - startIdx) - 1) selectedItem++;
+                if (cursor + 1 < view.size()) cursor++;
                 break;
             case KEY_LEFT:
-                if (page > 0) {
-                    page--;
-                    selectedItem = 0;
-                }
+                top = top > itemsPerPage ? top - itemsPerPage : 0;
+                cursor = cursor > itemsPerPage ? cursor - itemsPerPage : 0;
                 break;
             case KEY_RIGHT:
-                if (page < (files.size() + itemsPerPage - 1) / itemsPerPage - 1) {
-                    page++;
-                    selectedItem = 0;
+                if (top + itemsPerPage < view.size()) {
+                    top += itemsPerPage;
+                    cursor = min(cursor + itemsPerPage, view.size() - 1);
                 }
                 break;
             case KEY_HOME:
-                currentDir = getenv("HOME") ? getenv("HOME") : "/";
-                page = 0;
-                selectedItem = 0;
+                changeDirectory(getenv("HOME") ? getenv("HOME") : "/");
                 break;
             case KEY_BACKSPACE:
                 if (!currentDir.empty()) {
                     backStack.push(currentDir);
-                    currentDir = fs::path(currentDir).parent_path().string();
-                    if (currentDir.empty()) currentDir = "/";
-                    page = 0;
-                    selectedItem = 0;
+                    changeDirectory(fs::path(currentDir).parent_path().string());
                 }
                 break;
+            case KEY_RESIZE:
+                clear();
+                shown.clear();
+                break;
+            case '/':
+                searching = true;
+                resetPosition();
+                break;
             case 'h':
                 showHistory(dirHistory);
+                clear();
+                shown.clear();
                 break;
             case '+':
                 if (itemsPerPage < 50) {
                     itemsPerPage += 5;
-                    page = 0;
-                    selectedItem = 0;
+                    resetPosition();
                 }
                 break;
             case '-':
                 if (itemsPerPage > 5) {
                     itemsPerPage -= 5;
-                    page = 0;
-                    selectedItem = 0;
+                    resetPosition();
                 }
                 break;
             case 'p':
                 {
                     string parentDir = fs::path(currentDir).parent_path().string();
                     if (parentDir != currentDir) { // Avoid infinite loop at root
-                        currentDir = parentDir;
-                        page = 0;
-                        selectedItem = 0;
+                        changeDirectory(parentDir);
                     } else {
-                        printw("Already at root directory.\n");
+                        mvprintw(static_cast<int>(frame.size()), 0, "Already at root directory.");
                         refresh();
                         sleep(1); // Brief delay to show message
+                        move(static_cast<int>(frame.size()), 0);
+                        clrtoeol();
                     }
                 }
                 break;
             case 'f': case 'd': case 'l': case 'a':
                 filter = (ch == 'a') ? 0 : ch;
-                page = 0;
-                selectedItem = 0;
+                resetPosition();
                 break;
             case 'q':
                 endwin();
                 return "";
             case '\n':
-                if (!files.empty() && selectedItem < files.size() - startIdx) {
-                    size_t idx = startIdx + selectedItem;
-                    if (files[idx].second == DT_DIR) {
-                        currentDir = files[idx].first;
-                        page = 0;
-                        selectedItem = 0;
+                if (cursor < view.size()) {
+                    string name;
+                    char type;
+                    if (fromIndex) {
+                        lock_guard<mutex> lock(pathIndex->mtx);
+                        name = string(pathIndex->path(view[cursor]));
+                        type = pathIndex->type(view[cursor]);
+                    } else {
+                        lock_guard<mutex> lock(listing->mtx);
+                        name = listing->entries[view[cursor]].name;
+                        type = listing->entries[view[cursor]].type;
+                    }
+                    string fullPath = joinPath(currentDir, name);
+                    if (type == DT_DIR) {
+                        changeDirectory(fullPath);
                     } else {
                         endwin();
-                        return files[idx].first;
+                        return fullPath;
                     }
                 }
                 break;
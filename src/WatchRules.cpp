@@ -0,0 +1,276 @@
+#include "WatchRules.h"
+#include "Log.h"
+#include <bitset>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+const size_t MAX_DFA_STATES = 65536;
+
+// A glob compiles to a sequence of byte sets; repeating sets loop on themselves
+struct GlobToken {
+    bitset<256> bytes;
+    bool repeat;
+};
+
+struct CompiledGlob {
+    vector<GlobToken> tokens;
+    bool include;
+};
+
+bool parseGlob(const string& pattern, vector<GlobToken>& tokens) {
+    bitset<256> anyButSlash;
+    anyButSlash.set();
+    anyButSlash.reset('/');
+    bitset<256> anything;
+    anything.set();
+
+    string glob = pattern;
+    if (glob.empty() || glob[0] != '/') {
+        glob = "**/" + glob;
+    }
+
+    tokens.clear();
+    for (size_t i = 0; i < glob.size(); ++i) {
+        char c = glob[i];
+        GlobToken token{bitset<256>(), false};
+        if (c == '*') {
+            bool doubleStar = i + 1 < glob.size() && glob[i + 1] == '*';
+            if (doubleStar) {
+                ++i;
+            }
+            token.bytes = doubleStar ? anything : anyButSlash;
+            token.repeat = true;
+        } else if (c == '?') {
+            token.bytes = anyButSlash;
+        } else if (c == '[') {
+            size_t j = i + 1;
+            bool negate = j < glob.size() && (glob[j] == '!' || glob[j] == '^');
+            if (negate) {
+                ++j;
+            }
+            bool first = true;
+            while (j < glob.size() && (glob[j] != ']' || first)) {
+                unsigned char low = glob[j];
+                unsigned char high = low;
+                if (j + 2 < glob.size() && glob[j + 1] == '-' && glob[j + 2] != ']') {
+                    high = glob[j + 2];
+                    j += 2;
+                }
+                for (unsigned b = low; b <= high; ++b) {
+                    token.bytes.set(b);
+                }
+                ++j;
+                first = false;
+            }
+            if (j >= glob.size()) {
+                return false; // unterminated class
+            }
+            if (negate) {
+                token.bytes.flip();
+            }
+            token.bytes.reset('/');
+            i = j;
+        } else {
+            if (c == '\\') {
+                if (++i >= glob.size()) {
+                    return false;
+                }
+                c = glob[i];
+            }
+            token.bytes.set(static_cast<unsigned char>(c));
+        }
+        tokens.push_back(token);
+    }
+    return true;
+}
+
+// NFA positions are packed as (glob index << 16) | token position
+uint32_t packPosition(size_t glob, size_t position) {
+    return static_cast<uint32_t>((glob << 16) | position);
+}
+
+void addWithClosure(const vector<CompiledGlob>& globs, size_t glob, size_t position, vector<uint32_t>& set) {
+    const auto& tokens = globs[glob].tokens;
+    while (true) {
+        set.push_back(packPosition(glob, position));
+        if (position < tokens.size() && tokens[position].repeat) {
+            ++position; // a repeating token may also match nothing
+        } else {
+            break;
+        }
+    }
+}
+
+void normalize(vector<uint32_t>& set) {
+    sort(set.begin(), set.end());
+    set.erase(unique(set.begin(), set.end()), set.end());
+}
+
+} // namespace
+
+RuleMatcher::RuleMatcher() : classCount(0) {
+    fill(begin(byteClass), end(byteClass), 0);
+}
+
+bool RuleMatcher::compile(const vector<WatchRule>& rules) {
+    transitions.clear();
+    stateFlags.clear();
+
+    vector<CompiledGlob> globs;
+    for (const auto& rule : rules) {
+        CompiledGlob glob;
+        glob.include = rule.include;
+        if (!parseGlob(rule.pattern, glob.tokens) || glob.tokens.size() >= 0xFFFF) {
+            monitorErr() << "Invalid watch rule pattern: " << rule.pattern << endl;
+            return false;
+        }
+        globs.push_back(move(glob));
+    }
+    if (globs.size() >= 0xFFFF) {
+        monitorErr() << "Too many watch rules" << endl;
+        return false;
+    }
+
+    // Bytes that every token treats the same way share one column of the table
+    map<vector<bool>, uint16_t> classIds;
+    vector<unsigned char> representative;
+    for (unsigned b = 0; b < 256; ++b) {
+        vector<bool> signature;
+        for (const auto& glob : globs) {
+            for (const auto& token : glob.tokens) {
+                signature.push_back(token.bytes.test(b));
+            }
+        }
+        auto it = classIds.find(signature);
+        if (it == classIds.end()) {
+            it = classIds.emplace(signature, static_cast<uint16_t>(representative.size())).first;
+            representative.push_back(static_cast<unsigned char>(b));
+        }
+        byteClass[b] = it->second;
+    }
+    classCount = representative.size();
+
+    // Subset construction; state 0 is the dead state
+    map<vector<uint32_t>, int32_t> stateIds;
+    vector<vector<uint32_t>> states;
+    auto intern = [&](vector<uint32_t>& set) {
+        normalize(set);
+        auto it = stateIds.find(set);
+        if (it != stateIds.end()) {
+            return it->second;
+        }
+        int32_t id = static_cast<int32_t>(states.size());
+        stateIds.emplace(set, id);
+        states.push_back(set);
+        return id;
+    };
+
+    vector<uint32_t> set;
+    intern(set);
+    for (size_t g = 0; g < globs.size(); ++g) {
+        addWithClosure(globs, g, 0, set);
+    }
+    intern(set);
+
+    for (size_t current = 0; current < states.size(); ++current) {
+        if (states.size() > MAX_DFA_STATES) {
+            monitorErr() << "Watch rules are too complex (more than " << MAX_DFA_STATES << " DFA states)" << endl;
+            transitions.clear();
+            stateFlags.clear();
+            return false;
+        }
+        uint8_t flags = 0;
+        for (uint32_t packed : states[current]) {
+            size_t g = packed >> 16;
+            size_t position = packed & 0xFFFF;
+            if (globs[g].include) {
+                flags |= INCLUDE_LIVE;
+            }
+            if (position == globs[g].tokens.size()) {
+                flags |= globs[g].include ? INCLUDE_ACCEPT : EXCLUDE_ACCEPT;
+            }
+        }
+        stateFlags.push_back(flags);
+
+        for (size_t cls = 0; cls < classCount; ++cls) {
+            unsigned char b = representative[cls];
+            vector<uint32_t> next;
+            for (uint32_t packed : states[current]) {
+                size_t g = packed >> 16;
+                size_t position = packed & 0xFFFF;
+                const auto& tokens = globs[g].tokens;
+                if (position < tokens.size() && tokens[position].bytes.test(b)) {
+                    addWithClosure(globs, g, tokens[position].repeat ? position : position + 1, next);
+                }
+            }
+            // Rows are appended in state order, so this lands at current * classCount + cls
+            transitions.push_back(intern(next));
+        }
+    }
+    monitorOut() << "Compiled " << rules.size() << " watch rules into " << states.size() << " DFA states" << endl;
+    return true;
+}
+
+int32_t RuleMatcher::run(int32_t state, string_view text) const {
+    for (unsigned char c : text) {
+        state = transitions[state * classCount + byteClass[c]];
+        if (state == 0) {
+            break;
+        }
+    }
+    return state;
+}
+
+bool RuleMatcher::matches(string_view path) const {
+    if (empty()) {
+        return false;
+    }
+    uint8_t flags = stateFlags[run(1, path)];
+    return (flags & INCLUDE_ACCEPT) && !(flags & EXCLUDE_ACCEPT);
+}
+
+bool RuleMatcher::mayMatchUnder(string_view directory) const {
+    if (empty()) {
+        return false;
+    }
+    int32_t state = run(1, directory);
+    if (directory.empty() || directory.back() != '/') {
+        state = run(state, "/");
+    }
+    return (stateFlags[state] & INCLUDE_LIVE) != 0;
+}
+
+bool loadWatchRules(const string& fileName, vector<string>& roots, vector<WatchRule>& rules) {
+    ifstream in(fileName);
+    if (!in.is_open()) {
+        return false;
+    }
+    string line;
+    while (getline(in, line)) {
+        istringstream iss(line);
+        string keyword;
+        if (!(iss >> keyword) || keyword[0] == '#') {
+            continue;
+        }
+        string value;
+        getline(iss >> ws, value);
+        if (value.empty()) {
+            monitorErr() << fileName << ": missing value after '" << keyword << "'" << endl;
+            continue;
+        }
+        if (keyword == "root") {
+            roots.push_back(value);
+        } else if (keyword == "include" || keyword == "exclude") {
+            rules.push_back({value, keyword == "include"});
+        } else {
+            monitorErr() << fileName << ": unknown keyword '" << keyword << "'" << endl;
+        }
+    }
+    return true;
+}
@@ -1,5 +1,12 @@
 #include "FileMonitor.h"
+#include "EventRing.h"
+#include "BackupStore.h"
+#include "Replication.h"
+#include "ChangeJournal.h"
+#include "Trace.h"
+#include "UI.h"
 #include "Utils.h" // Added for clearScreen
+#include <filesystem>
 #include <iostream>
 #include <unistd.h>
 #include <signal.h>
@@ -8,9 +15,15 @@
 #include <sstream>
 #include <fstream>
 #include <sys/stat.h>
+#include <vector>
+#include <deque>
+#include <stack>
+#include <ctime>
 
 using namespace std;
 
+namespace fs = std::filesystem;
+
 // Проверяет, существует ли другой процесс мониторинга
 bool isAnotherInstanceRunning(pid_t& existingPid) {
     ifstream lockFile("file_monitor.lock");
@@ -44,23 +57,306 @@ void createLockFile() {
     lockFile.close();
 }
 
-int main(int argc, char* argv[]) {
+// Removes a file by index (interactive mode)
+void removeFileByIndex(FileMonitor& monitor) {
+    vector<string> fileList = monitor.trackedFileList();
+
+    // Clear the terminal
     clearScreen();
-    FileMonitor monitor;
+
+    // Check if there are any tracked files
+    if (fileList.empty()) {
+        cout << "+------------------------------------------+\n";
+        cout << "| No files are being tracked.              |\n";
+        cout << "+------------------------------------------+\n";
+        cout << "Press Enter to continue...\n";
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        return;
+    }
+
+    // Display the list of tracked files with numbers
+    cout << "+------------------------------------------+\n";
+    cout << "| Select a file to remove:                 |\n";
+    cout << "+------------------------------------------+\n";
+    
+    const size_t maxDisplayLength = 36; // Maximum length for display
+    for (size_t i = 0; i < fileList.size(); ++i) {
+        string displayName = fs::path(fileList[i]).filename().string();
+        if (displayName.length() > maxDisplayLength) {
+            displayName = displayName.substr(0, maxDisplayLength - 3) + "...";
+        }
+        size_t paddingLength = maxDisplayLength - displayName.length();
+        string padding = (paddingLength > 0) ? string(paddingLength, ' ') : "";
+        cout << "| " << (i + 1) << ". " << displayName << padding << " |\n";
+    }
+    cout << "+------------------------------------------+\n";
+    cout << "| Enter the number of the file to remove   |\n";
+    cout << "| (or 0 to cancel):                        |\n";
+    cout << "+------------------------------------------+\n";
+    cout << "Choice: ";
+
+    // Read user input
+    string input;
+    getline(cin, input);
+    istringstream iss(input);
+    int choice;
+    
+    // Validate input
+    if (!(iss >> choice)) {
+        cout << "Invalid input: please enter a number.\n";
+        cout << "Press Enter to continue...\n";
+        cin.clear(); // Clear error flags
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        return;
+    }
+
+    // Check for extra input after the number
+    string remaining;
+    if (getline(iss, remaining) && !remaining.empty() && remaining.find_first_not_of(" \t") != string::npos) {
+        cout << "Invalid input: extra characters after the number.\n";
+        cout << "Press Enter to continue...\n";
+        cin.clear(); // Clear error flags
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        return;
+    }
+
+    // Handle the choice
+    if (choice == 0) {
+        cout << "Removal cancelled.\n";
+        cout << "Press Enter to continue...\n";
+        cin.clear(); // Clear error flags
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        return;
+    }
+
+    if (choice < 1 || choice > static_cast<int>(fileList.size())) {
+        cout << "Invalid choice: please select a number between 1 and " << fileList.size() << ".\n";
+        cout << "Press Enter to continue...\n";
+        cin.clear(); // Clear error flags
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        return;
+    }
+
+    // Remove the selected file
+    string fileToRemove = fileList[choice - 1];
+    cout << "Debug: Attempting to remove file: " << fileToRemove << endl;
+    monitor.removeFile(fileToRemove);
+    cout << "File removed: " << fileToRemove << "\n";
+    cout << "Press Enter to continue...\n";
+    cin.clear(); // Clear error flags
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    cout << "Debug: After ignore, returning to menu" << endl;
+}
+
+// Prints all tracked files
+void listTrackedFiles(const FileMonitor& monitor) {
+    vector<string> fileList = monitor.trackedFileList();
+    if (fileList.empty()) {
+        cout << "No files are being tracked." << endl;
+        return;
+    }
+
+    cout << "Tracked files:" << endl;
+    for (const auto& file : fileList) {
+        cout << " - " << file << endl;
+    }
+}
+
+// Publishes the monitor's events to the shared-memory ring for local subscribers
+void attachEventRing(FileMonitor& monitor, EventRingWriter& ring) {
+    if (ring.open()) {
+        monitor.subscribe([&ring](const EventBatch& batch) { ring.publish(batch); });
+    }
+}
+
+// Prints events from the shared-memory ring until the producer goes away
+int tailEventRing() {
+    EventRingReader reader;
+    if (!reader.open()) {
+        cerr << "Is file_monitor running with --publish-ring?" << endl;
+        return 1;
+    }
+    uint64_t reportedOverruns = 0;
+    while (reader.producerAlive()) {
+        reader.poll([](const RingEvent& event) {
+            cout << event.sequence << " " << event.timestampNs << " 0x" << hex << event.mask << dec
+                 << " " << event.path << ((event.flags & RING_PATH_TRUNCATED) ? "..." : "") << endl;
+        });
+        if (reader.overruns() != reportedOverruns) {
+            cout << "Lost " << reader.overruns() - reportedOverruns << " events (consumer too slow)" << endl;
+            reportedOverruns = reader.overruns();
+        }
+        reader.wait(1000);
+    }
+    cout << "Producer exited." << endl;
+    return 0;
+}
+
+// Asks the running monitor to re-read file_monitor.conf (see MonitorConfig.h)
+int requestConfigReloadFromDaemon() {
+    pid_t pid;
+    if (!isAnotherInstanceRunning(pid)) {
+        cerr << "No running monitor found in file_monitor.lock" << endl;
+        return 1;
+    }
+    if (kill(pid, SIGHUP) == -1) {
+        perror("kill");
+        return 1;
+    }
+    cout << "Requested a reload of " << MONITOR_CONFIG_DEFAULT_PATH << " from PID " << pid << endl;
+    return 0;
+}
+
+// Asks the running monitor to write its trace spans (see Trace.h)
+int requestTraceDump() {
+#ifndef FILE_MONITOR_TRACING
+    cerr << "Tracing is not compiled in (build with -DFILE_MONITOR_TRACING)" << endl;
+    return 1;
+#endif
+    pid_t pid;
+    if (!isAnotherInstanceRunning(pid)) {
+        cerr << "No running monitor found in file_monitor.lock" << endl;
+        return 1;
+    }
+    if (kill(pid, SIGUSR2) == -1) {
+        perror("kill");
+        return 1;
+    }
+    cout << "Requested a trace dump to " << TRACE_DEFAULT_PATH << " from PID " << pid << endl;
+    return 0;
+}
+
+// Epoch seconds or local "YYYY-MM-DD[ HH:MM[:SS]]"; returns false if unparsable
+bool parseChangeTime(const string& text, int64_t& timeNs) {
+    if (!text.empty() && text.find_first_not_of("0123456789") == string::npos) {
+        timeNs = stoll(text) * 1000000000LL;
+        return true;
+    }
+    for (const char* format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"}) {
+        tm local = {};
+        const char* end = strptime(text.c_str(), format, &local);
+        if (end && *end == '\0') {
+            local.tm_isdst = -1;
+            timeNs = static_cast<int64_t>(mktime(&local)) * 1000000000LL;
+            return true;
+        }
+    }
+    return false;
+}
+
+// --changes [prefix] [--from time] [--to time] [--limit n]: changes in the
+// old changes.log format, reading only the segments in the time range
+int queryChangeJournal(int argc, char* argv[], int first) {
+    ChangeQuery query;
+    for (int i = first; i < argc; ++i) {
+        string arg = argv[i];
+        if ((arg == "--from" || arg == "--to") && i + 1 < argc) {
+            if (!parseChangeTime(argv[++i], arg == "--from" ? query.fromNs : query.toNs)) {
+                cerr << "Unrecognized time: " << argv[i] << " (use epoch seconds or \"YYYY-MM-DD HH:MM:SS\")" << endl;
+                return 1;
+            }
+        } else if (arg == "--limit" && i + 1 < argc) {
+            query.limit = stoul(argv[++i]);
+        } else if (query.prefix.empty() && arg.compare(0, 2, "--") != 0) {
+            query.prefix = arg;
+        } else {
+            cerr << "Usage: " << argv[0] << " --changes [path prefix] [--from time] [--to time] [--limit n]" << endl;
+            return 1;
+        }
+    }
+    long long found = queryChanges(CHANGE_JOURNAL_DEFAULT_DIR, query, [](const ChangeEntry& entry) {
+        writeChangeLine(cout, entry);
+    });
+    if (found < 0) {
+        cerr << "No change journal in " << CHANGE_JOURNAL_DEFAULT_DIR << "/" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --export-changes [file]: the whole journal as text, for tools reading changes.log
+int exportChangeJournal(const char* path) {
+    ofstream file;
+    if (path) {
+        file.open(path, ios::trunc);
+        if (!file.is_open()) {
+            cerr << "Cannot write " << path << endl;
+            return 1;
+        }
+    }
+    ostream& out = path ? file : cout;
+    long long exported = queryChanges(CHANGE_JOURNAL_DEFAULT_DIR, ChangeQuery(), [&out](const ChangeEntry& entry) {
+        writeChangeLine(out, entry);
+    });
+    if (exported < 0) {
+        cerr << "No change journal in " << CHANGE_JOURNAL_DEFAULT_DIR << "/" << endl;
+        return 1;
+    }
+    if (path) {
+        cout << "Exported " << exported << " changes to " << path << endl;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
     bool background = false;
+    bool publishRing = false;
+    FileMonitorOptions monitorOptions;
 
-    // Check for --background flag
+    // Check for command line flags
     for (int i = 1; i < argc; ++i) {
-        if (string(argv[i]) == "--background") {
+        string arg = argv[i];
+        if (arg == "--background") {
             background = true;
-            break;
+        } else if (arg == "--publish-ring") {
+            publishRing = true;
+        } else if (arg == "--tail-ring") {
+            return tailEventRing();
+        } else if (arg == "--changes") {
+            return queryChangeJournal(argc, argv, i + 1);
+        } else if (arg == "--export-changes") {
+            return exportChangeJournal(i + 1 < argc ? argv[i + 1] : nullptr);
+        } else if (arg == "--reload") {
+            return requestConfigReloadFromDaemon();
+        } else if (arg == "--dump-trace") {
+            return requestTraceDump();
+        } else if (arg == "--restore") {
+            if (i + 2 >= argc) {
+                cerr << "Usage: " << argv[0] << " --restore <backup> <destination>" << endl;
+                return 1;
+            }
+            return restoreBackup(argv[i + 1], argv[i + 2]) ? 0 : 1;
+        } else if (arg == "--fanotify") {
+            monitorOptions.engine = WatchEngine::Fanotify; // falls back to inotify without root
+        } else if (arg == "--replicate" && i + 1 < argc) {
+            monitorOptions.replication.target = argv[++i];
+        } else if (arg == "--replicate-limit" && i + 1 < argc) {
+            monitorOptions.replication.bandwidthLimit = stoull(argv[++i]) * 1024; // KiB/s
+        } else if (arg == "--max-burst-root-depth" && i + 1 < argc) {
+            monitorOptions.burst.maxRootDepth = stoull(argv[++i]);
+        } else if (arg == "--replica-peer") {
+            if (i + 2 >= argc) {
+                cerr << "Usage: " << argv[0] << " --replica-peer [host:]port <directory>" << endl;
+                return 1;
+            }
+            return runReplicationPeer(argv[i + 1], argv[i + 2]);
         }
     }
 
-    if (background) {
-        // Ignore SIGHUP to prevent termination when terminal closes
-        signal(SIGHUP, SIG_IGN);
+    clearScreen();
+    installTraceDumpSignal();
+    EventRingWriter ring; // declared first so it outlives the monitor's subscriber
+    FileMonitor monitor(monitorOptions);
+    // Every mode below may write file_monitor.lock, which --reload signals:
+    // SIGHUP reloads file_monitor.conf instead of terminating
+    installConfigReloadSignal();
+    deque<string> dirHistory;
+    stack<string> backStack;
+    if (publishRing) {
+        attachEventRing(monitor, ring);
+    }
 
+    if (background) {
         // Detach from terminal
         setsid();
 
@@ -122,14 +418,14 @@ int main(int argc, char* argv[]) {
             switch (choice) {
                 case 1:
                     clearScreen(); // Clear the terminal before adding a file
-                    filePath = monitor.browseAndSelectFile();
+                    filePath = browseAndSelectFileImpl(".", dirHistory, backStack);
                     if (!filePath.empty()) {
                         monitor.addFile(filePath);
                     }
                     break;
                 case 2:
                     clearScreen(); // Clear the terminal before removing a file
-                    monitor.removeFileByIndex();
+                    removeFileByIndex(monitor);
                     break;
                 case 3: {
                     pid_t existingPid;
@@ -148,7 +444,7 @@ int main(int argc, char* argv[]) {
                     break;
                 case 5:
                     clearScreen(); // Clear the terminal before listing files
-                    monitor.listTrackedFiles();
+                    listTrackedFiles(monitor);
                     cout << "Press Enter to continue...\n";
                     cin.ignore(numeric_limits<streamsize>::max(), '\n');
                     break;
@@ -158,14 +454,13 @@ int main(int argc, char* argv[]) {
                         exit(0); // Завершаем программу, если мониторинг не активен
                     }
                     cout << "Switching to background mode..." << endl;
+                    // The child opens the journals again; an inherited descriptor would keep them locked
+                    monitor.shutdown();
                     pid_t pid = fork();
                     if (pid < 0) {
                         cerr << "Fork failed!" << endl;
                         exit(1);
                     } else if (pid == 0) { // Child process
-                        // Ignore SIGHUP to prevent termination when terminal closes
-                        signal(SIGHUP, SIG_IGN);
-
                         // Detach from terminal
                         setsid();
 
@@ -176,7 +471,13 @@ int main(int argc, char* argv[]) {
                         freopen("file_monitor.err", "a", stderr);
 
                         // Reinitialize FileMonitor in child process
-                        FileMonitor backgroundMonitor;
+                        installTraceDumpSignal();
+                        EventRingWriter backgroundRing;
+                        FileMonitor backgroundMonitor(monitorOptions);
+                        installConfigReloadSignal();
+                        if (publishRing) {
+                            attachEventRing(backgroundMonitor, backgroundRing);
+                        }
                         // Создаём файл блокировки перед началом мониторинга
                         createLockFile();
                         backgroundMonitor.startMonitoring();
@@ -0,0 +1,140 @@
+#include "Test.h"
+#include "ChangeJournal.h"
+#include "FileMonitor.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+int64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// "path>backup" per match, in the order queryChanges visits them
+string query(const ChangeQuery& changeQuery, long long* matched = nullptr) {
+    string result;
+    long long count = queryChanges(CHANGE_JOURNAL_DEFAULT_DIR, changeQuery, [&](const ChangeEntry& entry) {
+        result.append(entry.path).append(">").append(entry.backupPath).append(" ");
+    });
+    if (matched) {
+        *matched = count;
+    }
+    return result;
+}
+
+ChangeQuery byPrefix(const string& prefix) {
+    ChangeQuery changeQuery;
+    changeQuery.prefix = prefix;
+    return changeQuery;
+}
+
+// Like the background switch in main.cpp: a forked child opens the journal
+// and records into it; true if it got the binary journal
+bool recordFromChild(const string& path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        ChangeJournal changes;
+        bool opened = changes.open(ChangeJournalOptions());
+        changes.record(path, "backups/child.1", ChangeKind::Backup);
+        changes.close();
+        _Exit(opened ? 0 : 1);
+    }
+    int status = 0;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+} // namespace
+
+TEST(changeJournalQueriesByPath) {
+    ChangeJournal changes;
+    CHECK(changes.open(ChangeJournalOptions()));
+    CHECK(changes.record("/etc/hosts", "backups/hosts.1", ChangeKind::Backup));
+    CHECK(changes.record("/etcd/data", "backups/data.1", ChangeKind::Backup));
+    CHECK(changes.record("/etc/ssh/sshd_config", "backups/sshd_config.1", ChangeKind::Snapshot));
+    CHECK(changes.record("/etc/hosts", "backups/hosts.2", ChangeKind::Backup));
+
+    // The open segment is read without its index
+    CHECK_EQ(query(byPrefix("/etc")), "/etc/hosts>backups/hosts.1 /etc/ssh/sshd_config>backups/sshd_config.1 "
+                                      "/etc/hosts>backups/hosts.2 ");
+    changes.close();
+
+    // Sealed: the same answers through the index
+    long long matched = 0;
+    CHECK_EQ(query(byPrefix("/etc/hosts"), &matched), "/etc/hosts>backups/hosts.1 /etc/hosts>backups/hosts.2 ");
+    CHECK_EQ(matched, 2);
+    CHECK_EQ(query(byPrefix("/etcd")), "/etcd/data>backups/data.1 ");
+    CHECK_EQ(query(byPrefix("/var")), "");
+    CHECK(!query(byPrefix(""), &matched).empty());
+    CHECK_EQ(matched, 4);
+
+    ChangeQuery limited = byPrefix("/etc");
+    limited.limit = 1;
+    CHECK_EQ(query(limited), "/etc/hosts>backups/hosts.1 ");
+}
+
+TEST(changeJournalQueriesByTimeAcrossSegments) {
+    ChangeJournalOptions options;
+    options.segmentDuration = chrono::seconds(1);
+    ChangeJournal changes;
+    CHECK(changes.open(options));
+    CHECK(changes.record("/srv/a", "backups/a.1", ChangeKind::Backup));
+    const int64_t between = nowNs();
+    this_thread::sleep_for(chrono::milliseconds(1100));  // the next record starts a new segment
+    CHECK(changes.record("/srv/b", "backups/b.1", ChangeKind::Backup));
+    const int64_t after = nowNs();
+
+    ChangeQuery early = byPrefix("/srv");
+    early.toNs = between;
+    ChangeQuery late = byPrefix("/srv");
+    late.fromNs = between;
+    ChangeQuery future = byPrefix("/srv");
+    future.fromNs = after + 1;
+    for (int pass = 0; pass < 2; ++pass) {  // open segment, then everything sealed
+        CHECK_EQ(query(early), "/srv/a>backups/a.1 ");
+        CHECK_EQ(query(late), "/srv/b>backups/b.1 ");
+        CHECK_EQ(query(future), "");
+        CHECK_EQ(query(byPrefix("/srv")), "/srv/a>backups/a.1 /srv/b>backups/b.1 ");
+        changes.close();
+    }
+}
+
+TEST(changeJournalRefusesASecondWriter) {
+    ChangeJournal first;
+    ChangeJournal second;
+    CHECK(first.open(ChangeJournalOptions()));
+    CHECK(!second.open(ChangeJournalOptions()));
+    CHECK(first.record("/srv/a", "backups/a.1", ChangeKind::Backup));
+    CHECK(second.record("/srv/b", "backups/b.1", ChangeKind::Backup));  // goes to changes.log
+    first.close();
+    CHECK_EQ(query(byPrefix("/srv")), "/srv/a>backups/a.1 ");
+    ifstream log("changes.log");
+    stringstream text;
+    text << log.rdbuf();
+    CHECK(text.str().find("/srv/b") != string::npos);
+}
+
+TEST(changeJournalPassesToAForkedMonitor) {
+    FileMonitorOptions options;
+    options.compactBackups = false;
+    options.journalBackups = false;
+    options.persistTrackedFiles = false;
+    options.configPath = "";
+    options.inotifyShards = 1;
+    options.pinReaders = false;
+    FileMonitor monitor(options);
+
+    // The child's descriptor shares the open file, and with it the lock
+    CHECK(!recordFromChild("/srv/early"));
+    monitor.shutdown();
+    CHECK(recordFromChild("/srv/late"));
+    CHECK_EQ(query(byPrefix("/srv")), "/srv/late>backups/child.1 ");
+}
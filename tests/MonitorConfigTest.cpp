@@ -0,0 +1,140 @@
+#include "Test.h"
+#include "MonitorConfig.h"
+#include "FileMonitor.h"
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+string removedLines(const string& before, const string& after) {
+    string removed;
+    string added;
+    diffConfigLines(before, after, removed, added);
+    return removed;
+}
+
+string addedLines(const string& before, const string& after) {
+    string removed;
+    string added;
+    diffConfigLines(before, after, removed, added);
+    return added;
+}
+
+MonitorConfig configFrom(const string& text) {
+    ofstream("file_monitor.conf", ios::trunc) << text;
+    MonitorConfig config;
+    loadMonitorConfig("file_monitor.conf", config);
+    return config;
+}
+
+bool isTracked(const FileMonitor& monitor, const string& filePath) {
+    vector<string> tracked = monitor.trackedFileList();
+    return find(tracked.begin(), tracked.end(), filePath) != tracked.end();
+}
+
+// A monitor that touches nothing outside the scratch directory
+FileMonitorOptions quietOptions() {
+    FileMonitorOptions options;
+    options.backups = false;
+    options.compactBackups = false;
+    options.persistTrackedFiles = false;
+    options.configPath = "";
+    options.inotifyShards = 1;
+    options.pinReaders = false;
+    return options;
+}
+
+} // namespace
+
+TEST(diffConfigLinesFindsEditedLines) {
+    const string before = "file /a\nfile /b\nfile /c\n";
+    CHECK_EQ(removedLines(before, before), "");
+    CHECK_EQ(addedLines(before, before), "");
+    CHECK_EQ(addedLines(before, "file /a\nfile /x\nfile /b\nfile /c\n"), "file /x\n");
+    CHECK_EQ(removedLines(before, "file /a\nfile /x\nfile /b\nfile /c\n"), "");
+    CHECK_EQ(removedLines(before, "file /a\nfile /c\n"), "file /b\n");
+    CHECK_EQ(removedLines(before, "file /a\npoll /b\nfile /c\n"), "file /b\n");
+    CHECK_EQ(addedLines(before, "file /a\npoll /b\nfile /c\n"), "poll /b\n");
+    CHECK_EQ(addedLines("", before), before);
+    CHECK_EQ(removedLines(before, ""), before);
+}
+
+TEST(diffConfigLinesReportsFarMovesAsRemovedAndAdded) {
+    string before = "file /moved\n";
+    string after;
+    for (int i = 0; i < 100; ++i) {
+        before += "file /f" + to_string(i) + "\n";
+        after += "file /f" + to_string(i) + "\n";
+    }
+    after += "file /moved\n";
+    CHECK_EQ(removedLines(before, after), "file /moved\n");
+    CHECK_EQ(addedLines(before, after), "file /moved\n");
+}
+
+TEST(loadMonitorConfigParsesDirectives) {
+    MonitorConfig config = configFrom("# comment\nfile /etc/hosts\npoll /mnt/nfs/app.conf\nroot /srv\n"
+                                      "include *.conf\nexclude **/cache/**\npolicy /srv/logs/** nobackup\n");
+    CHECK_EQ(config.files.size(), 2u);
+    if (config.files.size() == 2) {
+        CHECK_EQ(string(config.files[0].path), "/etc/hosts");
+        CHECK(!config.files[0].poll);
+        CHECK(config.files[1].poll);
+    }
+    CHECK_EQ(config.roots.size(), 1u);
+    CHECK_EQ(config.rules.size(), 2u);
+    CHECK_EQ(config.policies.size(), 1u);
+}
+
+TEST(applyConfigAddsAndDropsListedFiles) {
+    const string dir = fs::current_path().string();
+    for (const char* name : {"a", "b", "c"}) {
+        ofstream(dir + "/" + name) << name;
+    }
+    FileMonitor monitor(quietOptions());
+    CHECK(monitor.applyConfig(configFrom("file " + dir + "/a\nfile " + dir + "/b\n")));
+    CHECK(isTracked(monitor, dir + "/a"));
+    CHECK(isTracked(monitor, dir + "/b"));
+
+    CHECK(monitor.applyConfig(configFrom("file " + dir + "/b\npoll " + dir + "/c\n")));
+    CHECK(!isTracked(monitor, dir + "/a"));
+    CHECK(isTracked(monitor, dir + "/b"));
+    CHECK(isTracked(monitor, dir + "/c"));
+
+    // A listed file that merely moved stays tracked
+    CHECK(monitor.applyConfig(configFrom("poll " + dir + "/c\nfile " + dir + "/b\n")));
+    CHECK(isTracked(monitor, dir + "/b"));
+    CHECK(isTracked(monitor, dir + "/c"));
+}
+
+TEST(applyConfigKeepsFilesTrackedBeforeIt) {
+    const string dir = fs::current_path().string();
+    ofstream(dir + "/a") << "a";
+    FileMonitor monitor(quietOptions());
+    monitor.addFile(dir + "/a");
+    CHECK(monitor.applyConfig(configFrom("file " + dir + "/a\n")));
+    CHECK(monitor.applyConfig(configFrom("")));
+    CHECK(isTracked(monitor, dir + "/a"));
+}
+
+TEST(applyConfigRepairsDriftOnReload) {
+    const string dir = fs::current_path().string();
+    ofstream(dir + "/a") << "a";
+    const string text = "file " + dir + "/a\nfile " + dir + "/later\n";
+    FileMonitor monitor(quietOptions());
+    CHECK(monitor.applyConfig(configFrom(text)));
+    CHECK(isTracked(monitor, dir + "/a"));
+    CHECK(!isTracked(monitor, dir + "/later"));
+
+    // Removed from the menu and created after the first attempt: the same
+    // config text brings both back
+    monitor.removeFile(dir + "/a");
+    ofstream(dir + "/later") << "later";
+    CHECK(monitor.applyConfig(configFrom(text)));
+    CHECK(isTracked(monitor, dir + "/a"));
+    CHECK(isTracked(monitor, dir + "/later"));
+}
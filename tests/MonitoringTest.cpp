@@ -0,0 +1,45 @@
+#include "Test.h"
+#include "Monitoring.h"
+#include "ChangeJournal.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <thread>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+TEST(backupFileKeepsSameNamedFilesApart) {
+    // Eight files called "config" backed up at once, almost surely within one second
+    vector<string> sources;
+    for (int i = 0; i < 8; ++i) {
+        fs::create_directories("src" + to_string(i));
+        sources.push_back("src" + to_string(i) + "/config");
+        ofstream(sources.back()) << "copy " << i;
+    }
+    ChangeJournal changes;
+    CHECK(changes.open(ChangeJournalOptions()));
+    vector<string> backupPaths(sources.size());
+    vector<thread> workers;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        workers.emplace_back([&, i]() {
+            ostringstream log;
+            backupFile(sources[i], changes, log, &backupPaths[i]);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    set<string> contents;
+    for (const auto& path : backupPaths) {
+        ifstream in(path);
+        stringstream text;
+        text << in.rdbuf();
+        contents.insert(text.str());
+    }
+    CHECK_EQ(set<string>(backupPaths.begin(), backupPaths.end()).size(), sources.size());
+    CHECK_EQ(contents.size(), sources.size());
+}
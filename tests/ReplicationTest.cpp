@@ -0,0 +1,86 @@
+#include "Test.h"
+#include "Replication.h"
+#include "BackupStore.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void writeFile(const string& path, const string& contents) {
+    ofstream(path, ios::binary) << contents;
+}
+
+string readFile(const string& path) {
+    ifstream in(path, ios::binary);
+    ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+// Replicates backupPaths to a directory target and waits for the acknowledgement
+bool replicate(const string& directory, const vector<string>& backupPaths) {
+    ReplicationOptions options;
+    options.target = directory;
+    Replicator replicator(options);
+    if (!replicator.start()) {
+        return false;
+    }
+    replicator.enqueue(backupPaths);
+    for (int i = 0; i < 500 && replicator.stats().acknowledged < backupPaths.size(); ++i) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    bool done = replicator.stats().acknowledged == backupPaths.size();
+    replicator.stop();
+    return done;
+}
+
+} // namespace
+
+TEST(replicatedCompressedVersionRestores) {
+    // Five versions of one file: the compactor keeps three raw and compresses
+    // the two oldest with a dictionary trained on the raw ones
+    fs::create_directories("backups");
+    vector<string> versions;
+    for (int day = 1; day <= 5; ++day) {
+        string path = "backups/notes.txt_2026-01-0" + to_string(day) + " 10:00:00";
+        string contents;
+        for (int line = 0; line < 200; ++line) {
+            contents += "line " + to_string(line) + " of the notes, revision " + to_string(day) + "\n";
+        }
+        writeFile(path, contents);
+        versions.push_back(path);
+    }
+    const string original = readFile(versions[0]);
+    BackupCompactor().runOnce();
+    const string compressed = versions[0] + BACKUP_COMPRESSED_SUFFIX;
+    CHECK(fs::exists(compressed));
+    CHECK(!backupDictionaryPath(compressed).empty());
+
+    // Queued under its raw name, sent as the .fmz together with its dictionary
+    CHECK(replicate("replica", {versions[0]}));
+    CHECK(fs::exists("replica/notes.txt_2026-01-01 10:00:00.fmz"));
+
+    // The replica alone must be enough to restore it
+    fs::rename("backups", "original");
+    CHECK(restoreBackup("replica/notes.txt_2026-01-01 10:00:00.fmz", "restored.txt"));
+    CHECK(readFile("restored.txt") == original);
+}
+
+TEST(rejectedVersionDoesNotBlockTheQueue) {
+    fs::create_directories("backups/sub");
+    writeFile("backups/sub/first", "first");
+    writeFile("backups/second", "second");
+    // A file where the replica needs a directory: the first version can never be stored
+    fs::create_directories("replica");
+    writeFile("replica/sub", "in the way");
+
+    CHECK(replicate("replica", {"backups/sub/first", "backups/second"}));
+    CHECK_EQ(readFile("replica/second"), "second");
+    CHECK_EQ(readFile("replication_rejected.log"), "1 backups/sub/first\n");
+}
@@ -0,0 +1,43 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <iostream>
+#include <vector>
+
+// Minimal harness for the library tests: TEST(name) { CHECK(...); } defines
+// a case, TestMain.cpp runs every case in a scratch directory and fails if
+// any check did.
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+std::vector<TestCase>& testCases();
+int& testFailures();
+
+#define TEST(name)                                                                        \
+    static void name();                                                                   \
+    [[maybe_unused]] static const bool name##Registered = (testCases().push_back({#name, name}), true); \
+    static void name()
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+            ++testFailures();                                                             \
+        }                                                                                 \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                                        \
+    do {                                                                                  \
+        const auto& actualValue = (actual);                                               \
+        const auto& expectedValue = (expected);                                           \
+        if (!(actualValue == expectedValue)) {                                            \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #actual " is " << actualValue \
+                      << ", expected " << expectedValue << std::endl;                     \
+            ++testFailures();                                                             \
+        }                                                                                 \
+    } while (0)
+
+#endif // TEST_H
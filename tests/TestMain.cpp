@@ -0,0 +1,52 @@
+#include "Test.h"
+#include "Log.h"
+#include <filesystem>
+#include <sstream>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+vector<TestCase>& testCases() {
+    static vector<TestCase> cases;
+    return cases;
+}
+
+int& testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+// Each case runs in its own empty directory, since the library writes
+// backups/, changes/ and its logs relative to the working directory
+int main() {
+    char scratch[] = "/tmp/file_monitor_tests.XXXXXX";
+    if (!mkdtemp(scratch)) {
+        cerr << "Cannot create a scratch directory" << endl;
+        return 1;
+    }
+    ostringstream log;
+    setMonitorOutput(&log, &log);
+    int failed = 0;
+    for (const auto& test : testCases()) {
+        const fs::path directory = fs::path(scratch) / test.name;
+        fs::create_directories(directory);
+        fs::current_path(directory);
+        log.str("");
+        const int before = testFailures();
+        test.run();
+        if (testFailures() != before) {
+            cerr << "FAIL " << test.name << "\n" << log.str();
+            ++failed;
+        } else {
+            cout << "ok   " << test.name << endl;
+        }
+    }
+    fs::current_path("/");
+    error_code ec;
+    fs::remove_all(scratch, ec);
+    cout << testCases().size() - failed << " of " << testCases().size() << " tests passed" << endl;
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+#include "Test.h"
+#include "WatchRules.h"
+#include <fstream>
+
+using namespace std;
+
+TEST(ruleMatcherStarStaysInOneDirectory) {
+    RuleMatcher matcher;
+    CHECK(matcher.compile({{"/srv/*.conf", true}}));
+    CHECK(matcher.matches("/srv/app.conf"));
+    CHECK(!matcher.matches("/srv/app/app.conf"));
+    CHECK(!matcher.matches("/srv/app.confx"));
+}
+
+TEST(ruleMatcherUnanchoredPatternsMatchAtAnyDepth) {
+    RuleMatcher matcher;
+    CHECK(matcher.compile({{"*.conf", true}, {"*.yaml", true}}));
+    CHECK(matcher.matches("/a.conf"));
+    CHECK(matcher.matches("/srv/deep/down/b.yaml"));
+    CHECK(!matcher.matches("/srv/c.json"));
+}
+
+TEST(ruleMatcherExcludeWins) {
+    RuleMatcher matcher;
+    CHECK(matcher.compile({{"*.conf", true}, {"**/cache/**", false}}));
+    CHECK(matcher.matches("/srv/a.conf"));
+    CHECK(matcher.matches("/srv/cache.conf"));
+    CHECK(!matcher.matches("/srv/x/cache/a.conf"));
+    CHECK(!matcher.matches("/srv/x/cache/d/e/a.conf"));
+
+    // A single star only reaches files directly inside cache
+    CHECK(matcher.compile({{"*.conf", true}, {"*/cache/*", false}}));
+    CHECK(!matcher.matches("/srv/cache/a.conf"));
+    CHECK(matcher.matches("/srv/cache/d/a.conf"));
+}
+
+TEST(ruleMatcherClassesAndEscapes) {
+    RuleMatcher matcher;
+    CHECK(matcher.compile({{"/log/app[0-9].txt", true}, {"/log/[!a-z]*.bak", true}, {"/q/\\*", true}}));
+    CHECK(matcher.matches("/log/app7.txt"));
+    CHECK(!matcher.matches("/log/appx.txt"));
+    CHECK(matcher.matches("/log/1.bak"));
+    CHECK(!matcher.matches("/log/a.bak"));
+    CHECK(matcher.matches("/q/*"));
+    CHECK(!matcher.matches("/q/x"));
+}
+
+TEST(ruleMatcherRejectsMalformedPatterns) {
+    RuleMatcher matcher;
+    CHECK(!matcher.compile({{"/srv/[abc", true}}));
+    CHECK(matcher.empty());
+    CHECK(!matcher.compile({{"/srv/trailing\\", true}}));
+}
+
+TEST(ruleMatcherPrunesDirectories) {
+    RuleMatcher matcher;
+    CHECK(matcher.compile({{"/srv/app/**/*.conf", true}}));
+    CHECK(matcher.mayMatchUnder("/srv"));
+    CHECK(matcher.mayMatchUnder("/srv/app/x"));
+    CHECK(!matcher.mayMatchUnder("/home"));
+}
+
+TEST(loadWatchRulesReadsRootsAndGlobs) {
+    ofstream("watch_rules.txt") << "# comment\nroot /srv\ninclude *.conf\nexclude **/cache/**\n";
+    vector<string> roots;
+    vector<WatchRule> rules;
+    CHECK(loadWatchRules("watch_rules.txt", roots, rules));
+    CHECK_EQ(roots.size(), 1u);
+    CHECK_EQ(rules.size(), 2u);
+    if (rules.size() == 2) {
+        CHECK_EQ(rules[0].pattern, "*.conf");
+        CHECK(rules[0].include);
+        CHECK(!rules[1].include);
+    }
+}